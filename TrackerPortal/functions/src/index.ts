@@ -1,6 +1,9 @@
-import { onRequest } from "firebase-functions/v2/https";
+import { onRequest, Request } from "firebase-functions/v2/https";
+import type { Response } from "express";
 import * as logger from "firebase-functions/logger";
 import * as admin from "firebase-admin";
+import { createHash } from "crypto";
+import { MSGPACK_TYPE, decodeMsgPack, encodeMsgPack } from "./msgpack";
 
 admin.initializeApp();
 const db = admin.firestore();
@@ -8,6 +11,7 @@ const { Timestamp, FieldValue } = admin.firestore;
 
 const DEVICE_TOKEN = process.env.DEVICE_TOKEN || "";
 const THERMOSTAT_TOKEN = process.env.THERMOSTAT_TOKEN || DEVICE_TOKEN;
+const THERMOSTAT_HISTORY_BATCH_MAX = 450;
 const DEFAULT_THERMOSTAT_CONFIG = {
   setpointF: 70,
   diffF: 1,
@@ -231,6 +235,8 @@ export const config = onRequest(
 interface ThermostatIngestRequest {
   deviceId?: string;
   ts?: number | string | admin.firestore.Timestamp;
+  seq?: number | string;
+  base?: number | string;
   tempF?: number | string;
   humidity?: number | string;
   heatIndexF?: number | string;
@@ -252,6 +258,10 @@ interface ThermostatIngestRequest {
   scheduleSetpoint?: number | string;
   overrideActive?: boolean | string | number;
   history?: Array<{ ts?: number | string | admin.firestore.Timestamp; tempF?: number | string; setpointF?: number | string }>;
+  runtime?: ThermostatRuntimeRaw & {
+    hours?: Array<ThermostatRuntimeRaw & { hour?: number | string }>;
+    previous?: ThermostatRuntimeRaw;
+  };
   config?: {
     setpointF?: number | string;
     diffF?: number | string;
@@ -289,6 +299,33 @@ interface ThermostatHistoryPoint {
   setpointF: number | null;
 }
 
+interface ThermostatRuntimeRaw {
+  day?: number | string;
+  heatSec?: number | string;
+  coolSec?: number | string;
+  fanSec?: number | string;
+  heatCycles?: number | string;
+  coolCycles?: number | string;
+  fanCycles?: number | string;
+}
+
+interface ThermostatRuntimeCounters {
+  heatSec: number;
+  coolSec: number;
+  fanSec: number;
+  heatCycles: number;
+  coolCycles: number;
+  fanCycles: number;
+  avgHeatCycleSec: number | null;
+  avgCoolCycleSec: number | null;
+  avgFanCycleSec: number | null;
+}
+
+interface ThermostatRuntimeDay extends ThermostatRuntimeCounters {
+  day: string;
+  hours?: Record<string, ThermostatRuntimeCounters>;
+}
+
 interface ThermostatConfigShape {
   setpointF: number;
   diffF: number;
@@ -330,27 +367,48 @@ export const thermostatIngest = onRequest(
       return;
     }
 
-    const body = (req.body ?? {}) as ThermostatIngestRequest;
+    const body = readDeviceBody<ThermostatIngestRequest>(req);
+    if (!body) {
+      res.status(400).json({ error: "Malformed body" });
+      return;
+    }
     const deviceId = (body.deviceId || "").trim();
     if (!deviceId) {
       res.status(400).json({ error: "Missing deviceId" });
       return;
     }
 
-    const status = normalizeThermostatStatus(body);
-    const history = normalizeThermostatHistory(body);
+    // A push with `base` is a delta against the status the device last had acknowledged
+    // as seq `base`; it only carries changed fields.
+    const seq = toNullableNumber(body.seq);
+    const base = toNullableNumber(body.base);
+    const isDelta = base !== null;
+    // Firestore batches cap at 500 writes; anything beyond is left unacked for the next request.
+    const history = normalizeThermostatHistory(body, !isDelta)
+      .sort((a, b) => a.ts.toMillis() - b.ts.toMillis())
+      .slice(0, THERMOSTAT_HISTORY_BATCH_MAX);
+    const runtime = normalizeThermostatRuntime(body);
 
     try {
       const ref = db.collection("thermostats").doc(deviceId);
       const snap = await ref.get();
       const existing = snap.exists ? snap.data() : undefined;
       const existingConfig = normalizeThermostatConfig(existing?.config);
+      // A delta is still merged when we missed its base, but the device is asked to follow
+      // up with a full push so fields from the lost update get corrected.
+      const resync = isDelta && (!existing?.status || toNullableNumber(existing?.statusSeq) !== base);
+      const status = isDelta
+        ? normalizeThermostatStatusDelta(body, existing?.status)
+        : normalizeThermostatStatus(body);
 
       const update: Record<string, unknown> = {
         name: existing?.name ?? deviceId,
         updatedAt: FieldValue.serverTimestamp(),
         status
       };
+      if (seq !== null) {
+        update.statusSeq = seq;
+      }
       if (!existing?.config) {
         update.config = existingConfig;
       }
@@ -362,9 +420,15 @@ export const thermostatIngest = onRequest(
         const histRef = ref.collection("history").doc(id);
         batch.set(histRef, point, { merge: true });
       });
+      // Device counters are cumulative per local day, so the latest report simply replaces them.
+      runtime.forEach((day) => {
+        batch.set(ref.collection("runtime").doc(day.day), { ...day, updatedAt: FieldValue.serverTimestamp() }, { merge: true });
+      });
       await batch.commit();
 
-      res.status(200).json({ status: "ok", deviceId });
+      // Devices advance their upload cursor to ackTs (epoch seconds of the newest stored point).
+      const ackTs = history.reduce((max, point) => Math.max(max, Math.floor(point.ts.toMillis() / 1000)), 0);
+      sendDevice(req, res, 200, { status: "ok", deviceId, ackTs: ackTs || null, seq, resync });
       return;
     } catch (err) {
       logger.error("Thermostat ingest failure", err as Error);
@@ -381,7 +445,8 @@ export const thermostatConfig = onRequest(
   },
   async (req, res) => {
     res.set("Access-Control-Allow-Origin", "*");
-    res.set("Access-Control-Allow-Headers", "Content-Type, X-Device-Token");
+    res.set("Access-Control-Allow-Headers", "Content-Type, X-Device-Token, If-None-Match");
+    res.set("Access-Control-Expose-Headers", "ETag");
 
     if (req.method === "OPTIONS") {
       res.status(204).send("");
@@ -412,8 +477,23 @@ export const thermostatConfig = onRequest(
         const snap = await ref.get();
         const data = snap.data();
         const configValue = normalizeThermostatConfig(data?.config);
-        res.status(200).json({
+        // The revision is derived from the config itself, so writes from the portal that
+        // bypass this function still change it. Devices send it back as If-None-Match
+        // (or ?rev=) and get an empty 304 while nothing changed.
+        const rev = thermostatConfigRev(configValue);
+        const known = (req.get("If-None-Match") || (req.query.rev as string) || "")
+          .replace(/^W\//, "")
+          .replace(/"/g, "")
+          .trim();
+        res.set("ETag", `"${rev}"`);
+        res.set("Cache-Control", "no-cache");
+        if (known === rev) {
+          res.status(304).end();
+          return;
+        }
+        sendDevice(req, res, 200, {
           deviceId,
+          rev,
           config: configValue,
           serverTime: Date.now()
         });
@@ -426,7 +506,11 @@ export const thermostatConfig = onRequest(
     }
 
     if (req.method === "POST") {
-      const body = (req.body ?? {}) as ThermostatIngestRequest;
+      const body = readDeviceBody<ThermostatIngestRequest>(req);
+      if (!body) {
+        res.status(400).json({ error: "Malformed body" });
+        return;
+      }
       const deviceId = (body.deviceId || "").trim();
       if (!deviceId) {
         res.status(400).json({ error: "Missing deviceId" });
@@ -444,7 +528,7 @@ export const thermostatConfig = onRequest(
           },
           { merge: true }
         );
-        res.status(200).json({ status: "ok", deviceId });
+        sendDevice(req, res, 200, { status: "ok", deviceId });
         return;
       } catch (err) {
         logger.error("Thermostat config update failed", err as Error);
@@ -579,6 +663,28 @@ function serializeConfig(cfg: typeof DEFAULT_CONFIG) {
   };
 }
 
+// Thermostats built with CLOUD_WIRE_MSGPACK post application/msgpack; everything else
+// arrives as JSON already parsed by the framework. Returns null for an undecodable body.
+function readDeviceBody<T>(req: Request): T | null {
+  if (!req.is(MSGPACK_TYPE)) return (req.body ?? {}) as T;
+  try {
+    const decoded = decodeMsgPack(req.rawBody);
+    return (decoded && typeof decoded === "object" && !Array.isArray(decoded) ? decoded : {}) as T;
+  } catch (err) {
+    logger.warn("Malformed msgpack body", err as Error);
+    return null;
+  }
+}
+
+// Replies in msgpack to devices that ask for it with Accept, JSON otherwise.
+function sendDevice(req: Request, res: Response, status: number, payload: unknown): void {
+  if ((req.get("Accept") || "").includes(MSGPACK_TYPE)) {
+    res.status(status).type(MSGPACK_TYPE).send(encodeMsgPack(payload));
+    return;
+  }
+  res.status(status).json(payload);
+}
+
 function estimateBytes(req: { rawBody?: Buffer | string; body?: unknown }): number {
   if (req.rawBody) {
     return typeof req.rawBody === "string" ? Buffer.byteLength(req.rawBody, "utf8") : req.rawBody.length;
@@ -679,7 +785,31 @@ function normalizeThermostatStatus(body: ThermostatIngestRequest): ThermostatSta
   };
 }
 
-function normalizeThermostatHistory(body: ThermostatIngestRequest): ThermostatHistoryPoint[] {
+// Only the fields present in a delta push are returned, so the merge write keeps every
+// other stored value. wifi is a nested map, so its members merge one by one. Devices
+// leave uptime out of deltas; it is advanced by the time since the stored status.
+function normalizeThermostatStatusDelta(body: ThermostatIngestRequest, previous: unknown): Record<string, unknown> {
+  const full = normalizeThermostatStatus(body);
+  const raw = body as unknown as Record<string, unknown>;
+  const out: Record<string, unknown> = { ts: full.ts };
+  (Object.keys(full) as Array<keyof ThermostatStatus>).forEach((key) => {
+    if (key !== "ts" && key !== "wifi" && raw[key] !== undefined) out[key] = full[key];
+  });
+  const wifi: Record<string, unknown> = {};
+  (["ssid", "rssi", "ip"] as const).forEach((key) => {
+    if (raw[key] !== undefined) wifi[key] = full.wifi[key];
+  });
+  if (Object.keys(wifi).length) out.wifi = wifi;
+  const prev = (previous || {}) as Partial<ThermostatStatus>;
+  if (raw.uptimeSec === undefined && typeof prev.uptimeSec === "number" && prev.ts instanceof Timestamp) {
+    out.uptimeSec = prev.uptimeSec + Math.max(0, Math.round((full.ts.toMillis() - prev.ts.toMillis()) / 1000));
+  }
+  return out;
+}
+
+// Delta status pushes only name what changed, so they must not fall back to a point
+// built from the top-level fields (allowStatusPoint false).
+function normalizeThermostatHistory(body: ThermostatIngestRequest, allowStatusPoint = true): ThermostatHistoryPoint[] {
   const points: ThermostatHistoryPoint[] = [];
   const history = Array.isArray(body.history) ? body.history : [];
   history.forEach((raw) => {
@@ -690,7 +820,7 @@ function normalizeThermostatHistory(body: ThermostatIngestRequest): ThermostatHi
     points.push({ ts, tempF, setpointF });
   });
 
-  if (!points.length) {
+  if (!points.length && allowStatusPoint) {
     const ts = parseTimestamp(body.ts);
     const tempF = toNullableNumber(body.tempF);
     const setpointF = toNullableNumber(body.setpointF);
@@ -702,6 +832,58 @@ function normalizeThermostatHistory(body: ThermostatIngestRequest): ThermostatHi
   return points;
 }
 
+function normalizeRuntimeCounters(raw: ThermostatRuntimeRaw): ThermostatRuntimeCounters {
+  const heatSec = Math.max(0, toNumber(raw.heatSec, 0));
+  const coolSec = Math.max(0, toNumber(raw.coolSec, 0));
+  const fanSec = Math.max(0, toNumber(raw.fanSec, 0));
+  const heatCycles = Math.max(0, toNumber(raw.heatCycles, 0));
+  const coolCycles = Math.max(0, toNumber(raw.coolCycles, 0));
+  const fanCycles = Math.max(0, toNumber(raw.fanCycles, 0));
+  return {
+    heatSec,
+    coolSec,
+    fanSec,
+    heatCycles,
+    coolCycles,
+    fanCycles,
+    avgHeatCycleSec: heatCycles ? Math.round(heatSec / heatCycles) : null,
+    avgCoolCycleSec: coolCycles ? Math.round(coolSec / coolCycles) : null,
+    avgFanCycleSec: fanCycles ? Math.round(fanSec / fanCycles) : null
+  };
+}
+
+// Device days are local YYYYMMDD numbers; stored as "YYYY-MM-DD" document ids.
+function normalizeRuntimeDay(raw: unknown): string | null {
+  const n = toNumber(raw, 0);
+  if (!Number.isInteger(n) || n < 20000101 || n > 29991231) return null;
+  const s = String(n);
+  return `${s.slice(0, 4)}-${s.slice(4, 6)}-${s.slice(6, 8)}`;
+}
+
+function normalizeThermostatRuntime(body: ThermostatIngestRequest): ThermostatRuntimeDay[] {
+  const runtime = body.runtime;
+  if (!runtime || typeof runtime !== "object") return [];
+  const days: ThermostatRuntimeDay[] = [];
+
+  const today = normalizeRuntimeDay(runtime.day);
+  if (today) {
+    const hours: Record<string, ThermostatRuntimeCounters> = {};
+    (Array.isArray(runtime.hours) ? runtime.hours : []).forEach((raw) => {
+      const hour = toNumber(raw.hour, -1);
+      if (!Number.isInteger(hour) || hour < 0 || hour > 23) return;
+      hours[String(hour)] = normalizeRuntimeCounters(raw);
+    });
+    days.push({ day: today, ...normalizeRuntimeCounters(runtime), hours });
+  }
+
+  const previous = runtime.previous;
+  const previousDay = previous ? normalizeRuntimeDay(previous.day) : null;
+  if (previous && previousDay && previousDay !== today) {
+    days.push({ day: previousDay, ...normalizeRuntimeCounters(previous) });
+  }
+  return days;
+}
+
 function normalizeThermostatConfig(
   input: unknown,
   fallback?: unknown
@@ -717,6 +899,10 @@ function normalizeThermostatConfig(
   };
 }
 
+function thermostatConfigRev(config: ThermostatConfigShape): string {
+  return createHash("sha1").update(JSON.stringify(config)).digest("hex").slice(0, 16);
+}
+
 function normalizeThermostatSchedule(
   input: unknown,
   fallback?: Array<Array<number | null>>
@@ -0,0 +1,192 @@
+// Minimal MessagePack codec for device payloads (ArduinoJson's serializeMsgPack /
+// deserializeMsgPack on the firmware side). Covers nil, bool, ints, float32/64, str,
+// bin, array and map; ext types are rejected.
+
+export const MSGPACK_TYPE = "application/msgpack";
+
+export function decodeMsgPack(buf: Buffer): unknown {
+  let pos = 0;
+
+  const need = (n: number) => {
+    if (pos + n > buf.length) throw new Error("msgpack: truncated input");
+  };
+  const str = (n: number) => {
+    need(n);
+    const s = buf.toString("utf8", pos, pos + n);
+    pos += n;
+    return s;
+  };
+  const bin = (n: number) => {
+    need(n);
+    const b = buf.subarray(pos, pos + n);
+    pos += n;
+    return Buffer.from(b);
+  };
+  const array = (n: number): unknown[] => {
+    const out: unknown[] = [];
+    for (let i = 0; i < n; i++) out.push(next());
+    return out;
+  };
+  const map = (n: number): Record<string, unknown> => {
+    const out: Record<string, unknown> = {};
+    for (let i = 0; i < n; i++) {
+      const key = next();
+      out[String(key)] = next();
+    }
+    return out;
+  };
+  const u = (n: 1 | 2 | 4 | 8): number => {
+    need(n);
+    let v: number;
+    if (n === 1) v = buf.readUInt8(pos);
+    else if (n === 2) v = buf.readUInt16BE(pos);
+    else if (n === 4) v = buf.readUInt32BE(pos);
+    else v = Number(buf.readBigUInt64BE(pos));
+    pos += n;
+    return v;
+  };
+  const i = (n: 1 | 2 | 4 | 8): number => {
+    need(n);
+    let v: number;
+    if (n === 1) v = buf.readInt8(pos);
+    else if (n === 2) v = buf.readInt16BE(pos);
+    else if (n === 4) v = buf.readInt32BE(pos);
+    else v = Number(buf.readBigInt64BE(pos));
+    pos += n;
+    return v;
+  };
+
+  function next(): unknown {
+    need(1);
+    const b = buf[pos++];
+    if (b <= 0x7f) return b;
+    if (b >= 0xe0) return b - 0x100;
+    if ((b & 0xf0) === 0x80) return map(b & 0x0f);
+    if ((b & 0xf0) === 0x90) return array(b & 0x0f);
+    if ((b & 0xe0) === 0xa0) return str(b & 0x1f);
+    switch (b) {
+      case 0xc0: return null;
+      case 0xc2: return false;
+      case 0xc3: return true;
+      case 0xc4: return bin(u(1));
+      case 0xc5: return bin(u(2));
+      case 0xc6: return bin(u(4));
+      case 0xca: {
+        need(4);
+        const v = buf.readFloatBE(pos);
+        pos += 4;
+        return v;
+      }
+      case 0xcb: {
+        need(8);
+        const v = buf.readDoubleBE(pos);
+        pos += 8;
+        return v;
+      }
+      case 0xcc: return u(1);
+      case 0xcd: return u(2);
+      case 0xce: return u(4);
+      case 0xcf: return u(8);
+      case 0xd0: return i(1);
+      case 0xd1: return i(2);
+      case 0xd2: return i(4);
+      case 0xd3: return i(8);
+      case 0xd9: return str(u(1));
+      case 0xda: return str(u(2));
+      case 0xdb: return str(u(4));
+      case 0xdc: return array(u(2));
+      case 0xdd: return array(u(4));
+      case 0xde: return map(u(2));
+      case 0xdf: return map(u(4));
+      default:
+        throw new Error(`msgpack: unsupported type 0x${b.toString(16)}`);
+    }
+  }
+
+  const value = next();
+  if (pos !== buf.length) throw new Error("msgpack: trailing bytes");
+  return value;
+}
+
+// Integers go out in the smallest encoding; other numbers as float64 so config values
+// round-trip exactly. undefined object members are skipped, like JSON.stringify.
+export function encodeMsgPack(value: unknown): Buffer {
+  const parts: Buffer[] = [];
+  const head = (bytes: number[]) => parts.push(Buffer.from(bytes));
+
+  const len = (n: number, fix: number, fixMax: number, c8: number | null, c16: number, c32: number) => {
+    if (n <= fixMax) head([fix | n]);
+    else if (c8 !== null && n <= 0xff) head([c8, n]);
+    else if (n <= 0xffff) head([c16, n >> 8, n & 0xff]);
+    else {
+      const b = Buffer.alloc(5);
+      b[0] = c32;
+      b.writeUInt32BE(n, 1);
+      parts.push(b);
+    }
+  };
+
+  const num = (v: number) => {
+    if (Number.isInteger(v) && Math.abs(v) <= 0xffffffff) {
+      if (v >= 0 && v <= 0x7f) return head([v]);
+      if (v < 0 && v >= -32) return head([v & 0xff]);
+      const b = Buffer.alloc(5);
+      if (v >= 0) {
+        if (v <= 0xff) return head([0xcc, v]);
+        if (v <= 0xffff) return head([0xcd, v >> 8, v & 0xff]);
+        b[0] = 0xce;
+        b.writeUInt32BE(v, 1);
+        return parts.push(b);
+      }
+      if (v >= -0x80) return head([0xd0, v & 0xff]);
+      if (v >= -0x8000) return head([0xd1, (v >> 8) & 0xff, v & 0xff]);
+      if (v >= -0x80000000) {
+        b[0] = 0xd2;
+        b.writeInt32BE(v, 1);
+        return parts.push(b);
+      }
+    }
+    const b = Buffer.alloc(9);
+    b[0] = 0xcb;
+    b.writeDoubleBE(v, 1);
+    parts.push(b);
+  };
+
+  function put(v: unknown): void {
+    if (v === null || v === undefined) return head([0xc0]);
+    if (typeof v === "boolean") return head([v ? 0xc3 : 0xc2]);
+    if (typeof v === "number") {
+      if (!Number.isFinite(v)) return head([0xc0]);
+      return num(v);
+    }
+    if (typeof v === "string") {
+      const s = Buffer.from(v, "utf8");
+      len(s.length, 0xa0, 31, 0xd9, 0xda, 0xdb);
+      parts.push(s);
+      return;
+    }
+    if (Buffer.isBuffer(v)) {
+      len(v.length, 0xc4, -1, 0xc4, 0xc5, 0xc6);
+      parts.push(v);
+      return;
+    }
+    if (Array.isArray(v)) {
+      len(v.length, 0x90, 15, null, 0xdc, 0xdd);
+      v.forEach(put);
+      return;
+    }
+    if (typeof v === "object") {
+      const entries = Object.entries(v as Record<string, unknown>).filter(([, x]) => x !== undefined);
+      len(entries.length, 0x80, 15, null, 0xde, 0xdf);
+      entries.forEach(([k, x]) => {
+        put(k);
+        put(x);
+      });
+      return;
+    }
+    throw new Error(`msgpack: cannot encode ${typeof v}`);
+  }
+
+  put(value);
+  return Buffer.concat(parts);
+}
@@ -0,0 +1,82 @@
+// Round-trip and wire-format tests for src/msgpack.ts. Fixtures are the bytes ArduinoJson's
+// serializeMsgPack produces on the thermostat, so a codec change that breaks the device
+// shows up here. Run with `npm test`.
+import { strict as assert } from "node:assert";
+import { test } from "node:test";
+import { decodeMsgPack, encodeMsgPack } from "../src/msgpack";
+
+const hex = (s: string) => Buffer.from(s.replace(/\s+/g, ""), "hex");
+
+// {"id":"th-01","temp":72.5,"ts":1760000000,"rssi":-61,"runtime":{"heat":300,"cool":0}}
+// as ArduinoJson writes it: float32 for 72.5, uint32 for ts, int8 for rssi, a nested fixmap.
+const STATUS_FIXTURE = hex(`
+  85
+  a2 6964             a5 74682d3031
+  a4 74656d70         ca 42910000
+  a2 7473             ce 68e77800
+  a4 72737369         d0 c3
+  a7 72756e74696d65   82 a4 68656174 cd 012c
+                         a4 636f6f6c 00
+`);
+
+test("decodes an ArduinoJson status document", () => {
+  assert.deepEqual(decodeMsgPack(STATUS_FIXTURE), {
+    id: "th-01",
+    temp: 72.5,
+    ts: 1760000000,
+    rssi: -61,
+    runtime: { heat: 300, cool: 0 },
+  });
+});
+
+test("decodes float32 values to the nearest double", () => {
+  // 71.3 is not exact in float32; the device sends ca 428e999a.
+  const v = decodeMsgPack(hex("ca 428e999a")) as number;
+  assert.ok(Math.abs(v - 71.3) < 1e-4, `got ${v}`);
+  assert.equal(decodeMsgPack(hex("ca c0200000")), -2.5);
+});
+
+test("decodes every integer width ArduinoJson emits", () => {
+  assert.equal(decodeMsgPack(hex("ce ffffffff")), 0xffffffff);
+  assert.equal(decodeMsgPack(hex("cf 0000000100000000")), 0x100000000);
+  assert.equal(decodeMsgPack(hex("d2 80000000")), -0x80000000);
+  assert.equal(decodeMsgPack(hex("d1 8000")), -0x8000);
+  assert.equal(decodeMsgPack(hex("e0")), -32);
+  assert.equal(decodeMsgPack(hex("7f")), 127);
+});
+
+test("round-trips integers across encoding boundaries", () => {
+  const values = [0, 1, 127, 128, 255, 256, 65535, 65536, 0xffffffff, -1, -32, -33, -128, -129,
+    -32768, -32769, -0x80000000, 0x100000000, -0x80000001, 1.5, -0.25, 1e-7];
+  for (const v of values) assert.equal(decodeMsgPack(encodeMsgPack(v)), v, `value ${v}`);
+});
+
+test("round-trips a config document with nullable schedule cells", () => {
+  const schedule = Array.from({ length: 7 }, (_, d) =>
+    Array.from({ length: 24 }, (_, h) => (h % 6 === 0 ? 68 + d * 0.5 : null)));
+  const config = { setpoint: 70.5, diff: 1, mode: "heat", fanUntil: 0, rev: "a".repeat(40), schedule };
+  assert.deepEqual(decodeMsgPack(encodeMsgPack(config)), config);
+});
+
+test("encodes non-finite numbers and undefined members as JSON would", () => {
+  assert.deepEqual(decodeMsgPack(encodeMsgPack({ a: NaN, b: Infinity, c: undefined, d: [undefined] })),
+    { a: null, b: null, d: [null] });
+});
+
+test("round-trips strings, arrays and maps past their fix sizes", () => {
+  const big: Record<string, unknown> = {};
+  for (let i = 0; i < 20; i++) big[`k${i}`] = i * 1000;
+  const value = { s: "x".repeat(300), arr: Array.from({ length: 40 }, (_, i) => i - 20), big, bin: Buffer.from([1, 2, 3]) };
+  assert.deepEqual(decodeMsgPack(encodeMsgPack(value)), value);
+});
+
+test("rejects truncated input at every cut point", () => {
+  for (let n = 0; n < STATUS_FIXTURE.length; n++) {
+    assert.throws(() => decodeMsgPack(STATUS_FIXTURE.subarray(0, n)), /truncated/, `cut at ${n}`);
+  }
+});
+
+test("rejects trailing bytes and ext types", () => {
+  assert.throws(() => decodeMsgPack(hex("c0 c0")), /trailing/);
+  assert.throws(() => decodeMsgPack(hex("d4 01 02")), /unsupported/);
+});
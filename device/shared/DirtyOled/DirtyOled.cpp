@@ -0,0 +1,81 @@
+#include "DirtyOled.h"
+#include <stdlib.h>
+#include <string.h>
+
+// One I2C write carries the 0x40 data prefix plus this many pixel bytes.
+#if defined(I2C_BUFFER_LENGTH)
+static const size_t DIRTYOLED_CHUNK = (I2C_BUFFER_LENGTH > 129 ? 129 : I2C_BUFFER_LENGTH) - 1;
+#else
+static const size_t DIRTYOLED_CHUNK = 31; // AVR Wire buffer is 32
+#endif
+
+// Same clock during and after transfers: the panel is the bus owner in these projects, so
+// there is no point bouncing between speeds on every command.
+DirtyOled::DirtyOled(uint8_t w, uint8_t h, TwoWire *twi, int8_t rstPin, uint32_t hz)
+    : Adafruit_SSD1306(w, h, twi, rstPin, hz, hz), bus(twi), busHz(hz) {}
+
+DirtyOled::~DirtyOled() {
+  free(shadow);
+}
+
+bool DirtyOled::begin(uint8_t switchvcc, uint8_t i2caddr, bool reset, bool periphBegin) {
+  if (!Adafruit_SSD1306::begin(switchvcc, i2caddr, reset, periphBegin)) return false;
+  addr = i2caddr ? i2caddr : (height() == 32 ? 0x3C : 0x3D); // same default as the base class
+  size_t bytes = (size_t)width() * ((height() + 7) / 8);
+  if (!shadow) shadow = (uint8_t *)malloc(bytes);
+  if (!shadow) return false;
+  fullPending = true;
+  return true;
+}
+
+bool DirtyOled::display() {
+  uint8_t *buf = getBuffer();
+  if (!shadow || !buf) {
+    Adafruit_SSD1306::display();
+    return true;
+  }
+  const uint8_t w = (uint8_t)width();
+  const uint8_t pages = (uint8_t)((height() + 7) / 8);
+  bool sent = false;
+  bus->setClock(busHz);
+  for (uint8_t page = 0; page < pages; page++) {
+    const uint8_t *row = buf + (size_t)page * w;
+    uint8_t *shadowRow = shadow + (size_t)page * w;
+    int first = 0;
+    int last = w - 1;
+    if (!fullPending) {
+      while (first < w && row[first] == shadowRow[first]) first++;
+      if (first == w) continue;
+      while (row[last] == shadowRow[last]) last--;
+    }
+    sendSpan(page, (uint8_t)first, (uint8_t)last, row + first);
+    memcpy(shadowRow + first, row + first, (size_t)(last - first + 1));
+    sent = true;
+  }
+  fullPending = false;
+  if (sent) flushCount++;
+  else skipCount++;
+  return sent;
+}
+
+void DirtyOled::sendSpan(uint8_t page, uint8_t col0, uint8_t col1, const uint8_t *data) {
+  // Horizontal addressing (set by begin()): the window wraps inside page..page, col0..col1.
+  // All six command bytes go in one transfer behind a single 0x00 control byte.
+  const uint8_t window[] = {SSD1306_PAGEADDR, page, page, SSD1306_COLUMNADDR, col0, col1};
+  bus->beginTransmission(addr);
+  bus->write((uint8_t)0x00);
+  bus->write(window, sizeof(window));
+  bus->endTransmission();
+  byteCount += sizeof(window) + 1;
+  size_t len = (size_t)(col1 - col0 + 1);
+  while (len > 0) {
+    size_t n = len < DIRTYOLED_CHUNK ? len : DIRTYOLED_CHUNK;
+    bus->beginTransmission(addr);
+    bus->write((uint8_t)0x40);
+    bus->write(data, n);
+    bus->endTransmission();
+    data += n;
+    len -= n;
+    byteCount += n + 1;
+  }
+}
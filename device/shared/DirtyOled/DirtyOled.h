@@ -0,0 +1,39 @@
+#pragma once
+#include <Arduino.h>
+#include <Wire.h>
+#include <Adafruit_SSD1306.h>
+
+// Drop-in Adafruit_SSD1306 (I2C) that keeps a shadow of what the panel holds. display()
+// compares the framebuffer against it page by page and sends only the column span that
+// changed in each 8-row page, so an unchanged frame costs no bus traffic at all. Draw
+// with the usual GFX calls; clearDisplay() + redraw is fine, only real changes go out.
+//
+// busHz is the I2C clock used for every transfer to the panel. SSD1306 is specified for
+// 400 kHz but most modules run at Fast-mode Plus (1 MHz); drop back if the image tears.
+class DirtyOled : public Adafruit_SSD1306 {
+ public:
+  DirtyOled(uint8_t w, uint8_t h, TwoWire *twi = &Wire, int8_t rstPin = -1, uint32_t busHz = 400000UL);
+  ~DirtyOled();
+
+  bool begin(uint8_t switchvcc = SSD1306_SWITCHCAPVCC, uint8_t i2caddr = 0x3C, bool reset = true, bool periphBegin = true);
+  // Sends the changed spans; returns false when nothing had changed.
+  bool display();
+  // Forces the next display() to resend the whole frame (e.g. after a panel reset).
+  void invalidate() { fullPending = true; }
+
+  uint32_t flushes() const { return flushCount; }
+  uint32_t skipped() const { return skipCount; }
+  uint32_t bytesSent() const { return byteCount; }
+
+ private:
+  void sendSpan(uint8_t page, uint8_t col0, uint8_t col1, const uint8_t *data);
+
+  TwoWire *bus;
+  uint8_t addr = 0;
+  uint32_t busHz;
+  uint8_t *shadow = nullptr;
+  bool fullPending = true;
+  uint32_t flushCount = 0;
+  uint32_t skipCount = 0;
+  uint32_t byteCount = 0;
+};
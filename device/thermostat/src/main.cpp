@@ -2,17 +2,27 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <HTTPClient.h>
-#include <WebServer.h>
+#include <ESPAsyncWebServer.h>
 #include <Preferences.h>
 #include <Wire.h>
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
+#include <DirtyOled.h>
 #include <time.h>
 #include <math.h>
 #include "DHT.h"
+#include "web_assets.h"
 #include <ArduinoJson.h>
 #include <SPI.h>
 #include <SD.h>
+#include <atomic>
+#include <memory>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <driver/rmt.h>
+#include <esp_netif.h>
+#include <lwip/dhcp.h>
 
 #if __has_include("secrets.h")
 #include "secrets.h"
@@ -25,6 +35,9 @@
 #ifndef WIFI_PASSWORD
 #define WIFI_PASSWORD "Koda2020"
 #endif
+#ifndef WIFI_REUSE_LEASE
+#define WIFI_REUSE_LEASE 0 // 1 = fast reconnects reuse the cached DHCP lease while it is safely valid
+#endif
 #ifndef THERMOSTAT_DEVICE_ID
 #define THERMOSTAT_DEVICE_ID "home"
 #endif
@@ -37,6 +50,9 @@
 #ifndef THERMOSTAT_CONFIG_URL
 #define THERMOSTAT_CONFIG_URL "https://us-central1-wurdemaniot.cloudfunctions.net/thermostatConfig"
 #endif
+#ifndef CLOUD_WIRE_MSGPACK
+#define CLOUD_WIRE_MSGPACK 0 // 1 = status, history and config travel as application/msgpack
+#endif
 
 const char *DEFAULT_WIFI_SSID = WIFI_SSID;
 const char *DEFAULT_WIFI_PASSWORD = WIFI_PASSWORD;
@@ -44,13 +60,14 @@ const char *THERMOSTAT_DEVICE_ID_STR = THERMOSTAT_DEVICE_ID;
 const char *THERMOSTAT_DEVICE_TOKEN_STR = THERMOSTAT_DEVICE_TOKEN;
 const char *THERMOSTAT_INGEST_ENDPOINT = THERMOSTAT_INGEST_URL;
 const char *THERMOSTAT_CONFIG_ENDPOINT = THERMOSTAT_CONFIG_URL;
+const char *CLOUD_WIRE_TYPE = CLOUD_WIRE_MSGPACK ? "application/msgpack" : "application/json";
 const char *AUTHORIZED_SSID = "WurdemanIoT"; // network required for control changes
 const char *ADMIN_USER = "admin";
 const char *ADMIN_PASSWORD = "change-me";
 const char *AP_SSID = "Thermostat-Setup";
 const char *AP_PASSWORD = "";
-const char *HEADER_KEYS[] = {"Cookie"};
-const size_t HEADER_KEYS_COUNT = 1;
+const char *HEADER_KEYS[] = {"Cookie", "If-None-Match"};
+const size_t HEADER_KEYS_COUNT = 2;
 
 // Pins (Arduino Nano ESP32 board labels)
 const int HEAT_PIN = D12; // heat relay output
@@ -68,6 +85,7 @@ long tzOffsetSec = 0;
 int dstOffsetSec = 0;
 
 const unsigned long WIFI_CONNECT_TIMEOUT_MS = 15000;
+const unsigned long WIFI_FAST_JOIN_TIMEOUT_MS = 3000; // cached BSSID/channel join, then fall back to a scan
 const unsigned long WIFI_RECONNECT_INTERVAL_MS = 30000;
 
 // Control defaults
@@ -88,35 +106,448 @@ bool sdReady = false;
 const bool DEBUG_SERIAL = true;
 const unsigned long HEALTH_LOG_INTERVAL_MS = 30000;
 const unsigned long SENSOR_FAIL_LOG_INTERVAL_MS = 10000;
-unsigned long lastHealthLog = 0;
 unsigned long lastSensorFailLog = 0;
 unsigned long lastSdWriteMs = 0;
 bool lastSdWriteOk = true;
 const char* lastSdError = "none";
 unsigned long sdWriteFailures = 0;
-const unsigned long CLOUD_PUSH_INTERVAL_MS = 60000;
+
+// Buffered append-only SD logging: records collect in a RAM block and go to the card in
+// whole 512-byte sectors (or on a timer) through a handle that stays open. A card error
+// unmounts and schedules a remount instead of disabling SD until reboot.
+const size_t SD_SECTOR_BYTES = 512;
+const size_t SDLOG_BUF_BYTES = 2 * SD_SECTOR_BYTES;
+const unsigned long SDLOG_FLUSH_MS = 300000;    // a partial sector waits at most 5 minutes
+const unsigned long SDLOG_SERVICE_MS = 1000;
+const unsigned long SD_REMOUNT_MIN_MS = 5000;
+const unsigned long SD_REMOUNT_MAX_MS = 300000;
+
+struct SdLog {
+  const char *base;        // file path, or the prefix of <base>-YYYYMMDD.csv when daily
+  bool daily;
+  bool (*create)(SdLog &log) = nullptr; // writes a header when the opened file is empty
+  File file{};
+  char openPath[32] = "";
+  uint32_t day = 0;          // YYYYMMDD the buffered records belong to, 0 before NTP sync
+  uint32_t fileBytes = 0;    // size of the open file, to keep writes sector-aligned
+  alignas(4) uint8_t buf[SDLOG_BUF_BYTES] = {};
+  size_t used = 0;
+  unsigned long oldestMs = 0; // millis() when the buffer last went from empty to non-empty
+  unsigned long flushes = 0;
+  unsigned long bytesWritten = 0;
+  unsigned long lastFlushBytes = 0;
+  unsigned long lastWriteUs = 0;
+  unsigned long worstWriteUs = 0;
+  unsigned long drops = 0;
+};
+
+SdLog historyLog = {"/history", true};
+bool sdEverMounted = false;
+unsigned long sdRemountAtMs = 0;
+unsigned long sdRemountBackoffMs = SD_REMOUNT_MIN_MS;
+unsigned long sdRemounts = 0;
+// Status goes up when something a user would notice changes (see StatusTrigger), at most
+// once per STATUS_EVENT_SPACING_MS so bursts coalesce, and otherwise as a keepalive.
+const unsigned long STATUS_EVENT_SPACING_MS = 10000;
+const unsigned long STATUS_KEEPALIVE_MS = 300000;
+const uint16_t STATUS_FULL_EVERY = 30;       // pushes between full status resyncs
+const int32_t STATUS_RSSI_DELTA_DB = 3;      // smaller RSSI wander is not worth a field
 const unsigned long CONFIG_FETCH_INTERVAL_MS = 120000;
 const unsigned long CONFIG_PUSH_INTERVAL_MS = 15000;
 unsigned long lastCloudPush = 0;
+bool uploadLastBatchFull = false;  // the last push carried a full history batch
 unsigned long lastConfigFetch = 0;
 unsigned long lastConfigPush = 0;
 bool configDirty = false;
-bool historyDirty = false;
-uint32_t lastHistTs = 0;
-float lastHistCtl = NAN;
-float lastHistSetpoint = NAN;
 uint32_t fanUntilEpoch = 0;
 
+// Cloud sync runs on its own FreeRTOS task; the main loop only exchanges fixed-size
+// structs with it through lock-free single-producer/single-consumer rings.
+const uint32_t CLOUD_TASK_STACK = 12288;
+const BaseType_t CLOUD_TASK_CORE = 0; // Arduino loop runs on core 1
+const unsigned long CLOUD_RETRY_MS = 10000;
+
+template <typename T, size_t N>
+struct SpscRing {
+  T items[N];
+  std::atomic<uint32_t> head{0}; // written only by the producer
+  std::atomic<uint32_t> tail{0}; // written only by the consumer
+
+  bool push(const T &v) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= N) return false;
+    items[h % N] = v;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+  T *front() {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return nullptr;
+    return &items[t % N];
+  }
+  void pop() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+};
+
+// Runtime accounting: heat/cool/fan on-seconds and cycle counts per local hour and day,
+// driven by the output states after each control pass. The store sits in RTC memory that
+// survives a soft reset and is checkpointed to NVS for power loss.
+const uint32_t RUNTIME_MAGIC = 0x314d5452; // "RTM1"
+const uint8_t RUNTIME_DAYS = 7;
+const unsigned long RUNTIME_PERSIST_MS = 600000;
+enum { RT_HEAT = 0, RT_COOL = 1, RT_FAN = 2 };
+
+struct RuntimeCounters {
+  uint32_t sec[3];     // indexed by RT_HEAT/RT_COOL/RT_FAN
+  uint16_t cycles[3];  // off->on transitions
+};
+
+struct RuntimeStore {
+  uint32_t magic;
+  uint32_t day;                         // local YYYYMMDD of today/hours, 0 before NTP sync
+  RuntimeCounters hours[24];
+  RuntimeCounters today;
+  uint32_t pastDay[RUNTIME_DAYS];       // newest first, 0 = empty
+  RuntimeCounters past[RUNTIME_DAYS];
+  uint32_t checksum;
+};
+
+RTC_NOINIT_ATTR RuntimeStore runtimeStore;
+Preferences runtimePrefs;
+uint8_t runtimeLastOn = 0;              // output bitmask at the previous tick
+uint8_t runtimeHour = 0;
+unsigned long runtimeLastTickMs = 0;
+uint32_t runtimeCarryMs[3] = {0, 0, 0};
+unsigned long runtimeLastPersistMs = 0;
+
+// Durable history upload queue: each sample is appended to a write-ahead file on SD and
+// drained in batches; the cursor advances when the server acknowledges a timestamp.
+// Without SD the RAM history ring is the (non-durable) source.
+const char *UPLOAD_WAL_PATH = "/upload.wal";
+const uint8_t UPLOAD_BATCH_MAX = 60;                    // points per thermostatIngest POST
+const uint32_t UPLOAD_MIN_VALID_TS = 1600000000UL;      // skip samples taken before NTP sync
+const uint32_t UPLOAD_WAL_COMPACT_BYTES = 16384;        // drop a fully acked WAL past this size
+const unsigned long UPLOAD_ACK_PERSIST_MS = 600000;     // NVS write throttle for the cursor
+SdLog walLog = {UPLOAD_WAL_PATH, false};
+
+struct HistoryPoint {
+  uint32_t ts;
+  int16_t temp10;
+  int16_t set10;
+};
+
+Preferences uploadPrefs;
+uint32_t uploadAckTs = 0;          // newest timestamp the server has stored
+uint32_t uploadPersistedAckTs = 0;
+unsigned long uploadLastPersistMs = 0;
+uint32_t uploadWalOffset = 0;      // first unacknowledged WAL byte
+uint32_t uploadWalSize = 0;
+bool uploadPending = false;        // a batch is queued or in flight
+uint32_t uploadPendingLastTs = 0;
+uint32_t uploadPendingEndOffset = 0;
+std::atomic<uint32_t> cloudBatchAckTs{0}; // set by the cloud task on a successful batch
+
+struct StatusSnapshot {
+  uint32_t ts;
+  float tempF;
+  float humidity;
+  float heatIndexF;
+  float setpointF;
+  float diffF;
+  char mode[8];
+  bool heatOn;
+  bool coolOn;
+  bool fanOn;
+  bool sensorOk;
+  bool sdOk;
+  bool scheduleActive;
+  bool overrideActive;
+  uint32_t fanUntil;
+  char ssid[33];
+  int32_t rssi;
+  char ip[16];
+  uint32_t uptimeSec;
+  char sdError[24];
+  float scheduleSetpoint;
+  uint32_t runtimeDay;
+  RuntimeCounters runtimeToday;
+  RuntimeCounters runtimeHours[24];
+  uint32_t runtimePastDay;              // yesterday, so its last minutes are not lost at rollover
+  RuntimeCounters runtimePast;
+  uint8_t historyCount;
+  HistoryPoint history[UPLOAD_BATCH_MAX];
+};
+
+// The server's copy of our status is the last push it acknowledged. Status pushes after
+// that carry only the fields that differ from it, plus `seq` and the `base` seq they were
+// diffed against; the ingest function merges them and asks for a full push (`resync`)
+// when its stored seq doesn't match `base`. Owned by the cloud task.
+struct StatusDelta {
+  StatusSnapshot acked;
+  bool valid;          // acked holds a push the server confirmed
+  bool resync;         // the server asked for a full push
+  uint32_t seq;        // last seq sent
+  uint32_t ackedSeq;
+  uint16_t sinceFull;
+  unsigned long fulls;
+  unsigned long deltas;
+  unsigned long resyncs;
+};
+
+// Outputs, mode, setpoint and health bits: a change here pushes status within a second.
+struct StatusTrigger {
+  bool heat;
+  bool cool;
+  bool fan;
+  bool sensorOk;
+  bool controlOk;
+  bool sdOk;
+  int16_t set10;
+  char mode[8];
+};
+
+struct ConfigSnapshot {
+  float setpointF;
+  float diffF;
+  char mode[8];
+  uint32_t fanUntil;
+  float schedule[7][24];
+};
+
+// Last local config, kept in NVS ("config") so a reboot resumes control before Wi-Fi and the
+// cloud are back. Bump CONFIG_STORE_VERSION whenever this layout changes; a mismatched or
+// corrupt record is ignored and the defaults stand.
+const uint32_t CONFIG_STORE_MAGIC = 0x43464753; // "CFGS"
+const uint16_t CONFIG_STORE_VERSION = 1;
+const unsigned long CONFIG_SAVE_DELAY_MS = 5000; // let a burst of edits settle into one write
+
+struct ConfigStore {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;
+  ConfigSnapshot cfg;
+  int32_t tzOffsetSec;
+  int32_t dstOffsetSec;
+  uint32_t crc;                         // CRC-32 of everything above
+};
+
+Preferences configPrefs;
+uint32_t configStoreCrc = 0;            // CRC of the record currently in NVS
+unsigned long configStoreDirtyMs = 0;   // 0 = nothing pending
+uint32_t configStoreWrites = 0;
+
+// Config as received from the cloud; has* flags mark which fields were present.
+struct RemoteConfig {
+  bool hasSetpoint;
+  bool hasDiff;
+  bool hasMode;
+  bool hasFanUntil;
+  bool hasSchedule;
+  uint8_t scheduleDayMask; // bit d set when schedule[d] was provided
+  float setpointF;
+  float diffF;
+  char mode[8];
+  uint32_t fanUntil;
+  float schedule[7][24];
+};
+
+// One keep-alive HTTPS connection per cloud host, owned by the cloud task.
+// WiFiClientSecure does not expose TLS session resumption, so reuse comes from
+// keeping the socket open between requests rather than from session tickets.
+const size_t CLOUD_MAX_HOSTS = 2;
+const uint32_t CLOUD_HANDSHAKE_TIMEOUT_S = 10;
+const uint16_t CLOUD_HTTP_TIMEOUT_MS = 8000;
+const unsigned long CLOUD_BACKOFF_MIN_MS = 2000;
+const unsigned long CLOUD_BACKOFF_MAX_MS = 120000;
+
+struct HttpsConn {
+  char host[64];
+  WiFiClientSecure client;
+  HTTPClient http;
+  bool open;
+  bool warm; // current request reuses an established connection
+  unsigned long requests;
+  unsigned long handshakes;
+  unsigned long reused;
+  unsigned long failures;
+  unsigned long backoffMs;
+  unsigned long nextAttemptMs;
+};
+
+HttpsConn cloudConns[CLOUD_MAX_HOSTS];
+StatusDelta statusDelta;
+StatusTrigger statusTriggerSent = {};  // as of the last queued push
+StatusTrigger statusTriggerSeen = {};  // as of the last tick
+unsigned long statusEventPushes = 0;
+unsigned long statusKeepalivePushes = 0;
+unsigned long statusCoalesced = 0;     // changes folded into an already pending push
+
+SpscRing<StatusSnapshot, 4> statusRing;     // main -> cloud
+SpscRing<ConfigSnapshot, 1> configOutbox;   // main -> cloud
+SpscRing<RemoteConfig, 1> configInbox;      // cloud -> main
+std::atomic<bool> cloudFetchRequested{false};
+std::atomic<bool> cloudConfigRevReset{false};
+std::atomic<bool> cloudConfigPushFailed{false};
+TaskHandle_t cloudTaskHandle = nullptr;
+volatile unsigned long cloudStatusPushes = 0;
+volatile unsigned long cloudConfigFetches = 0;
+volatile unsigned long cloudConfigUnchanged = 0;
+volatile uint32_t cloudConfigHeapLast = 0;  // heap held by the last config fetch/push, bytes
+volatile uint32_t cloudConfigHeapPeak = 0;
+volatile uint32_t cloudStatusBytes = 0;     // last status body on the wire
+volatile uint32_t cloudStatusSerializeUs = 0;
+volatile unsigned long cloudStatusFailures = 0;
+unsigned long cloudStatusDrops = 0;
+
 // OLED setup
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
-Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, -1);
+const uint32_t OLED_I2C_HZ = 1000000; // Fast-mode Plus; use 400000 if the panel garbles
+DirtyOled display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, -1, OLED_I2C_HZ);
 bool displayReady = false;
+char displayShown[96] = ""; // values behind the current frame; unchanged means no redraw
 
-// DHT setup
+// Only used for computeHeatIndex(); reads go through the RMT driver below.
 DHT dht(DHT_PIN, DHT22);
 
-WebServer server(80);
+// DHT22 on the RMT peripheral. taskSense() pulls the data line low, an esp_timer lets go
+// DHT_START_LOW_US later and arms RMT receive, and the 40-bit reply is timed by hardware
+// with interrupts left on. The next taskSense() decodes whatever landed in the ring buffer.
+#if CONFIG_IDF_TARGET_ESP32S3
+const rmt_channel_t DHT_RMT_CHANNEL = RMT_CHANNEL_4; // S3 receive channels are 4-7
+#else
+const rmt_channel_t DHT_RMT_CHANNEL = RMT_CHANNEL_0;
+#endif
+const uint64_t DHT_START_LOW_US = 1100;
+const uint16_t DHT_IDLE_US = 200;    // no edge for this long ends the frame (longest level is 80 us)
+const uint8_t DHT_BIT_ONE_US = 48;   // high time of a 0 is 26-28 us, of a 1 about 70 us
+const size_t DHT_RING_BYTES = 512;
+
+struct DhtSample {
+  float tempF;
+  float humidity;
+  unsigned long ms;           // millis() when the read was started
+  uint32_t seq;
+};
+
+struct DhtStats {
+  uint32_t reads;
+  uint32_t ok;
+  uint32_t timeouts;          // nothing captured
+  uint32_t shortFrames;       // fewer than 40 bits
+  uint32_t checksumErrors;
+  uint32_t rangeErrors;
+};
+
+gpio_num_t dhtGpio;
+RingbufHandle_t dhtRing = nullptr;
+esp_timer_handle_t dhtReleaseTimer = nullptr;
+bool dhtReady = false;
+bool dhtPending = false;      // a capture was started and not yet collected
+unsigned long dhtStartMs = 0;
+const char *dhtLastError = "none";
+DhtSample dhtSample = {NAN, NAN, 0, 0};
+DhtStats dhtStats = {};
+
+AsyncWebServer server(80);
+AsyncHeaderFreeMiddleware headerFilter; // drops every request header except HEADER_KEYS
+// Recursive mutex held by the scheduler while a job runs and by HTTP handlers (AsyncTCP
+// task) while they read or change firmware state. Recursive because a response can be
+// filled or freed from inside req->send() while the handler still holds it.
+SemaphoreHandle_t stateLock = nullptr;
+
+// === HTTP limits ===
+const size_t WEB_MAX_URL = 512;              // path plus decoded args; longer gets 414
+const size_t WEB_MAX_BODY = 1024;            // form posts only; larger gets 413
+const uint8_t WEB_MAX_STREAMS = 2;           // concurrent chunked history responses
+const unsigned long WEB_LOCK_WAIT_MS = 250;  // then 503 + Retry-After instead of queueing
+
+// Counters are bumped on the AsyncTCP task and read by /system_status_data on the loop.
+struct WebStats {
+  std::atomic<uint32_t> requests{0};
+  std::atomic<uint32_t> rejected{0}; // 413/414
+  std::atomic<uint32_t> busy{0};     // 503: state lock or stream slots unavailable
+  uint8_t streams = 0;               // chunked history responses in flight (under stateLock)
+  uint8_t peakStreams = 0;
+};
+WebStats webStats;
+
+// Path plus query args; the args are parsed with the request line, before any handler.
+size_t webUrlBytes(AsyncWebServerRequest *req) {
+  size_t n = req->url().length();
+  for (size_t i = 0; i < req->params(); i++) {
+    const AsyncWebParameter *p = req->getParam(i);
+    n += p->name().length() + p->value().length() + 2;
+  }
+  return n;
+}
+
+// Claims over-limit requests before their body is read. The server picks a request's
+// handler (canHandle) as soon as the headers are in; a trivial handler's body bytes are
+// counted and dropped instead of being parsed into params. Registered ahead of every route.
+class WebLimitHandler : public AsyncWebHandler {
+public:
+  bool canHandle(AsyncWebServerRequest *req) const override {
+    return req->contentLength() > WEB_MAX_BODY || webUrlBytes(req) > WEB_MAX_URL;
+  }
+  bool isRequestHandlerTrivial() const override {
+    return true;
+  }
+  void handleRequest(AsyncWebServerRequest *req) override {
+    webStats.requests++;
+    webStats.rejected++;
+    if (req->contentLength() > WEB_MAX_BODY) req->send(413, "text/plain", "request too large");
+    else req->send(414, "text/plain", "uri too long");
+  }
+};
+WebLimitHandler webLimitHandler;
+
+// JSON bodies are written into one of these static buffers instead of a growing String,
+// so serving a status endpoint no longer leaves freed String chunks scattered over the
+// heap. A slot stays busy until its response is destroyed; none free means 503.
+const size_t JSON_SLOT_BYTES = 6144; // largest body: /runtime_data (~5 KB)
+const uint8_t JSON_SLOTS = 2;
+struct JsonSlot {
+  bool busy;
+  size_t len;
+  size_t pos;
+  char buf[JSON_SLOT_BYTES];
+};
+JsonSlot jsonSlots[JSON_SLOTS];
+uint32_t jsonOverflows = 0;
+
+// === Server-sent events ===
+// /events pushes a JSON delta of the live readings when they change, so open pages don't
+// poll /status. AsyncEventSource formats each message once and queues it to every client.
+const unsigned long EVENTS_INTERVAL_MS = 250;    // change detection cadence
+const unsigned long EVENTS_HEARTBEAT_MS = 15000; // keeps idle connections and proxies alive
+const uint32_t EVENTS_RETRY_MS = 3000;           // browser reconnect delay after a drop
+const size_t EVENTS_MSG_BYTES = 256;
+AsyncEventSource events("/events");
+
+// Last values published on /events, at display resolution so sensor noise below a tenth
+// doesn't generate traffic.
+struct EventState {
+  int16_t temp10;
+  int16_t hum10;
+  int16_t feel10;
+  int16_t set10;
+  int16_t diff10;
+  int16_t sched10; // scheduled setpoint, HIST_NA while manual
+  bool heat;
+  bool cool;
+  bool fan;
+  char mode[8];
+};
+EventState eventsLast = {};
+uint32_t eventsSeq = 0;
+unsigned long eventsLastSendMs = 0;
+uint32_t eventsDeltas = 0;
+uint32_t eventsHeartbeats = 0;
 Preferences prefs;
 
 String wifiSsid;
@@ -125,6 +556,46 @@ bool wifiConnected = false;
 bool apMode = false;
 String wifiIpStr = "0.0.0.0";
 unsigned long lastWifiReconnect = 0;
+bool wifiJoinPending = false; // new credentials saved from /wifi, join on the next wifi pass
+
+// Wi-Fi link state, driven by updateWiFiStatus(). The ESP32 Wi-Fi event task only raises
+// the flags below; all WiFi.* calls stay on the loop task.
+enum WifiState : uint8_t { WIFI_IDLE, WIFI_JOINING, WIFI_UP, WIFI_RETRY_WAIT };
+const char *WIFI_STATE_NAMES[] = {"idle", "joining", "up", "wait"};
+WifiState wifiState = WIFI_IDLE;
+bool wifiFastJoin = false;              // current attempt uses the cached BSSID/channel (and lease)
+unsigned long wifiJoinStartMs = 0;
+unsigned long wifiLastJoinMs = 0;       // begin() to GOT_IP of the last successful join
+uint32_t wifiJoins = 0;
+uint32_t wifiFastJoins = 0;
+volatile bool wifiEvtGotIp = false;
+volatile bool wifiEvtLost = false;
+volatile unsigned long wifiEvtGotIpMs = 0;
+volatile uint16_t wifiEvtReason = 0;
+uint16_t wifiLastReason = 0;
+
+// Last good association, kept in NVS ("wifinet") so a reconnect can skip the scan and DHCP.
+// The address is only reused before the lease's renewal time (T1 = half the lease), when
+// the server still has to honour it; that needs a valid clock, so the first join after
+// a boot always asks DHCP.
+const uint32_t WIFI_CACHE_MAGIC = 0x57434632; // "WCF2"
+struct WifiCache {
+  uint32_t magic;
+  char ssid[33];
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t mask;
+  uint32_t dns;
+  uint32_t leaseStart;  // epoch the lease was granted; 0 until the clock is set
+  uint32_t leaseSec;    // lease time from the DHCP ACK; 0 = unknown, never reused
+};
+WifiCache wifiCache = {};
+bool wifiCacheValid = false;
+bool wifiLeaseReused = false;     // the current link runs on the cached address, not DHCP
+bool wifiLeaseStampPending = false;
+Preferences wifiCachePrefs;
 
 String sessionToken;
 unsigned long sessionStartMs = 0;
@@ -142,7 +613,90 @@ float lastHumidity = NAN;
 float lastHeatIndexF = NAN;
 unsigned long lastRead = 0;
 const unsigned long READ_INTERVAL_MS = 2000;
-unsigned long lastDisplay = 0;
+
+// Control temperature pipeline. Each source feeds its own ControlSensor: a median-of-N
+// window replaces single-read spikes, an exponential filter with time constant tauS
+// smooths what is left, and a source that hasn't reported for SENSOR_STALE_MS drops out.
+// The fresh sources are then averaged by weight into controlTempF. Add a row to
+// controlSensors[] and call sensorFeed() from its reader to fuse another sensor.
+const uint8_t SENSOR_MEDIAN_N = 5;
+const float SENSOR_SPIKE_F = 3.0f;       // further than this from the window median is a spike
+const unsigned long SENSOR_STALE_MS = 30000;
+
+struct ControlSensor {
+  const char *name;
+  float weight;
+  float tauS;
+  float window[SENSOR_MEDIAN_N];
+  uint8_t count;
+  uint8_t pos;
+  float raw;                             // last reading as received
+  float filtered;                        // NaN until the first reading
+  unsigned long lastMs;                  // millis() of the last reading, 0 = never
+  uint32_t samples;
+  uint32_t spikes;
+};
+
+ControlSensor controlSensors[] = {
+  {"dht22", 1.0f, 30.0f, {}, 0, 0, NAN, NAN, 0, 0, 0}, // heat index, falls back to temperature
+};
+const size_t CONTROL_SENSOR_COUNT = sizeof(controlSensors) / sizeof(controlSensors[0]);
+float controlTempF = NAN;                // fused filtered value the relays act on
+float controlRawF = NAN;                 // same weights over raw readings, kept for tuning
+
+// Learned thermal model: dT/dt = drift + heat (heating) or drift - cool (cooling), in F per
+// hour. Rates come from the control temperature over windows where the relays held one
+// state (see modelObserve). There is no outdoor sensor, so drift is whatever the house
+// does with everything off. Kept in NVS ("model").
+const uint32_t MODEL_MAGIC = 0x4D444C31;           // "MDL1"
+const uint32_t MODEL_LAG_S = 180;                  // skip equipment ramp-up after a change
+const uint32_t MODEL_WINDOW_MIN_S = 600;
+const uint32_t MODEL_WINDOW_MAX_S = 1800;
+const float MODEL_ALPHA = 0.2f;
+const uint16_t MODEL_MIN_WINDOWS = 3;              // planner waits for this many per rate
+const unsigned long MODEL_SAVE_INTERVAL_MS = 3600000UL;
+
+struct ThermalModel {
+  uint32_t magic;
+  float heatFph;
+  float coolFph;
+  float driftFph;
+  uint16_t heatN;
+  uint16_t coolN;
+  uint16_t driftN;
+  uint16_t reserved;
+  uint32_t crc;
+};
+
+ThermalModel model = {MODEL_MAGIC, 4.0f, 3.0f, -0.5f, 0, 0, 0, 0, 0};
+Preferences modelPrefs;
+bool modelDirty = false;
+unsigned long modelLastSaveMs = 0;
+uint8_t modelState = 0xFF;       // relay bits (1 heat, 2 cool) of the current run
+uint32_t modelStateSinceTs = 0;
+uint32_t modelWinStartTs = 0;    // 0 = no open window
+float modelWinStartF = NAN;
+uint32_t modelPrevTs = 0;
+float modelPrevF = NAN;
+float modelRateErrFph = NAN;     // mean |observed - predicted| slope
+
+// Pre-heat/pre-cool: moves the next scheduled setpoint in early enough for the model to
+// reach it when the block starts. Arrival error is + when late, - when early.
+const uint32_t PREHEAT_MAX_S = 7200;
+const uint32_t PREHEAT_GIVE_UP_S = 3600;         // stop waiting for arrival this long after the block
+
+struct PreheatPlan {
+  bool active;
+  bool heating;
+  float target;
+  uint32_t startTs;
+  uint32_t blockTs;
+};
+
+PreheatPlan preheat = {};
+uint32_t preheatRuns = 0;
+float preheatLastErrMin = NAN;
+float preheatMeanAbsErrMin = NAN;
 const unsigned long DISPLAY_INTERVAL_MS = 300; // quicker display refresh to reduce button lag perception
 float scheduleSP[7][24]; // NaN means no schedule entry
 int lastScheduleHour = -1;
@@ -158,7 +712,141 @@ uint16_t histMin[HIST_MAX];
 uint32_t histBaseEpoch = 0;
 int histCount = 0;
 int histIndex = 0;
-unsigned long lastHistLog = 0;
+uint32_t histPushes = 0;  // samples ever pushed; cursors use it to notice the ring moving
+const size_t HIST_CHUNK_BYTES = 1024;   // chunked-transfer block size for /history_data
+const size_t HIST_POINT_MAX_BYTES = 64; // worst-case serialized point
+const uint8_t HIST_BIN_VERSION = 3;     // /history_bin header version (row-interleaved)
+const uint32_t HIST_BIN_COUNT_TRAILER = 0xFFFFFFFF; // header count: read it from the trailer
+
+// On-SD history: one binary segment per UTC day (/hist/YYYYMMDD.bin) holding fixed
+// HistoryPoint records in time order behind a header. hourFirst[] is filled in once the
+// day is over ("sealed"); until then readers binary-search the records. Ranges older than
+// the RAM ring are served from here.
+const char *HIST_SEG_DIR = "/hist";
+const uint32_t HIST_SEG_MAGIC = 0x47455348; // "HSEG"
+const uint8_t HIST_SEG_VERSION = 1;
+const uint32_t HIST_SEG_MAX_DAYS = 400;     // widest range a single request will walk
+const uint32_t HIST_SEG_NONE = 0xFFFFFFFF;
+
+struct HistSegHeader {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t recSize;         // sizeof(HistoryPoint)
+  uint8_t sealed;          // hourFirst[] is valid
+  uint8_t reserved;
+  uint32_t dayStart;       // UTC midnight, epoch seconds
+  uint32_t hourFirst[24];  // index of the first record at or after each hour
+};
+static_assert(sizeof(HistSegHeader) == 108, "on-SD segment header layout changed");
+
+bool histSegCreate(SdLog &log);
+char histSegPath[24] = "";
+uint32_t histSegDay = 0;      // UTC day number being appended
+uint32_t histSegSealDay = 0;  // finished day waiting for its index, 0 = none
+SdLog histSegLog = {histSegPath, false, histSegCreate};
+
+// Rollup tiers: hourly and daily (UTC) buckets with min/avg/max of control temperature,
+// setpoint and duty cycle, fed from the 1-minute samples. Long chart ranges read these
+// instead of raw points; anything finer comes from the 7-day ring. Closed buckets are
+// appended to /hist/rollup.bin and reloaded at boot; the bucket open at a reboot only
+// covers the minutes after it.
+const uint8_t HIST_BIN_ROLLUP_VERSION = 4;
+const int ROLLUP_1H_MAX = 840;    // 35 days
+const int ROLLUP_1D_MAX = 366;
+
+struct RollupBucket {
+  uint32_t ts;       // bucket start
+  int16_t temp[3];   // min, avg, max in tenths F; HIST_NA when no reading
+  int16_t set[3];
+  uint8_t duty[3];   // min, avg, max % of control passes with heat or cool on
+};
+
+struct RollupStat {
+  int16_t lo;
+  int16_t hi;
+  int32_t sum;
+  uint16_t n;
+};
+
+struct RollupAcc {
+  uint32_t ts;
+  RollupStat temp;
+  RollupStat set;
+  RollupStat duty;
+};
+
+struct RollupTier {
+  const char *name;
+  uint32_t periodSec;
+  RollupBucket *buckets;
+  int cap;
+  int count;
+  int head;          // next write slot
+  RollupAcc acc;     // bucket still being filled; acc.ts == 0 when empty
+};
+
+RollupBucket rollup1h[ROLLUP_1H_MAX];
+RollupBucket rollup1d[ROLLUP_1D_MAX];
+RollupTier rollupTiers[] = {
+  {"1h", 3600,  rollup1h, ROLLUP_1H_MAX, 0, 0, {}},
+  {"1d", 86400, rollup1d, ROLLUP_1D_MAX, 0, 0, {}},
+};
+const size_t ROLLUP_TIER_COUNT = sizeof(rollupTiers) / sizeof(rollupTiers[0]);
+
+// On-SD copy of the closed buckets, one record per bucket in close order. Rewritten from
+// the RAM tiers once it holds about two tiers' worth.
+const char *ROLLUP_LOG_PATH = "/hist/rollup.bin";
+const char *ROLLUP_TMP_PATH = "/hist/rollup.tmp";
+const uint32_t ROLLUP_LOG_COMPACT_BYTES = 65536;
+
+struct RollupRecord {
+  uint32_t periodSec;  // tier the bucket belongs to
+  RollupBucket bucket;
+};
+
+SdLog rollupLog = {ROLLUP_LOG_PATH, false};
+bool rollupCompactPending = false;
+
+// Every buffered SD log, for flushing, fault handling and stats.
+SdLog *const sdLogs[] = {&historyLog, &walLog, &histSegLog, &rollupLog};
+uint32_t histDutyPasses = 0;   // control passes since the last history sample
+uint32_t histDutyOnPasses = 0;
+
+// Cooperative scheduler: each job runs from loop() when its deadline passes.
+// budgetUs is the expected worst-case run time; longer runs count as overruns.
+struct SchedTask {
+  const char *name;
+  void (*fn)();
+  unsigned long periodMs;  // 0 = run on every idle pass
+  uint8_t priority;        // lower value wins when several jobs are due
+  unsigned long budgetUs;
+  unsigned long nextDueMs;
+  unsigned long runs;
+  unsigned long overruns;
+  unsigned long lastRunUs;
+  unsigned long worstRunUs;
+  unsigned long worstLatencyMs; // how late past its deadline the job started
+};
+
+void taskSense();
+void sensorFeed(ControlSensor &s, float v, unsigned long ms);
+void sensorFuse(unsigned long now);
+uint32_t modelChecksum(const ThermalModel &m);
+void modelBegin();
+void modelObserve(uint32_t ts, float ctl);
+void modelCloseWindow(uint32_t endTs, float endF);
+void modelService();
+void planTick(float ctl);
+bool dhtBegin();
+void dhtRelease(void *arg);
+void dhtStart();
+bool dhtCollect();
+int dhtDecode(const rmt_item32_t *items, size_t count, uint8_t *data);
+void taskControl();
+void taskHistory();
+void taskDisplay();
+void taskEvents();
+void runScheduler();
 
 String fmtBytes(uint64_t b) {
   if (b >= (1ULL << 30)) return String((float)b / (1 << 30), 2) + " GB";
@@ -167,42 +855,254 @@ String fmtBytes(uint64_t b) {
   return String((unsigned long)b) + " B";
 }
 
-void handleThermostat();
-void handleSchedule();
-void handleScheduleData();
-void handleHistory();
-void handleHistoryData();
-void handleSystemStatus();
-void handleSystemStatusData();
-void handleSet();
-void handleStatus();
-void handleTz();
-void handleWifiPage();
-void handleWifiSave();
-void handleLogin();
-void handleLogout();
+// Fixed-buffer JSON writer: appends into caller-owned memory with no heap use (no String,
+// no printf float path). Output that doesn't fit sets `overflow`; callers check it once.
+// Keys are nullptr for array elements.
+struct JsonWriter {
+  char *buf;
+  size_t cap;
+  size_t len;
+  bool comma;    // the next key or value needs a separator
+  bool overflow;
+};
+
+void jwBegin(JsonWriter &w, char *buf, size_t cap) {
+  w.buf = buf;
+  w.cap = cap;
+  w.len = 0;
+  w.comma = false;
+  w.overflow = false;
+  if (cap > 0) buf[0] = '\0';
+}
+
+void jwPut(JsonWriter &w, const char *s, size_t n) {
+  if (w.overflow || w.len + n >= w.cap) {
+    w.overflow = true;
+    return;
+  }
+  memcpy(w.buf + w.len, s, n);
+  w.len += n;
+  w.buf[w.len] = '\0';
+}
+
+void jwChar(JsonWriter &w, char c) {
+  jwPut(w, &c, 1);
+}
+
+void jwKey(JsonWriter &w, const char *key) {
+  if (w.comma) jwChar(w, ',');
+  w.comma = true;
+  if (!key) return;
+  jwChar(w, '"');
+  jwPut(w, key, strlen(key));
+  jwPut(w, "\":", 2);
+}
+
+void jwObject(JsonWriter &w, const char *key = nullptr) {
+  jwKey(w, key);
+  jwChar(w, '{');
+  w.comma = false;
+}
+
+void jwArray(JsonWriter &w, const char *key = nullptr) {
+  jwKey(w, key);
+  jwChar(w, '[');
+  w.comma = false;
+}
+
+void jwEndObject(JsonWriter &w) {
+  jwChar(w, '}');
+  w.comma = true;
+}
+
+void jwEndArray(JsonWriter &w) {
+  jwChar(w, ']');
+  w.comma = true;
+}
+
+void jwDigits(JsonWriter &w, uint64_t v) {
+  char tmp[20];
+  size_t n = 0;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v > 0);
+  while (n > 0) jwChar(w, tmp[--n]);
+}
+
+void jwUint(JsonWriter &w, const char *key, uint64_t v) {
+  jwKey(w, key);
+  jwDigits(w, v);
+}
+
+void jwInt(JsonWriter &w, const char *key, int64_t v) {
+  jwKey(w, key);
+  if (v < 0) jwChar(w, '-');
+  jwDigits(w, v < 0 ? (uint64_t)(-(v + 1)) + 1 : (uint64_t)v);
+}
+
+void jwBool(JsonWriter &w, const char *key, bool v) {
+  jwKey(w, key);
+  if (v) jwPut(w, "true", 4);
+  else jwPut(w, "false", 5);
+}
+
+void jwNull(JsonWriter &w, const char *key) {
+  jwKey(w, key);
+  jwPut(w, "null", 4);
+}
+
+// Fixed-point decimal with `dp` (0-4) places; NaN/inf become null.
+void jwFixed(JsonWriter &w, const char *key, float v, uint8_t dp) {
+  static const uint32_t POW10[] = {1, 10, 100, 1000, 10000};
+  if (isnan(v) || isinf(v)) {
+    jwNull(w, key);
+    return;
+  }
+  if (dp > 4) dp = 4;
+  uint64_t scaled = (uint64_t)llroundf(fabsf(v) * POW10[dp]);
+  jwKey(w, key);
+  if (v < 0 && scaled != 0) jwChar(w, '-');
+  jwDigits(w, scaled / POW10[dp]);
+  if (dp == 0) return;
+  jwChar(w, '.');
+  uint32_t frac = scaled % POW10[dp];
+  for (uint32_t p = POW10[dp] / 10; p > 0; p /= 10) jwChar(w, (char)('0' + (frac / p) % 10));
+}
+
+// Tenths as stored in the history ring; HIST_NA becomes null.
+void jwTenths(JsonWriter &w, const char *key, int16_t v10) {
+  if (v10 == HIST_NA) {
+    jwNull(w, key);
+    return;
+  }
+  jwKey(w, key);
+  if (v10 < 0) jwChar(w, '-');
+  uint32_t a = (uint32_t)abs((int32_t)v10);
+  jwDigits(w, a / 10);
+  jwChar(w, '.');
+  jwChar(w, (char)('0' + a % 10));
+}
+
+void jwString(JsonWriter &w, const char *key, const char *s) {
+  jwKey(w, key);
+  jwChar(w, '"');
+  for (; *s; s++) {
+    uint8_t c = (uint8_t)*s;
+    if (c == '"' || c == '\\') {
+      jwChar(w, '\\');
+      jwChar(w, (char)c);
+    } else if (c < 0x20) {
+      static const char HEX_DIGITS[] = "0123456789abcdef";
+      char esc[6] = {'\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 15]};
+      jwPut(w, esc, sizeof(esc));
+    } else {
+      jwChar(w, (char)c);
+    }
+  }
+  jwChar(w, '"');
+}
+
+void handleThermostat(AsyncWebServerRequest *req);
+void handleSchedule(AsyncWebServerRequest *req);
+void handleScheduleData(AsyncWebServerRequest *req);
+void handleHistory(AsyncWebServerRequest *req);
+void handleHistoryData(AsyncWebServerRequest *req);
+void handleHistoryBin(AsyncWebServerRequest *req);
+void histStreamReap();
+void handleSystemStatus(AsyncWebServerRequest *req);
+void handleSystemStatusData(AsyncWebServerRequest *req);
+void handleSet(AsyncWebServerRequest *req);
+void handleStatus(AsyncWebServerRequest *req);
+void handleTz(AsyncWebServerRequest *req);
+void handleWifiPage(AsyncWebServerRequest *req);
+void handleWifiSave(AsyncWebServerRequest *req);
+void handleLogin(AsyncWebServerRequest *req);
+void handleLogout(AsyncWebServerRequest *req);
+void sendAsset(AsyncWebServerRequest *req, const char *path);
+void webRoute(const char *path, WebRequestMethodComposite method, void (*fn)(AsyncWebServerRequest *req));
+void webBusy(AsyncWebServerRequest *req);
+void addHeapJson(JsonWriter &w);
+JsonSlot *jsonBegin(AsyncWebServerRequest *req, JsonWriter &w);
+void jsonSend(AsyncWebServerRequest *req, JsonSlot *slot, const JsonWriter &w);
+float scheduledSetpointNow();
 void setOutput(int pin, bool on);
 void updateDisplay();
 void logHealth();
 void logSdCardInfo(const char* context);
 void sdWriteTest();
 const char* sdTypeToString(uint8_t type);
+void sdFault(const char *reason);
+bool sdLogAppend(SdLog &log, const void *data, size_t len, uint32_t ts);
+bool sdLogFlush(SdLog &log, bool force);
+bool sdLogClose(SdLog &log);
+void taskStorage();
 void loadWifiCredentials();
-bool connectWiFiWithTimeout(unsigned long timeoutMs);
 void startWiFi();
 void startAp();
 void updateWiFiStatus();
-bool isAuthenticated();
+void onWifiEvent(arduino_event_t *event);
+void wifiJoin(bool fast);
+void wifiCacheLoad();
+void wifiCacheStore();
+bool isAuthenticated(AsyncWebServerRequest *req);
 bool onAuthorizedNetwork();
-bool canControl();
-bool requireControlAuth();
+bool canControl(AsyncWebServerRequest *req);
+bool requireControlAuth(AsyncWebServerRequest *req);
 String makeToken();
 void tickCloudSync();
-bool pushThermostatStatus(bool includeHistory);
-bool fetchThermostatConfig();
-bool pushThermostatConfig();
+void captureStatus(StatusSnapshot &snap);
+void statusTriggerCapture(StatusTrigger &t);
+bool statusTriggerEqual(const StatusTrigger &a, const StatusTrigger &b);
+void runtimeBegin();
+void runtimeTick();
+void handleRuntimeData(AsyncWebServerRequest *req);
+void uploadQueueBegin();
+void uploadQueueScanWal();
+void histSegAppend(HistoryPoint p);
+void rollupAdd(uint32_t ts, int16_t temp10, int16_t set10, uint8_t duty);
+void histSegSeal(uint32_t day);
+void uploadQueueAppend(const HistoryPoint &point);
+bool uploadQueueBacklog();
+void uploadQueueFillBatch(StatusSnapshot &snap, uint32_t &endOffset);
+void uploadQueueService();
+void captureConfig(ConfigSnapshot &cfg);
+void cloudTask(void *param);
+void startCloudTask();
+bool splitHttpsUrl(const char *url, char *host, size_t hostCap, const char *&path);
+HttpsConn *cloudBegin(const char *url);
+void cloudFinish(HttpsConn *conn, int code);
+bool pushThermostatStatus(const StatusSnapshot &snap);
+enum ConfigFetch : uint8_t { FETCH_FAILED, FETCH_UNCHANGED, FETCH_CHANGED };
+void cloudWireHeaders(HTTPClient &http, bool hasBody);
+size_t cloudSerialize(JsonDocument &doc, std::unique_ptr<uint8_t[]> &out);
+ConfigFetch fetchThermostatConfig(RemoteConfig &out, char *rev, size_t revLen);
+void parseRemoteConfig(JsonObject config, RemoteConfig &out);
+bool pushThermostatConfig(const ConfigSnapshot &cfg);
 void markConfigDirty();
-void applyRemoteConfig(JsonObject config);
+void applyRemoteConfig(const RemoteConfig &config);
+uint32_t configStoreChecksum(const ConfigStore &st);
+void configStoreLoad();
+void configStoreMark();
+void configStoreService();
+void histRingPush(uint32_t ts, int16_t temp10, int16_t set10);
+void histRestore();
+void rollupRestore();
+void rollupCompact();
+
+// Ordered by priority. HTTP is served by the AsyncTCP task, not from this table.
+SchedTask schedTasks[] = {
+  {"sense",   taskSense,        READ_INTERVAL_MS,       0, 30000,  0, 0, 0, 0, 0, 0},
+  {"control", taskControl,      READ_INTERVAL_MS,       1, 5000,   0, 0, 0, 0, 0, 0},
+  {"wifi",    updateWiFiStatus, 250,                    2, 5000,   0, 0, 0, 0, 0, 0},
+  {"history", taskHistory,      HISTORY_INTERVAL_MS,    3, 50000,  0, 0, 0, 0, 0, 0},
+  {"storage", taskStorage,      SDLOG_SERVICE_MS,       4, 30000,  0, 0, 0, 0, 0, 0},
+  {"events",  taskEvents,       EVENTS_INTERVAL_MS,     5, 5000,   0, 0, 0, 0, 0, 0},
+  {"display", taskDisplay,      DISPLAY_INTERVAL_MS,    6, 40000,  0, 0, 0, 0, 0, 0},
+  {"health",  logHealth,        HEALTH_LOG_INTERVAL_MS, 7, 20000,  0, 0, 0, 0, 0, 0},
+  {"cloud",   tickCloudSync,    1000,                   8, 2000,   0, 0, 0, 0, 0, 0},
+};
+const size_t SCHED_TASK_COUNT = sizeof(schedTasks) / sizeof(schedTasks[0]);
 
 void setup() {
   Serial.begin(115200);
@@ -223,8 +1123,10 @@ void setup() {
     histSet10[i] = HIST_NA;
     histMin[i] = 0;
   }
+  configStoreLoad();
+  modelBegin();
 
-  dht.begin();
+  if (!dhtBegin()) Serial.println("[SENSOR] RMT init failed");
 
   Wire.begin(I2C_SDA, I2C_SCL);
   Serial.println("I2C scan...");
@@ -249,6 +1151,7 @@ void setup() {
 
   prefs.begin("wifi", false);
   loadWifiCredentials();
+  wifiCacheLoad();
   startWiFi();
 
   // SD card init (using explicit SPI pins)
@@ -258,232 +1161,581 @@ void setup() {
   }
   if (SD.begin(SD_CS)) {
     sdReady = true;
+    sdEverMounted = true;
     Serial.println("SD card mounted");
+    SD.mkdir(HIST_SEG_DIR);
     logSdCardInfo("SD init");
     sdWriteTest();
+    histRestore();
+    rollupRestore();
   } else {
     sdReady = false;
+    sdRemountAtMs = millis() + SD_REMOUNT_MIN_MS;
     Serial.println("SD init failed (check wiring/format)");
   }
+  uploadQueueBegin();
+  runtimeBegin();
 
-  server.on("/", [](){ server.sendHeader("Location", "/thermostat"); server.send(302, "text/plain", ""); });
-  server.on("/thermostat", handleThermostat);
-  server.on("/schedule", handleSchedule);
-  server.on("/schedule_data", handleScheduleData);
-  server.on("/history", handleHistory);
-  server.on("/history_data", handleHistoryData);
-  server.on("/system_status", handleSystemStatus);
-  server.on("/system_status_data", handleSystemStatusData);
-  server.on("/set", handleSet);
-  server.on("/status", handleStatus);
-  server.on("/tz", handleTz);
-  server.on("/wifi", HTTP_GET, handleWifiPage);
-  server.on("/wifi", HTTP_POST, handleWifiSave);
-  server.on("/login", HTTP_GET, handleLogin);
-  server.on("/login", HTTP_POST, handleLogin);
-  server.on("/logout", handleLogout);
-  server.collectHeaders(HEADER_KEYS, HEADER_KEYS_COUNT);
+  stateLock = xSemaphoreCreateRecursiveMutex();
+  for (size_t i = 0; i < HEADER_KEYS_COUNT; i++) headerFilter.keep(HEADER_KEYS[i]);
+  server.addMiddleware(&headerFilter);
+  server.addHandler(&webLimitHandler);
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *req){ req->redirect("/thermostat"); });
+  server.on("/app.css", HTTP_GET, [](AsyncWebServerRequest *req){ sendAsset(req, "/app.css"); });
+  webRoute("/thermostat", HTTP_GET, handleThermostat);
+  webRoute("/schedule", HTTP_GET, handleSchedule);
+  webRoute("/schedule_data", HTTP_GET, handleScheduleData);
+  webRoute("/history", HTTP_GET, handleHistory);
+  webRoute("/history_data", HTTP_GET, handleHistoryData);
+  webRoute("/history_bin", HTTP_GET, handleHistoryBin);
+  webRoute("/system_status", HTTP_GET, handleSystemStatus);
+  webRoute("/system_status_data", HTTP_GET, handleSystemStatusData);
+  webRoute("/runtime_data", HTTP_GET, handleRuntimeData);
+  webRoute("/set", HTTP_GET | HTTP_POST, handleSet);
+  webRoute("/status", HTTP_GET, handleStatus);
+  webRoute("/tz", HTTP_GET | HTTP_POST, handleTz);
+  webRoute("/wifi", HTTP_GET, handleWifiPage);
+  webRoute("/wifi", HTTP_POST, handleWifiSave);
+  webRoute("/login", HTTP_GET | HTTP_POST, handleLogin);
+  webRoute("/logout", HTTP_GET | HTTP_POST, handleLogout);
+  // New subscribers only get the retry hint; the page resyncs from /status on open.
+  events.onConnect([](AsyncEventSourceClient *client) { client->send("{}", "hello", eventsSeq, EVENTS_RETRY_MS); });
+  server.addHandler(&events);
+  server.onNotFound([](AsyncWebServerRequest *req){ req->send(404, "text/plain", "not found"); });
   server.begin();
+  startCloudTask();
 }
 
 void loop() {
-  server.handleClient();
-  updateWiFiStatus();
+  runScheduler();
+}
 
+// Picks the most urgent due task: lowest priority value first, then earliest deadline.
+// Only one task runs per pass so a slow job delays at most the jobs behind it once.
+void runScheduler() {
   unsigned long now = millis();
-  if (now - lastRead >= READ_INTERVAL_MS) {
-    lastRead = now;
-    float t = dht.readTemperature(true); // true = Fahrenheit
-    float h = dht.readHumidity();
-    if (DEBUG_SERIAL && (isnan(t) || isnan(h))) {
-      if (now - lastSensorFailLog >= SENSOR_FAIL_LOG_INTERVAL_MS) {
-        Serial.printf("[SENSOR] DHT read failed. t=%s h=%s\n",
-                      isnan(t) ? "NaN" : String(t, 1).c_str(),
-                      isnan(h) ? "NaN" : String(h, 1).c_str());
-        lastSensorFailLog = now;
+  SchedTask *next = nullptr;
+  for (size_t i = 0; i < SCHED_TASK_COUNT; i++) {
+    SchedTask &t = schedTasks[i];
+    if ((long)(now - t.nextDueMs) < 0) continue;
+    if (!next || t.priority < next->priority ||
+        (t.priority == next->priority && (long)(t.nextDueMs - next->nextDueMs) < 0)) {
+      next = &t;
+    }
+  }
+  if (!next) {
+    delay(1); // idle: leave the core to the AsyncTCP and WiFi tasks
+    return;
+  }
+
+  unsigned long latencyMs = (next->periodMs > 0) ? (now - next->nextDueMs) : 0;
+  unsigned long startUs = micros();
+  xSemaphoreTakeRecursive(stateLock, portMAX_DELAY);
+  next->fn();
+  histStreamReap();
+  xSemaphoreGiveRecursive(stateLock);
+  unsigned long runUs = micros() - startUs;
+
+  next->runs++;
+  next->lastRunUs = runUs;
+  if (runUs > next->worstRunUs) next->worstRunUs = runUs;
+  if (latencyMs > next->worstLatencyMs) next->worstLatencyMs = latencyMs;
+  if (next->budgetUs > 0 && runUs > next->budgetUs) next->overruns++;
+
+  // Keep cadence anchored to the deadline; skip missed slots instead of bursting.
+  next->nextDueMs += next->periodMs;
+  unsigned long after = millis();
+  if ((long)(after - next->nextDueMs) >= 0 && next->periodMs > 0) {
+    next->nextDueMs = after + next->periodMs;
+  }
+}
+
+bool dhtBegin() {
+  dhtGpio = (gpio_num_t)digitalPinToGPIONumber(DHT_PIN);
+  pinMode(DHT_PIN, INPUT_PULLUP);
+  rmt_config_t cfg = {};
+  cfg.rmt_mode = RMT_MODE_RX;
+  cfg.channel = DHT_RMT_CHANNEL;
+  cfg.gpio_num = dhtGpio;
+  cfg.clk_div = 80;                        // 1 us ticks
+  cfg.mem_block_num = 2;                   // a frame is ~42 items; one S3 block holds 48
+  cfg.rx_config.filter_en = true;
+  cfg.rx_config.filter_ticks_thresh = 100; // APB ticks: drop glitches under ~1.25 us
+  cfg.rx_config.idle_threshold = DHT_IDLE_US;
+  if (rmt_config(&cfg) != ESP_OK) return false;
+  if (rmt_driver_install(DHT_RMT_CHANNEL, DHT_RING_BYTES, 0) != ESP_OK) return false;
+  if (rmt_get_ringbuf_handle(DHT_RMT_CHANNEL, &dhtRing) != ESP_OK || !dhtRing) return false;
+  // Open drain with input kept on, so the same pin can pull the start pulse and feed RMT.
+  gpio_set_direction(dhtGpio, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_pullup_en(dhtGpio);
+  gpio_set_level(dhtGpio, 1);
+  esp_timer_create_args_t args = {};
+  args.callback = dhtRelease;
+  args.dispatch_method = ESP_TIMER_TASK;
+  args.name = "dht";
+  if (esp_timer_create(&args, &dhtReleaseTimer) != ESP_OK) return false;
+  dhtReady = true;
+  return true;
+}
+
+// esp_timer task: receive is armed before the line is released so the sensor's reply,
+// 20-40 us later, can't be missed.
+void dhtRelease(void *arg) {
+  rmt_rx_start(DHT_RMT_CHANNEL, true);
+  gpio_set_level(dhtGpio, 1);
+}
+
+void dhtStart() {
+  rmt_rx_stop(DHT_RMT_CHANNEL);
+  size_t len = 0;
+  void *stale;
+  while ((stale = xRingbufferReceive(dhtRing, &len, 0)) != nullptr) vRingbufferReturnItem(dhtRing, stale);
+  gpio_set_level(dhtGpio, 0);
+  if (esp_timer_start_once(dhtReleaseTimer, DHT_START_LOW_US) != ESP_OK) {
+    gpio_set_level(dhtGpio, 1);
+    return;
+  }
+  dhtStartMs = millis();
+  dhtPending = true;
+  dhtStats.reads++;
+}
+
+// Returns the number of bits decoded into data[5]. The reply is an 80 us low/high preamble
+// and then 40 bits of ~50 us low plus a 26 us (0) or 70 us (1) high, so the data bits are
+// the last 40 high levels before the idle gap.
+int dhtDecode(const rmt_item32_t *items, size_t count, uint8_t *data) {
+  uint16_t highs[48];
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint16_t dur[2] = {(uint16_t)items[i].duration0, (uint16_t)items[i].duration1};
+    uint8_t lvl[2] = {(uint8_t)items[i].level0, (uint8_t)items[i].level1};
+    for (int k = 0; k < 2; k++) {
+      if (dur[k] == 0) break; // end of frame
+      if (lvl[k] != 1) continue;
+      if (n == 48) {
+        memmove(highs, highs + 1, sizeof(highs) - sizeof(highs[0]));
+        n--;
       }
+      highs[n++] = dur[k];
     }
-    if (!isnan(t)) lastTempF = t;
-    if (!isnan(h)) lastHumidity = h;
-    if (!isnan(lastTempF) && !isnan(lastHumidity)) {
-      lastHeatIndexF = dht.computeHeatIndex(lastTempF, lastHumidity, true); // real feel
-    } else {
-      lastHeatIndexF = NAN;
+  }
+  if (n < 40) return (int)(n > 0 ? n - 1 : 0);
+  memset(data, 0, 5);
+  for (int b = 0; b < 40; b++) {
+    if (highs[n - 40 + b] > DHT_BIT_ONE_US) data[b / 8] |= 0x80 >> (b % 8);
+  }
+  return 40;
+}
+
+// Picks up the capture started by the previous dhtStart(); true when a new sample was
+// published to dhtSample.
+bool dhtCollect() {
+  if (!dhtPending) return false;
+  dhtPending = false;
+  size_t len = 0;
+  rmt_item32_t *items = (rmt_item32_t *)xRingbufferReceive(dhtRing, &len, 0);
+  if (!items) {
+    dhtStats.timeouts++;
+    dhtLastError = "timeout";
+    return false;
+  }
+  uint8_t data[5];
+  int bits = dhtDecode(items, len / sizeof(rmt_item32_t), data);
+  vRingbufferReturnItem(dhtRing, items);
+  if (bits < 40) {
+    dhtStats.shortFrames++;
+    dhtLastError = "short frame";
+    return false;
+  }
+  if ((uint8_t)(data[0] + data[1] + data[2] + data[3]) != data[4]) {
+    dhtStats.checksumErrors++;
+    dhtLastError = "checksum";
+    return false;
+  }
+  float h = ((data[0] << 8) | data[1]) / 10.0f;
+  float c = (((data[2] & 0x7F) << 8) | data[3]) / 10.0f;
+  if (data[2] & 0x80) c = -c;
+  if (h > 100.0f || c < -40.0f || c > 80.0f) {
+    dhtStats.rangeErrors++;
+    dhtLastError = "out of range";
+    return false;
+  }
+  dhtSample.tempF = c * 1.8f + 32.0f;
+  dhtSample.humidity = h;
+  dhtSample.ms = dhtStartMs;
+  dhtSample.seq++;
+  dhtStats.ok++;
+  return true;
+}
+
+// Consumes the sample captured since the last pass and starts the next capture; the
+// DHT22 wants at least 2 s between reads, which READ_INTERVAL_MS already gives it.
+void taskSense() {
+  unsigned long now = millis();
+  lastRead = now;
+  if (!dhtReady) return;
+  bool fresh = dhtCollect();
+  dhtStart();
+  if (!fresh) {
+    if (DEBUG_SERIAL && dhtStats.reads > 1 && now - lastSensorFailLog >= SENSOR_FAIL_LOG_INTERVAL_MS) {
+      Serial.printf("[SENSOR] DHT read failed (%s). reads=%lu timeouts=%lu short=%lu crc=%lu range=%lu\n",
+                    dhtLastError,
+                    (unsigned long)dhtStats.reads,
+                    (unsigned long)dhtStats.timeouts,
+                    (unsigned long)dhtStats.shortFrames,
+                    (unsigned long)dhtStats.checksumErrors,
+                    (unsigned long)dhtStats.rangeErrors);
+      lastSensorFailLog = now;
     }
+    sensorFuse(now);
+    return;
+  }
+  lastTempF = dhtSample.tempF;
+  lastHumidity = dhtSample.humidity;
+  lastHeatIndexF = dht.computeHeatIndex(lastTempF, lastHumidity, true); // real feel
+  sensorFeed(controlSensors[0], !isnan(lastHeatIndexF) ? lastHeatIndexF : lastTempF, dhtSample.ms);
+  sensorFuse(now);
+}
 
-    // Apply schedule setpoint if available (respect manual override until next schedule block)
-    struct tm timeinfo;
-    if (getLocalTime(&timeinfo)) {
-      int d = timeinfo.tm_wday; // 0=Sunday
-      int h = timeinfo.tm_hour;
-      if (d >= 0 && d < 7 && h >= 0 && h < 24) {
-        float sp = scheduleSP[d][h];
-        if (overrideUntilNextSchedule) {
-          if (overrideStartHour < 0) overrideStartHour = h;
-          if (!isnan(sp) && h != overrideStartHour) {
-            setpointF = sp;
-            lastScheduleHour = h;
-            overrideUntilNextSchedule = false;
-          }
-        } else {
-          if (!isnan(sp) && (lastScheduleHour != h)) {
-            setpointF = sp;
-            lastScheduleHour = h;
-          }
+// NaN readings never enter the window; a dead source just goes stale.
+void sensorFeed(ControlSensor &s, float v, unsigned long ms) {
+  if (isnan(v)) return;
+  bool fresh = s.lastMs != 0 && ms - s.lastMs < SENSOR_STALE_MS;
+  if (!fresh) s.count = 0;
+  s.window[s.pos] = v;
+  s.pos = (s.pos + 1) % SENSOR_MEDIAN_N;
+  if (s.count < SENSOR_MEDIAN_N) s.count++;
+  float sorted[SENSOR_MEDIAN_N];
+  for (uint8_t i = 0; i < s.count; i++) {
+    float x = s.window[(s.pos + SENSOR_MEDIAN_N - 1 - i) % SENSOR_MEDIAN_N];
+    uint8_t j = i;
+    for (; j > 0 && sorted[j - 1] > x; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = x;
+  }
+  float accepted = v;
+  // A real step moves the median after a couple of reads; a lone spike never does.
+  if (s.count >= 3 && fabsf(v - sorted[s.count / 2]) > SENSOR_SPIKE_F) {
+    accepted = sorted[s.count / 2];
+    s.spikes++;
+  }
+  if (!fresh || isnan(s.filtered)) {
+    s.filtered = accepted;
+  } else {
+    float dt = (ms - s.lastMs) / 1000.0f;
+    s.filtered += (1.0f - expf(-dt / s.tauS)) * (accepted - s.filtered);
+  }
+  s.raw = v;
+  s.lastMs = ms;
+  s.samples++;
+}
+
+void sensorFuse(unsigned long now) {
+  float sumW = 0, sumF = 0, sumR = 0;
+  for (size_t i = 0; i < CONTROL_SENSOR_COUNT; i++) {
+    const ControlSensor &s = controlSensors[i];
+    if (s.lastMs == 0 || now - s.lastMs >= SENSOR_STALE_MS || isnan(s.filtered)) continue;
+    sumW += s.weight;
+    sumF += s.weight * s.filtered;
+    sumR += s.weight * s.raw;
+  }
+  controlTempF = sumW > 0 ? sumF / sumW : NAN;
+  controlRawF = sumW > 0 ? sumR / sumW : NAN;
+}
+
+void taskControl() {
+  unsigned long now = millis();
+
+  // Apply schedule setpoint if available (respect manual override until next schedule block)
+  struct tm timeinfo;
+  if (getLocalTime(&timeinfo, 0)) { // no wait: control must not stall before NTP sync
+    int d = timeinfo.tm_wday; // 0=Sunday
+    int h = timeinfo.tm_hour;
+    if (d >= 0 && d < 7 && h >= 0 && h < 24) {
+      float sp = scheduleSP[d][h];
+      if (overrideUntilNextSchedule) {
+        if (overrideStartHour < 0) overrideStartHour = h;
+        if (!isnan(sp) && h != overrideStartHour) {
+          setpointF = sp;
+          lastScheduleHour = h;
+          overrideUntilNextSchedule = false;
+        }
+      } else {
+        if (!isnan(sp) && (lastScheduleHour != h)) {
+          setpointF = sp;
+          lastScheduleHour = h;
         }
       }
     }
+  }
 
-    // Control temperature: prefer real-feel, fall back to actual
-    float ctlTemp = !isnan(lastHeatIndexF) ? lastHeatIndexF : lastTempF;
+  // Control temperature: filtered and fused real-feel (see sensorFeed), NaN when stale
+  float ctlTemp = controlTempF;
+  planTick(ctlTemp);
 
-    // Hysteresis thresholds (half the diff)
-    float onThresholdHeat  = setpointF - (diffF * 0.5f);
-    float offThresholdHeat = setpointF + (diffF * 0.5f);
-    float onThresholdCool  = setpointF + (diffF * 0.5f);
-    float offThresholdCool = setpointF - (diffF * 0.5f);
+  // Hysteresis thresholds (half the diff)
+  float onThresholdHeat  = setpointF - (diffF * 0.5f);
+  float offThresholdHeat = setpointF + (diffF * 0.5f);
+  float onThresholdCool  = setpointF + (diffF * 0.5f);
+  float offThresholdCool = setpointF - (diffF * 0.5f);
 
-    // Heat control
-    if (mode == "heat" && !isnan(ctlTemp)) {
-      if (!heatOn && ctlTemp <= onThresholdHeat && (now - lastHeatToggle) >= MIN_OFF_TIME_MS) {
-        heatOn = true;
-        lastHeatToggle = now;
-      } else if (heatOn && ctlTemp >= offThresholdHeat && (now - lastHeatToggle) >= MIN_ON_TIME_MS) {
-        heatOn = false;
-        lastHeatToggle = now;
-      }
-    } else {
+  // Heat control
+  if (mode == "heat" && !isnan(ctlTemp)) {
+    if (!heatOn && ctlTemp <= onThresholdHeat && (now - lastHeatToggle) >= MIN_OFF_TIME_MS) {
+      heatOn = true;
+      lastHeatToggle = now;
+    } else if (heatOn && ctlTemp >= offThresholdHeat && (now - lastHeatToggle) >= MIN_ON_TIME_MS) {
       heatOn = false;
+      lastHeatToggle = now;
     }
+  } else if (heatOn && (mode != "heat" || (now - lastHeatToggle) >= MIN_ON_TIME_MS)) {
+    // A stale sensor still honours the minimum on-time; leaving the mode stops at once.
+    heatOn = false;
+    lastHeatToggle = now;
+  }
 
-    // Cool control
-    if (mode == "cool" && !isnan(ctlTemp)) {
-      if (!coolOn && ctlTemp >= onThresholdCool && (now - lastCoolToggle) >= MIN_OFF_TIME_MS) {
-        coolOn = true;
-        lastCoolToggle = now;
-      } else if (coolOn && ctlTemp <= offThresholdCool && (now - lastCoolToggle) >= MIN_ON_TIME_MS) {
-        coolOn = false;
-        lastCoolToggle = now;
-      }
-    } else {
+  // Cool control
+  if (mode == "cool" && !isnan(ctlTemp)) {
+    if (!coolOn && ctlTemp >= onThresholdCool && (now - lastCoolToggle) >= MIN_OFF_TIME_MS) {
+      coolOn = true;
+      lastCoolToggle = now;
+    } else if (coolOn && ctlTemp <= offThresholdCool && (now - lastCoolToggle) >= MIN_ON_TIME_MS) {
       coolOn = false;
+      lastCoolToggle = now;
     }
+  } else if (coolOn && (mode != "cool" || (now - lastCoolToggle) >= MIN_ON_TIME_MS)) {
+    // A stale sensor still honours the minimum on-time; leaving the mode stops at once.
+    coolOn = false;
+    lastCoolToggle = now;
+  }
 
-    // Fan timer (manual fan mode)
-    if (mode == "fan" && fanRequestMinutes > 0) {
-      fanRunUntil = now + (unsigned long)fanRequestMinutes * 60000UL;
-      uint32_t nowEpoch = (uint32_t)time(nullptr);
-      if (nowEpoch > 0) {
-        fanUntilEpoch = nowEpoch + (uint32_t)fanRequestMinutes * 60UL;
-      } else {
-        fanUntilEpoch = 0;
-      }
-      fanRequestMinutes = 0; // consume request
-      markConfigDirty();
+  // Fan timer (manual fan mode)
+  if (mode == "fan" && fanRequestMinutes > 0) {
+    fanRunUntil = now + (unsigned long)fanRequestMinutes * 60000UL;
+    uint32_t nowEpoch = (uint32_t)time(nullptr);
+    if (nowEpoch > 0) {
+      fanUntilEpoch = nowEpoch + (uint32_t)fanRequestMinutes * 60UL;
+    } else {
+      fanUntilEpoch = 0;
     }
-    if (fanRunUntil > 0 && now >= fanRunUntil) {
-      fanRunUntil = 0;
-      if (fanUntilEpoch != 0) {
-        fanUntilEpoch = 0;
-        markConfigDirty();
-      }
+    fanRequestMinutes = 0; // consume request
+    markConfigDirty();
+  }
+  if (fanRunUntil > 0 && now >= fanRunUntil) {
+    fanRunUntil = 0;
+    if (fanUntilEpoch != 0) {
+      fanUntilEpoch = 0;
+      markConfigDirty();
     }
+  }
 
-    fanOn = (fanRunUntil > 0) || heatOn || coolOn;
-
-    setOutput(HEAT_PIN, heatOn);
-    setOutput(COOL_PIN, coolOn);
-    setOutput(FAN_PIN, fanOn);
-    if (DEBUG_SERIAL) {
-      static bool lastHeat = false;
-      static bool lastCool = false;
-      static bool lastFan = false;
-      if (heatOn != lastHeat || coolOn != lastCool || fanOn != lastFan) {
-        Serial.printf("[OUTPUT] Heat %s -> %s | Cool %s -> %s | Fan %s -> %s\n",
-                      lastHeat ? "ON" : "OFF", heatOn ? "ON" : "OFF",
-                      lastCool ? "ON" : "OFF", coolOn ? "ON" : "OFF",
-                      lastFan ? "ON" : "OFF", fanOn ? "ON" : "OFF");
-        lastHeat = heatOn;
-        lastCool = coolOn;
-        lastFan = fanOn;
-      }
+  fanOn = (fanRunUntil > 0) || heatOn || coolOn;
+
+  setOutput(HEAT_PIN, heatOn);
+  setOutput(COOL_PIN, coolOn);
+  setOutput(FAN_PIN, fanOn);
+  histDutyPasses++;
+  if (heatOn || coolOn) histDutyOnPasses++;
+  runtimeTick();
+  if (DEBUG_SERIAL) {
+    static bool lastHeat = false;
+    static bool lastCool = false;
+    static bool lastFan = false;
+    if (heatOn != lastHeat || coolOn != lastCool || fanOn != lastFan) {
+      Serial.printf("[OUTPUT] Heat %s -> %s | Cool %s -> %s | Fan %s -> %s\n",
+                    lastHeat ? "ON" : "OFF", heatOn ? "ON" : "OFF",
+                    lastCool ? "ON" : "OFF", coolOn ? "ON" : "OFF",
+                    lastFan ? "ON" : "OFF", fanOn ? "ON" : "OFF");
+      lastHeat = heatOn;
+      lastCool = coolOn;
+      lastFan = fanOn;
     }
+  }
 
-    Serial.printf("Mode: %s | Temp: %s F | Hum: %s %% | RealFeel: %s F | Heat: %s | Cool: %s | Fan: %s | Set: %.1f | Diff: %.1f\n",
-                  mode.c_str(),
-                  isnan(lastTempF) ? "NaN" : String(lastTempF, 2).c_str(),
-                  isnan(lastHumidity) ? "NaN" : String(lastHumidity, 1).c_str(),
-                  isnan(lastHeatIndexF) ? "NaN" : String(lastHeatIndexF, 2).c_str(),
-                  heatOn ? "ON" : "OFF",
-                  coolOn ? "ON" : "OFF",
-                  fanOn ? "ON" : "OFF",
-                  setpointF, diffF);
-
-    // Log history once per interval (stores setpoint and control temperature)
-    if (now - lastHistLog >= HISTORY_INTERVAL_MS) {
-      lastHistLog = now;
-      float ctl = !isnan(lastHeatIndexF) ? lastHeatIndexF : lastTempF;
-      uint32_t ts = (uint32_t)time(nullptr);
-      if (ts == 0) ts = millis() / 1000; // fallback if no NTP yet
-      lastHistTs = ts;
-      lastHistCtl = ctl;
-      lastHistSetpoint = setpointF;
-      historyDirty = true;
-
-      if (histBaseEpoch == 0 || ts < histBaseEpoch || (ts - histBaseEpoch) > 3600000UL) {
-        histBaseEpoch = ts - (ts % 60);
-        histCount = 0;
-        histIndex = 0;
-      }
-      uint32_t minutes = (ts - histBaseEpoch) / 60;
-      if (minutes > 65535) {
-        histBaseEpoch = ts - (ts % 60);
-        histCount = 0;
-        histIndex = 0;
-        minutes = 0;
-      }
+  Serial.printf("Mode: %s | Temp: %s F | Hum: %s %% | RealFeel: %s F | Heat: %s | Cool: %s | Fan: %s | Set: %.1f | Diff: %.1f\n",
+                mode.c_str(),
+                isnan(lastTempF) ? "NaN" : String(lastTempF, 2).c_str(),
+                isnan(lastHumidity) ? "NaN" : String(lastHumidity, 1).c_str(),
+                isnan(lastHeatIndexF) ? "NaN" : String(lastHeatIndexF, 2).c_str(),
+                heatOn ? "ON" : "OFF",
+                coolOn ? "ON" : "OFF",
+                fanOn ? "ON" : "OFF",
+                setpointF, diffF);
+}
 
-      if (isnan(ctl)) histTemp10[histIndex] = HIST_NA;
-      else histTemp10[histIndex] = (int16_t)lroundf(ctl * 10.0f);
-      histSet10[histIndex] = (int16_t)lroundf(setpointF * 10.0f);
-      histMin[histIndex] = (uint16_t)minutes;
-      histIndex = (histIndex + 1) % HIST_MAX;
-      if (histCount < HIST_MAX) histCount++;
-      // SD append: timestamp, temperature, setpoint
-      if (sdReady) {
-        File f = SD.open("/history.csv", FILE_APPEND);
-        if (f) {
-          int written = f.printf("%lu,%.2f,%.2f\n", (unsigned long)ts, ctl, setpointF);
-          f.close();
-          lastSdWriteMs = now;
-          if (written > 0) {
-            lastSdWriteOk = true;
-            lastSdError = "ok";
-          } else {
-            lastSdWriteOk = false;
-            lastSdError = "write failed";
-            sdWriteFailures++;
-            Serial.println("SD write returned 0 bytes");
-          }
-        } else {
-          lastSdWriteMs = now;
-          lastSdWriteOk = false;
-          lastSdError = "open failed";
-          sdWriteFailures++;
-          sdReady = false; // stop trying until reboot
-          Serial.println("SD open failed; disabling SD logging");
-        }
-      }
+uint32_t modelChecksum(const ThermalModel &m) {
+  return esp_rom_crc32_le(0, (const uint8_t *)&m, offsetof(ThermalModel, crc));
+}
+
+void modelBegin() {
+  modelPrefs.begin("model", false);
+  ThermalModel m;
+  if (modelPrefs.getBytes("rates", &m, sizeof(m)) == sizeof(m) && m.magic == MODEL_MAGIC && m.crc == modelChecksum(m)) {
+    model = m;
+    Serial.printf("[MODEL] restored heat=%.2f cool=%.2f drift=%.2f F/h (%u/%u/%u windows)\n",
+                  model.heatFph, model.coolFph, model.driftFph, model.heatN, model.coolN, model.driftN);
+  }
+  modelLastSaveMs = millis();
+}
+
+// Storage job: the model moves slowly, so an hourly NVS write is plenty.
+void modelService() {
+  if (!modelDirty || millis() - modelLastSaveMs < MODEL_SAVE_INTERVAL_MS) return;
+  model.crc = modelChecksum(model);
+  modelPrefs.putBytes("rates", &model, sizeof(model));
+  modelDirty = false;
+  modelLastSaveMs = millis();
+}
+
+// Fits one window's slope into the rate for the relay state it covers. Early windows get
+// a larger weight so a fresh model converges in a few cycles.
+void modelCloseWindow(uint32_t endTs, float endF) {
+  if (modelWinStartTs == 0 || endTs < modelWinStartTs + MODEL_WINDOW_MIN_S || isnan(endF) || isnan(modelWinStartF)) return;
+  float slope = (endF - modelWinStartF) * 3600.0f / (float)(endTs - modelWinStartTs);
+  float predicted;
+  if (modelState == 1) {
+    predicted = model.driftFph + model.heatFph;
+    float a = max(MODEL_ALPHA, 1.0f / (model.heatN + 1));
+    model.heatFph = constrain(model.heatFph + a * ((slope - model.driftFph) - model.heatFph), 0.2f, 30.0f);
+    if (model.heatN < UINT16_MAX) model.heatN++;
+  } else if (modelState == 2) {
+    predicted = model.driftFph - model.coolFph;
+    float a = max(MODEL_ALPHA, 1.0f / (model.coolN + 1));
+    model.coolFph = constrain(model.coolFph + a * ((model.driftFph - slope) - model.coolFph), 0.2f, 30.0f);
+    if (model.coolN < UINT16_MAX) model.coolN++;
+  } else if (modelState == 0) {
+    predicted = model.driftFph;
+    float a = max(MODEL_ALPHA, 1.0f / (model.driftN + 1));
+    model.driftFph = constrain(model.driftFph + a * (slope - model.driftFph), -10.0f, 10.0f);
+    if (model.driftN < UINT16_MAX) model.driftN++;
+  } else {
+    return;
+  }
+  float err = fabsf(slope - predicted);
+  modelRateErrFph = isnan(modelRateErrFph) ? err : modelRateErrFph + MODEL_ALPHA * (err - modelRateErrFph);
+  modelDirty = true;
+}
+
+// Called once a minute from taskHistory with the control temperature. A window opens
+// MODEL_LAG_S after the relays change and closes at the next change or after
+// MODEL_WINDOW_MAX_S; anything shorter than MODEL_WINDOW_MIN_S is dropped.
+void modelObserve(uint32_t ts, float ctl) {
+  if (ts < UPLOAD_MIN_VALID_TS || isnan(ctl)) {
+    modelWinStartTs = 0;
+    modelPrevTs = 0;
+    return;
+  }
+  uint8_t st = (heatOn ? 1 : 0) | (coolOn ? 2 : 0);
+  if (st != modelState) {
+    if (modelPrevTs) modelCloseWindow(modelPrevTs, modelPrevF);
+    modelState = st;
+    modelStateSinceTs = ts;
+    modelWinStartTs = 0;
+  } else if (modelWinStartTs == 0) {
+    if (ts - modelStateSinceTs >= MODEL_LAG_S) {
+      modelWinStartTs = ts;
+      modelWinStartF = ctl;
+    }
+  } else if (ts - modelWinStartTs >= MODEL_WINDOW_MAX_S) {
+    modelCloseWindow(ts, ctl);
+    modelWinStartTs = ts;
+    modelWinStartF = ctl;
+  }
+  modelPrevTs = ts;
+  modelPrevF = ctl;
+}
+
+// Runs from taskControl. Looks for the next scheduled setpoint within PREHEAT_MAX_S and
+// applies it early once the model says the equipment needs that long (plus whatever is
+// left of MIN_OFF_TIME_MS) to get there. Min on/off times are still enforced by the
+// relay logic; the planner only moves the setpoint. A manual override suspends it.
+void planTick(float ctl) {
+  uint32_t now = (uint32_t)time(nullptr);
+  if (preheat.active) {
+    bool arrived = !isnan(ctl) && (preheat.heating ? ctl >= preheat.target - 0.05f : ctl <= preheat.target + 0.05f);
+    bool gaveUp = now >= preheat.blockTs + PREHEAT_GIVE_UP_S;
+    bool dropped = mode != (preheat.heating ? "heat" : "cool") || fabsf(setpointF - preheat.target) > 0.05f;
+    if (arrived || gaveUp) {
+      preheatLastErrMin = ((float)now - (float)preheat.blockTs) / 60.0f;
+      float absErr = fabsf(preheatLastErrMin);
+      preheatMeanAbsErrMin = isnan(preheatMeanAbsErrMin) ? absErr : preheatMeanAbsErrMin + MODEL_ALPHA * (absErr - preheatMeanAbsErrMin);
+      if (DEBUG_SERIAL) Serial.printf("[MODEL] %s to %.1f %s, error %+.1f min\n", preheat.heating ? "pre-heat" : "pre-cool",
+                                      preheat.target, arrived ? "arrived" : "gave up", preheatLastErrMin);
     }
+    if (arrived || gaveUp || dropped) preheat.active = false;
+    return;
+  }
+  if (now < UPLOAD_MIN_VALID_TS || isnan(ctl) || overrideUntilNextSchedule) return;
+  bool heating = (mode == "heat");
+  if (!heating && mode != "cool") return;
+  uint16_t n = heating ? model.heatN : model.coolN;
+  float rate = heating ? model.heatFph + model.driftFph : model.coolFph - model.driftFph;
+  if (n < MODEL_MIN_WINDOWS || model.driftN < MODEL_MIN_WINDOWS || rate < 0.5f) return;
 
-    if (displayReady && (millis() - lastDisplay >= DISPLAY_INTERVAL_MS)) {
-      lastDisplay = millis();
-      updateDisplay();
+  uint32_t blockTs = 0;
+  float sp = NAN;
+  // Schedule blocks start on local hours, which need not fall on UTC hours when the
+  // offset has minutes, so step the local clock and let mktime find each epoch.
+  time_t nowT = (time_t)now;
+  struct tm hourStart;
+  localtime_r(&nowT, &hourStart);
+  hourStart.tm_min = 0;
+  hourStart.tm_sec = 0;
+  for (int k = 1; k <= (int)(PREHEAT_MAX_S / 3600) + 1; k++) {
+    struct tm local = hourStart;
+    local.tm_hour += k;
+    local.tm_isdst = -1;
+    time_t t = mktime(&local);
+    if (t == (time_t)-1 || (uint32_t)t > now + PREHEAT_MAX_S) break;
+    if ((uint32_t)t <= now) continue;
+    sp = scheduleSP[local.tm_wday][local.tm_hour];
+    if (!isnan(sp)) {
+      blockTs = (uint32_t)t;
+      break;
     }
   }
+  if (blockTs == 0 || fabsf(sp - setpointF) < 0.05f) return;
+  float need = heating ? sp - ctl : ctl - sp;
+  if (need <= 0) return;
+
+  unsigned long ms = millis();
+  unsigned long sinceToggle = ms - (heating ? lastHeatToggle : lastCoolToggle);
+  bool relayOn = heating ? heatOn : coolOn;
+  uint32_t waitS = (!relayOn && sinceToggle < MIN_OFF_TIME_MS) ? (MIN_OFF_TIME_MS - sinceToggle) / 1000 : 0;
+  uint32_t leadS = (uint32_t)(need / rate * 3600.0f) + waitS;
+  if (now + leadS < blockTs) return;
+
+  setpointF = sp;
+  preheat = {true, heating, sp, now, blockTs};
+  preheatRuns++;
+  if (DEBUG_SERIAL) Serial.printf("[MODEL] %s to %.1f for block at %lu, %lu min ahead (need %.1f F at %.2f F/h)\n",
+                                  heating ? "pre-heat" : "pre-cool", sp, (unsigned long)blockTs,
+                                  (unsigned long)((blockTs - now) / 60), need, rate);
+}
+
+// Log history once per interval (stores setpoint and control temperature)
+void taskHistory() {
+  float ctl = controlTempF;
+  uint32_t ts = (uint32_t)time(nullptr);
+  if (ts == 0) ts = millis() / 1000; // fallback if no NTP yet
+  HistoryPoint point = {ts, isnan(ctl) ? HIST_NA : (int16_t)lroundf(ctl * 10.0f), (int16_t)lroundf(setpointF * 10.0f)};
+  // Until NTP syncs, uptime stamps would wipe a ring restored from SD; keep it instead.
+  if (ts >= UPLOAD_MIN_VALID_TS || histBaseEpoch < UPLOAD_MIN_VALID_TS) histRingPush(ts, point.temp10, point.set10);
+  uploadQueueAppend(point);
+  histSegAppend(point);
+  uint8_t duty = histDutyPasses ? (uint8_t)((histDutyOnPasses * 100UL) / histDutyPasses) : 0;
+  histDutyPasses = 0;
+  histDutyOnPasses = 0;
+  if (ts >= UPLOAD_MIN_VALID_TS) rollupAdd(ts - (ts % 60), point.temp10, point.set10, duty);
+  modelObserve(ts, ctl);
+  // SD append: timestamp, control temperature, setpoint, unfiltered control temperature
+  // (buffered; see sdLogAppend)
+  char line[56];
+  int len = snprintf(line, sizeof(line), "%lu,%.2f,%.2f,%.2f\n", (unsigned long)ts, ctl, setpointF, controlRawF);
+  if (len > 0) sdLogAppend(historyLog, line, (size_t)len, ts);
+}
 
-  logHealth();
-  tickCloudSync();
+void taskDisplay() {
+  if (displayReady) updateDisplay();
 }
 
 String makeToken() {
@@ -494,10 +1746,10 @@ String makeToken() {
   return String(buf);
 }
 
-bool isAuthenticated() {
+bool isAuthenticated(AsyncWebServerRequest *req) {
   if (sessionToken.length() == 0) return false;
   if ((unsigned long)(millis() - sessionStartMs) >= SESSION_TTL_MS) return false;
-  String cookie = server.header("Cookie");
+  String cookie = req->header("Cookie");
   if (cookie.length() == 0) return false;
   int idx = cookie.indexOf("session=");
   if (idx < 0) return false;
@@ -514,17 +1766,16 @@ bool onAuthorizedNetwork() {
   return WiFi.SSID() == String(AUTHORIZED_SSID);
 }
 
-bool canControl() {
-  return isAuthenticated() && onAuthorizedNetwork();
+bool canControl(AsyncWebServerRequest *req) {
+  return isAuthenticated(req) && onAuthorizedNetwork();
 }
 
-bool requireControlAuth() {
-  if (canControl()) return true;
-  if (server.method() == HTTP_GET) {
-    server.sendHeader("Location", "/login");
-    server.send(302, "text/plain", "login required");
+bool requireControlAuth(AsyncWebServerRequest *req) {
+  if (canControl(req)) return true;
+  if (req->method() == HTTP_GET) {
+    req->redirect("/login");
   } else {
-    server.send(401, "text/plain", "unauthorized");
+    req->send(401, "text/plain", "unauthorized");
   }
   return false;
 }
@@ -534,36 +1785,126 @@ void loadWifiCredentials() {
   wifiPass = prefs.getString("pass", DEFAULT_WIFI_PASSWORD);
 }
 
-bool connectWiFiWithTimeout(unsigned long timeoutMs) {
-  if (wifiSsid.length() == 0) return false;
-  WiFi.mode(apMode ? WIFI_AP_STA : WIFI_STA);
-  WiFi.begin(wifiSsid.c_str(), wifiPass.c_str());
-  unsigned long start = millis();
-  while (WiFi.status() != WL_CONNECTED && (millis() - start) < timeoutMs) {
-    delay(300);
-  }
-  if (WiFi.status() == WL_CONNECTED) {
-    wifiConnected = true;
-    apMode = false;
-    wifiIpStr = WiFi.localIP().toString();
-    WiFi.softAPdisconnect(true);
-    configTime(tzOffsetSec, dstOffsetSec, "pool.ntp.org", "time.nist.gov", "time.google.com");
-    Serial.printf("\nWiFi connected: %s (%s)\n", WiFi.SSID().c_str(), wifiIpStr.c_str());
-    lastConfigFetch = 0;
-    lastCloudPush = 0;
-    if (configDirty) lastConfigPush = 0;
-    return true;
-  }
-  wifiConnected = false;
-  return false;
+void wifiCacheLoad() {
+  wifiCachePrefs.begin("wifinet", false);
+  wifiCacheValid = wifiCachePrefs.getBytes("cache", &wifiCache, sizeof(wifiCache)) == sizeof(wifiCache) &&
+                   wifiCache.magic == WIFI_CACHE_MAGIC && wifiCache.channel != 0;
+  if (!wifiCacheValid) memset(&wifiCache, 0, sizeof(wifiCache));
 }
 
-void startWiFi() {
-  Serial.printf("Connecting to WiFi SSID: %s\n", wifiSsid.c_str());
-  if (!connectWiFiWithTimeout(WIFI_CONNECT_TIMEOUT_MS)) {
-    Serial.println("WiFi not connected; starting AP");
-    startAp();
+// Lease time of the address DHCP just bound on the station interface, 0 if unknown.
+uint32_t wifiDhcpLeaseSec() {
+  esp_netif_t *sta = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  struct netif *n = sta ? (struct netif *)esp_netif_get_netif_impl(sta) : nullptr;
+  struct dhcp *d = n ? netif_dhcp_data(n) : nullptr;
+  return d ? d->offered_t0_lease : 0;
+}
+
+bool wifiLeaseUsable() {
+  if (!WIFI_REUSE_LEASE || wifiCache.leaseSec == 0 || wifiCache.leaseStart == 0) return false;
+  uint32_t now = (uint32_t)time(nullptr);
+  if (now < UPLOAD_MIN_VALID_TS || now < wifiCache.leaseStart) return false;
+  return now - wifiCache.leaseStart < wifiCache.leaseSec / 2;
+}
+
+// Dates a DHCP lease once NTP has set the clock; until then it can't be reused.
+void wifiLeaseStamp() {
+  if (!wifiLeaseStampPending) return;
+  uint32_t now = (uint32_t)time(nullptr);
+  if (now < UPLOAD_MIN_VALID_TS) return;
+  wifiLeaseStampPending = false;
+  wifiCache.leaseStart = now - (millis() - wifiEvtGotIpMs) / 1000;
+  wifiCachePrefs.putBytes("cache", &wifiCache, sizeof(wifiCache));
+}
+
+// Only writes NVS when the AP, channel or lease actually changed. A link that reused the
+// cached address keeps the original lease; re-storing it as new would extend it forever.
+void wifiCacheStore() {
+  WifiCache c = {};
+  c.magic = WIFI_CACHE_MAGIC;
+  strlcpy(c.ssid, WiFi.SSID().c_str(), sizeof(c.ssid));
+  uint8_t *bssid = WiFi.BSSID();
+  if (bssid) memcpy(c.bssid, bssid, sizeof(c.bssid));
+  c.channel = (uint8_t)WiFi.channel();
+  c.ip = (uint32_t)WiFi.localIP();
+  c.gateway = (uint32_t)WiFi.gatewayIP();
+  c.mask = (uint32_t)WiFi.subnetMask();
+  c.dns = (uint32_t)WiFi.dnsIP(0);
+  if (!bssid || c.channel == 0 || c.ip == 0) return;
+  if (wifiLeaseReused) {
+    c.leaseStart = wifiCache.leaseStart;
+    c.leaseSec = wifiCache.leaseSec;
+  } else {
+    c.leaseSec = wifiDhcpLeaseSec();
+    uint32_t now = (uint32_t)time(nullptr);
+    c.leaseStart = now >= UPLOAD_MIN_VALID_TS ? now : 0;
+    wifiLeaseStampPending = c.leaseSec != 0 && c.leaseStart == 0;
   }
+  wifiCacheValid = true;
+  if (memcmp(&c, &wifiCache, sizeof(c)) == 0) return;
+  wifiCache = c;
+  wifiCachePrefs.putBytes("cache", &wifiCache, sizeof(wifiCache));
+  if (DEBUG_SERIAL) Serial.printf("[WIFI] cached %s ch %u\n", WiFi.BSSIDstr().c_str(), c.channel);
+}
+
+// Runs on the Wi-Fi event task: record what happened and let updateWiFiStatus() act on it.
+void onWifiEvent(arduino_event_t *event) {
+  switch (event->event_id) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      wifiEvtGotIpMs = millis();
+      wifiEvtGotIp = true;
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      // Our own disconnect() before a new begin() is not a link failure.
+      if (event->event_info.wifi_sta_disconnected.reason == WIFI_REASON_ASSOC_LEAVE) break;
+      wifiEvtReason = event->event_info.wifi_sta_disconnected.reason;
+      wifiEvtLost = true;
+      break;
+    default:
+      break;
+  }
+}
+
+// Starts an association and returns immediately. A fast join goes straight to the cached
+// BSSID on its channel (no scan) and, with WIFI_REUSE_LEASE and a lease short of its
+// renewal time, reuses the cached address instead of waiting on DHCP; a plain join scans
+// and asks DHCP.
+void wifiJoin(bool fast) {
+  if (wifiSsid.length() == 0) return;
+  wifiFastJoin = fast && wifiCacheValid && wifiSsid == wifiCache.ssid;
+  wifiEvtGotIp = false;
+  wifiEvtLost = false;
+  WiFi.disconnect();
+  WiFi.mode(apMode ? WIFI_AP_STA : WIFI_STA);
+  wifiLeaseReused = wifiFastJoin && wifiLeaseUsable();
+  wifiLeaseStampPending = false;
+  if (wifiLeaseReused) {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.mask), IPAddress(wifiCache.dns));
+  } else {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  }
+  if (wifiFastJoin) {
+    WiFi.begin(wifiSsid.c_str(), wifiPass.c_str(), wifiCache.channel, wifiCache.bssid);
+  } else {
+    WiFi.begin(wifiSsid.c_str(), wifiPass.c_str());
+  }
+  wifiJoinStartMs = millis();
+  lastWifiReconnect = wifiJoinStartMs;
+  wifiState = WIFI_JOINING;
+  if (DEBUG_SERIAL) Serial.printf("[WIFI] join %s (%s)\n", wifiSsid.c_str(), wifiFastJoin ? "cached" : "scan");
+}
+
+void startWiFi() {
+  Serial.printf("Connecting to WiFi SSID: %s\n", wifiSsid.c_str());
+  WiFi.persistent(false);       // credentials live in our own NVS namespace
+  WiFi.setAutoReconnect(false); // updateWiFiStatus() owns reconnects
+  WiFi.onEvent(onWifiEvent);
+  if (wifiSsid.length() == 0) {
+    startAp();
+    wifiState = WIFI_RETRY_WAIT;
+    return;
+  }
+  wifiJoin(true);
 }
 
 void startAp() {
@@ -578,20 +1919,65 @@ void startAp() {
   Serial.printf("AP started: %s (IP %s)\n", AP_SSID, wifiIpStr.c_str());
 }
 
+// Join failed outright: bring up the setup AP and retry on WIFI_RECONNECT_INTERVAL_MS.
+void wifiJoinFailed(const char *why) {
+  Serial.printf("WiFi join failed (%s); starting AP\n", why);
+  wifiState = WIFI_RETRY_WAIT;
+  if (!apMode) startAp();
+}
+
 void updateWiFiStatus() {
-  static unsigned long lastCheck = 0;
   unsigned long now = millis();
-  if (now - lastCheck < 1000) return;
-  lastCheck = now;
 
-  if (WiFi.status() == WL_CONNECTED) {
-    if (!wifiConnected) {
+  if (wifiJoinPending) {
+    wifiJoinPending = false;
+    Serial.printf("Joining WiFi SSID: %s\n", wifiSsid.c_str());
+    if (wifiConnected) {
+      wifiConnected = false;
+      Serial.println("WiFi disconnected");
+    }
+    wifiJoin(false);
+    return;
+  }
+
+  if (wifiEvtLost) {
+    wifiEvtLost = false;
+    wifiLastReason = wifiEvtReason;
+    if (wifiState == WIFI_UP) {
+      wifiConnected = false;
+      Serial.printf("WiFi disconnected (reason %u)\n", wifiLastReason);
+      wifiJoin(true);
+      return;
+    }
+    if (wifiState == WIFI_JOINING) {
+      // The cached AP may have moved or gone; scan for it before giving up.
+      if (wifiFastJoin) {
+        wifiCacheValid = false;
+        wifiJoin(false);
+      } else {
+        wifiJoinFailed("rejected");
+      }
+      return;
+    }
+  }
+
+  if (wifiEvtGotIp && WiFi.status() == WL_CONNECTED) {
+    wifiEvtGotIp = false;
+    if (wifiState != WIFI_UP) {
+      wifiState = WIFI_UP;
       wifiConnected = true;
-      apMode = false;
+      wifiLastJoinMs = wifiEvtGotIpMs - wifiJoinStartMs;
+      wifiJoins++;
+      if (wifiFastJoin) wifiFastJoins++;
       wifiIpStr = WiFi.localIP().toString();
-      WiFi.softAPdisconnect(true);
+      if (apMode) {
+        WiFi.softAPdisconnect(true);
+        apMode = false;
+      }
+      wifiCacheStore();
       configTime(tzOffsetSec, dstOffsetSec, "pool.ntp.org", "time.nist.gov", "time.google.com");
-      Serial.printf("WiFi reconnected: %s (%s)\n", WiFi.SSID().c_str(), wifiIpStr.c_str());
+      Serial.printf("WiFi connected: %s (%s) in %lu ms%s\n", WiFi.SSID().c_str(), wifiIpStr.c_str(),
+                    wifiLastJoinMs, wifiFastJoin ? " (cached)" : "");
       lastConfigFetch = 0;
       lastCloudPush = 0;
       if (configDirty) lastConfigPush = 0;
@@ -599,316 +1985,911 @@ void updateWiFiStatus() {
     return;
   }
 
-  if (wifiConnected) {
-    wifiConnected = false;
-    Serial.println("WiFi disconnected");
+  if (wifiState == WIFI_UP) {
+    wifiLeaseStamp();
+    // A reused address is static as far as the stack knows and never renews; rejoin through
+    // DHCP before the lease reaches its renewal time.
+    if (wifiLeaseReused && !wifiLeaseUsable()) {
+      wifiConnected = false;
+      if (DEBUG_SERIAL) Serial.println("[WIFI] cached lease at renewal time; rejoining via DHCP");
+      wifiJoin(true);
+    }
+    return;
   }
-  if (!apMode) startAp();
-  if (apMode) wifiIpStr = WiFi.softAPIP().toString();
 
-  if (wifiSsid.length() > 0 && (now - lastWifiReconnect) >= WIFI_RECONNECT_INTERVAL_MS) {
-    WiFi.mode(WIFI_AP_STA);
-    WiFi.begin(wifiSsid.c_str(), wifiPass.c_str());
-    lastWifiReconnect = now;
+  if (wifiState == WIFI_JOINING) {
+    if (wifiFastJoin && (now - wifiJoinStartMs) >= WIFI_FAST_JOIN_TIMEOUT_MS) {
+      wifiCacheValid = false;
+      wifiJoin(false);
+    } else if ((now - wifiJoinStartMs) >= WIFI_CONNECT_TIMEOUT_MS) {
+      wifiJoinFailed("timeout");
+    }
+    return;
+  }
+
+  if (wifiState == WIFI_RETRY_WAIT) {
+    if (apMode) wifiIpStr = WiFi.softAPIP().toString();
+    if (wifiSsid.length() > 0 && (now - lastWifiReconnect) >= WIFI_RECONNECT_INTERVAL_MS) {
+      wifiJoin(true);
+    }
   }
 }
 
-void handleLogin() {
-  String msg;
-  if (server.method() == HTTP_POST) {
-    String user = server.arg("user");
-    String pass = server.arg("pass");
+void handleLogin(AsyncWebServerRequest *req) {
+  if (req->method() == HTTP_POST) {
+    String user = req->arg("user");
+    String pass = req->arg("pass");
     if (user == ADMIN_USER && pass == ADMIN_PASSWORD) {
       sessionToken = makeToken();
       sessionStartMs = millis();
       String cookie = "session=" + sessionToken + "; Path=/; HttpOnly; SameSite=Strict; Max-Age=" + String(SESSION_TTL_MS / 1000);
-      server.sendHeader("Set-Cookie", cookie);
-      server.sendHeader("Location", "/thermostat");
-      server.send(303, "text/plain", "signed in");
+      AsyncWebServerResponse *res = req->beginResponse(303, "text/plain", "signed in");
+      res->addHeader("Set-Cookie", cookie);
+      res->addHeader("Location", "/thermostat");
+      req->send(res);
       return;
     }
-    msg = "Invalid credentials.";
+    req->redirect("/login?error=1", 303);
+    return;
   }
-
-  bool signedIn = isAuthenticated();
-  bool onNet = onAuthorizedNetwork();
-  String netLabel = onNet ? "Authorized network" : "Not on authorized network";
-
-  String page;
-  page += F("<!doctype html><html><head><meta charset='UTF-8'><meta name='viewport' content='width=device-width,initial-scale=1'>");
-  page += F("<style>body{font-family:'Segoe UI',sans-serif;background:#0e1117;color:#e6e9f0;display:flex;justify-content:center;align-items:flex-start;min-height:100vh;padding:16px;} .card{background:#171b23;border-radius:18px;box-shadow:0 12px 30px rgba(0,0,0,0.45);width:460px;padding:20px;} h1{font-size:1.2rem;margin:0 0 8px;} .nav{display:flex;gap:10px;margin:8px 0 12px;} .nav a{background:#232a36;color:#e6e9f0;text-decoration:none;padding:8px 12px;border-radius:10px;box-shadow:0 6px 12px rgba(0,0,0,0.25);} .nav a.active{background:#2f74ff;} .pill{background:#232a36;border-radius:14px;padding:10px;display:flex;align-items:center;justify-content:space-between;margin:8px 0;} label{display:block;margin:6px 0 4px;} input{width:100%;padding:10px;border-radius:10px;border:1px solid #2b3442;background:#0f141c;color:#e6e9f0;} button{border:none;border-radius:10px;background:#2f74ff;color:#fff;padding:10px 14px;font-size:1rem;cursor:pointer;box-shadow:0 6px 12px rgba(0,0,0,0.25);width:100%;margin-top:10px;} .hint{color:#8a93a8;font-size:0.85rem;} a{color:#8fb3ff;} </style>");
-  page += F("</head><body><div class='card'>");
-  page += F("<div class='row'><h1>Sign In</h1><div></div></div>");
-  page += "<div class='nav'><a href='/thermostat'>Thermostat</a><a href='/schedule'>Schedule</a><a href='/history'>History</a><a href='/system_status'>System</a><a href='/wifi'>WiFi</a><a class='active' href='/login'>Sign in</a></div>";
-  page += "<div class='pill'><label>Status</label><div>" + String(signedIn ? "Signed in" : "Signed out") + " | " + netLabel + "</div></div>";
-  if (msg.length() > 0) {
-    page += "<div class='hint'>" + msg + "</div>";
-  }
-  if (signedIn) {
-    page += "<div class='pill'><label>Session</label><div><a href='/logout'>Sign out</a></div></div>";
-  }
-  page += F("<form method='POST' action='/login'>");
-  page += F("<label for='user'>User</label><input id='user' name='user' autocomplete='username' required>");
-  page += F("<label for='pass'>Password</label><input id='pass' name='pass' type='password' autocomplete='current-password' required>");
-  page += F("<button type='submit'>Sign in</button>");
-  page += F("</form>");
-  page += F("<div class='hint'>Only signed-in users on the authorized network can change settings.</div>");
-  page += F("</div></body></html>");
-  server.send(200, "text/html", page);
+  sendAsset(req, "/login");
 }
 
-void handleLogout() {
+void handleLogout(AsyncWebServerRequest *req) {
   sessionToken = "";
   sessionStartMs = 0;
-  server.sendHeader("Set-Cookie", "session=; Max-Age=0; Path=/");
-  server.sendHeader("Location", "/thermostat");
-  server.send(303, "text/plain", "signed out");
+  AsyncWebServerResponse *res = req->beginResponse(303, "text/plain", "signed out");
+  res->addHeader("Set-Cookie", "session=; Max-Age=0; Path=/");
+  res->addHeader("Location", "/thermostat");
+  req->send(res);
 }
 
-void handleWifiPage() {
-  bool connected = (WiFi.status() == WL_CONNECTED);
-  bool allowEdit = !connected || canControl();
-  String modeLabel = connected ? "Connected" : (apMode ? "AP mode" : "Offline");
-  String ssidLabel = connected ? WiFi.SSID() : (apMode ? String(AP_SSID) : String(""));
-  String ipLabel = connected ? WiFi.localIP().toString() : (apMode ? WiFi.softAPIP().toString() : String("0.0.0.0"));
-
-  String page;
-  page += F("<!doctype html><html><head><meta charset='UTF-8'><meta name='viewport' content='width=device-width,initial-scale=1'>");
-  page += F("<style>body{font-family:'Segoe UI',sans-serif;background:#0e1117;color:#e6e9f0;display:flex;justify-content:center;align-items:flex-start;min-height:100vh;padding:16px;} .card{background:#171b23;border-radius:18px;box-shadow:0 12px 30px rgba(0,0,0,0.45);width:460px;padding:20px;} h1{font-size:1.2rem;margin:0 0 8px;} .nav{display:flex;gap:10px;margin:8px 0 12px;} .nav a{background:#232a36;color:#e6e9f0;text-decoration:none;padding:8px 12px;border-radius:10px;box-shadow:0 6px 12px rgba(0,0,0,0.25);} .nav a.active{background:#2f74ff;} .pill{background:#232a36;border-radius:14px;padding:10px;display:flex;align-items:center;justify-content:space-between;margin:8px 0;} label{display:block;margin:6px 0 4px;} input{width:100%;padding:10px;border-radius:10px;border:1px solid #2b3442;background:#0f141c;color:#e6e9f0;} button{border:none;border-radius:10px;background:#2f74ff;color:#fff;padding:10px 14px;font-size:1rem;cursor:pointer;box-shadow:0 6px 12px rgba(0,0,0,0.25);width:100%;margin-top:10px;} button:disabled{opacity:0.6;cursor:not-allowed;} .hint{color:#8a93a8;font-size:0.85rem;} a{color:#8fb3ff;} </style>");
-  page += F("</head><body><div class='card'>");
-  page += F("<div class='row'><h1>WiFi Setup</h1><div></div></div>");
-  page += "<div class='nav'><a href='/thermostat'>Thermostat</a><a href='/schedule'>Schedule</a><a href='/history'>History</a><a href='/system_status'>System</a><a class='active' href='/wifi'>WiFi</a><a href='/login'>Sign in</a></div>";
-  page += "<div class='pill'><label>Status</label><div class='val'>" + modeLabel + "</div></div>";
-  if (ssidLabel.length() > 0) {
-    page += "<div class='pill'><label>SSID</label><div class='val'>" + ssidLabel + "</div></div>";
-  }
-  page += "<div class='pill'><label>IP</label><div class='val'>" + ipLabel + "</div></div>";
-  if (!allowEdit && connected) {
-    page += "<div class='hint'>Sign in on the authorized network to change WiFi settings.</div>";
-  } else if (!connected) {
-    page += "<div class='hint'>Connect to the AP and enter WiFi credentials to join your network.</div>";
-  }
-  page += F("<form method='POST' action='/wifi'>");
-  page += "<label for='ssid'>SSID</label><input id='ssid' name='ssid' value='" + wifiSsid + "'" + String(allowEdit ? "" : " disabled") + ">";
-  page += "<label for='pass'>Password</label><input id='pass' name='pass' type='password' value='' " + String(allowEdit ? "" : " disabled") + ">";
-  page += "<button type='submit'" + String(allowEdit ? "" : " disabled") + ">Save and connect</button>";
-  page += F("</form>");
-  page += F("<div class='hint'>Saved credentials persist across reboots.</div>");
-  page += F("</div></body></html>");
-  server.send(200, "text/html", page);
+void handleWifiPage(AsyncWebServerRequest *req) {
+  sendAsset(req, "/wifi");
 }
 
-void handleWifiSave() {
-  if (wifiConnected && !canControl()) {
-    server.sendHeader("Location", "/login");
-    server.send(302, "text/plain", "login required");
+// Joining a network takes seconds, far too long for the AsyncTCP task, so the handler only
+// stores the credentials and flags the join; updateWiFiStatus() starts it on the loop task.
+void handleWifiSave(AsyncWebServerRequest *req) {
+  if (wifiConnected && !canControl(req)) {
+    req->redirect("/login");
     return;
   }
-  String ssid = server.arg("ssid");
-  String pass = server.arg("pass");
+  String ssid = req->arg("ssid");
+  String pass = req->arg("pass");
   ssid.trim();
   if (ssid.length() == 0) {
-    server.send(400, "text/plain", "ssid required");
+    req->send(400, "text/plain", "ssid required");
     return;
   }
   wifiSsid = ssid;
   wifiPass = pass;
   prefs.putString("ssid", wifiSsid);
   prefs.putString("pass", wifiPass);
-
-  bool ok = connectWiFiWithTimeout(WIFI_CONNECT_TIMEOUT_MS);
-  if (!ok) startAp();
-  String targetIp = ok ? WiFi.localIP().toString() : (apMode ? WiFi.softAPIP().toString() : wifiIpStr);
+  wifiJoinPending = true;
 
   String page;
   page += F("<!doctype html><html><head><meta charset='UTF-8'><meta name='viewport' content='width=device-width,initial-scale=1'>");
-  page += F("<style>body{font-family:'Segoe UI',sans-serif;background:#0e1117;color:#e6e9f0;display:flex;justify-content:center;align-items:flex-start;min-height:100vh;padding:16px;} .card{background:#171b23;border-radius:18px;box-shadow:0 12px 30px rgba(0,0,0,0.45);width:460px;padding:20px;} h1{font-size:1.2rem;margin:0 0 8px;} .pill{background:#232a36;border-radius:14px;padding:10px;display:flex;align-items:center;justify-content:space-between;margin:8px 0;} a{color:#8fb3ff;} </style>");
+  page += F("<title>WiFi Update</title><link rel='stylesheet' href='/app.css'>");
   page += F("</head><body><div class='card'>");
   page += F("<div class='row'><h1>WiFi Update</h1><div></div></div>");
-  page += "<div class='pill'><label>Status</label><div class='val'>" + String(ok ? "Connected" : "Not connected") + "</div></div>";
-  page += "<div class='pill'><label>IP</label><div class='val'>" + targetIp + "</div></div>";
-  if (ok) {
-    page += "<div>Open <a href='http://" + targetIp + "/thermostat'>http://" + targetIp + "/thermostat</a></div>";
-  } else {
-    page += "<div>Stay on the AP and try again.</div>";
-  }
+  page += "<div class='pill'><label>Status</label><div class='val'>Joining</div></div>";
+  page += "<div class='pill'><label>SSID</label><div class='val'>" + wifiSsid + "</div></div>";
+  page += "<div>Once connected the new IP is shown on the display. If the join fails the thermostat stays on the " + String(AP_SSID) + " access point; reconnect there and try again.</div>";
   page += F("</div></body></html>");
-  server.send(200, "text/html", page);
+  req->send(200, "text/html", page);
 }
 
-void handleThermostat() {
-  // Determine schedule/manual status for display
-  String schedLabel = "Manual";
-  String schedVal = String(setpointF, 1) + " F";
-  struct tm timeinfo;
-  if (getLocalTime(&timeinfo)) {
-    int d = timeinfo.tm_wday;
-    int h = timeinfo.tm_hour;
-    if (d >= 0 && d < 7 && h >= 0 && h < 24) {
-      float sp = scheduleSP[d][h];
-      if (!overrideUntilNextSchedule && !isnan(sp)) {
-        schedLabel = "Scheduled";
-        schedVal = String(sp, 1) + " F";
-      } else {
-        schedLabel = "Manual";
-        schedVal = String(setpointF, 1) + " F";
+void handleThermostat(AsyncWebServerRequest *req) {
+  sendAsset(req, "/thermostat");
+}
+
+void handleSchedule(AsyncWebServerRequest *req) {
+  sendAsset(req, "/schedule");
+}
+
+void handleScheduleData(AsyncWebServerRequest *req) {
+  JsonWriter w;
+  JsonSlot *slot = jsonBegin(req, w);
+  if (!slot) return;
+  jwObject(w);
+  jwArray(w, "schedule");
+  for (int d = 0; d < 7; d++) {
+    jwArray(w);
+    for (int h = 0; h < 24; h++) jwFixed(w, nullptr, scheduleSP[d][h], 1);
+    jwEndArray(w);
+  }
+  jwEndArray(w);
+  jwEndObject(w);
+  jsonSend(req, slot, w);
+}
+
+void histRingPush(uint32_t ts, int16_t temp10, int16_t set10) {
+  if (histBaseEpoch == 0 || ts < histBaseEpoch || (ts - histBaseEpoch) > 3600000UL) {
+    histBaseEpoch = ts - (ts % 60);
+    histCount = 0;
+    histIndex = 0;
+  }
+  uint32_t minutes = (ts - histBaseEpoch) / 60;
+  if (minutes > 65535) {
+    histBaseEpoch = ts - (ts % 60);
+    histCount = 0;
+    histIndex = 0;
+    minutes = 0;
+  }
+
+  histTemp10[histIndex] = temp10;
+  histSet10[histIndex] = set10;
+  histMin[histIndex] = (uint16_t)minutes;
+  histIndex = (histIndex + 1) % HIST_MAX;
+  if (histCount < HIST_MAX) histCount++;
+  histPushes++;
+}
+
+// Ring helpers: logical index 0 is the oldest sample still held.
+int histRingIndex(int i) {
+  return (histIndex - histCount + i + 2 * HIST_MAX) % HIST_MAX;
+}
+
+uint32_t histTsAt(int i) {
+  return histBaseEpoch + ((uint32_t)histMin[histRingIndex(i)] * 60UL);
+}
+
+// First logical index with ts >= target (ring timestamps are monotonic between resets).
+int histLowerBound(uint32_t target) {
+  int lo = 0;
+  int hi = histCount;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (histTsAt(mid) < target) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+struct HistQuery {
+  uint32_t fromTs;
+  uint32_t toTs;
+  uint32_t stepSec;
+};
+
+// Walks SD segments for everything older than the RAM ring, then the ring itself.
+struct HistCursor {
+  HistQuery q;
+  uint32_t nextTs;
+  uint32_t ringStartTs;  // SD serves ts below this
+  uint32_t segDay;       // next/current UTC day; past segLastDay once SD is exhausted
+  uint32_t segLastDay;
+  File seg;
+  HistSegHeader segHdr;
+  uint32_t segRec;
+  uint32_t segCount;
+  int i;                 // logical ring index, valid while pushes == histPushes
+  uint32_t pushes;
+  uint32_t lastTs;       // last point yielded, 0 before the first
+};
+
+// Optional args shared by the history endpoints: from/to (epoch seconds) bound the range,
+// step (seconds) downsamples by keeping the first point of each step.
+HistQuery histQueryFromArgs(AsyncWebServerRequest *req) {
+  HistQuery q;
+  q.fromTs = req->hasArg("from") ? strtoul(req->arg("from").c_str(), nullptr, 10) : 0;
+  q.toTs = req->hasArg("to") ? strtoul(req->arg("to").c_str(), nullptr, 10) : UINT32_MAX;
+  q.stepSec = req->hasArg("step") ? strtoul(req->arg("step").c_str(), nullptr, 10) : 0;
+  return q;
+}
+
+void histSegFormatPath(char *out, size_t cap, uint32_t day) {
+  time_t t = (time_t)day * 86400;
+  struct tm utc;
+  gmtime_r(&t, &utc);
+  snprintf(out, cap, "%s/%04d%02d%02d.bin", HIST_SEG_DIR, utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday);
+}
+
+bool histSegCreate(SdLog &log) {
+  HistSegHeader h;
+  h.magic = HIST_SEG_MAGIC;
+  h.version = HIST_SEG_VERSION;
+  h.recSize = sizeof(HistoryPoint);
+  h.sealed = 0;
+  h.reserved = 0;
+  h.dayStart = histSegDay * 86400UL;
+  for (int i = 0; i < 24; i++) h.hourFirst[i] = HIST_SEG_NONE;
+  if (log.file.write((const uint8_t *)&h, sizeof(h)) != sizeof(h)) return false;
+  log.fileBytes += sizeof(h);
+  return true;
+}
+
+// Timestamps are stored on the minute like the RAM ring.
+void histSegAppend(HistoryPoint p) {
+  if (p.ts < UPLOAD_MIN_VALID_TS) return;
+  p.ts -= p.ts % 60;
+  uint32_t day = p.ts / 86400;
+  if (day != histSegDay) {
+    // Best effort: if the card is down the old day's tail lands in the new segment.
+    sdLogClose(histSegLog);
+    // After a reboot the previous day may still be unsealed; sealing is idempotent.
+    histSegSealDay = histSegDay ? histSegDay : day - 1;
+    histSegDay = day;
+    histSegFormatPath(histSegPath, sizeof(histSegPath), day);
+  }
+  sdLogAppend(histSegLog, &p, sizeof(p), p.ts);
+}
+
+bool histSegOpen(File &f, HistSegHeader &h, uint32_t &count, uint32_t day, const char *mode) {
+  char path[24];
+  histSegFormatPath(path, sizeof(path), day);
+  if (!SD.exists(path)) return false;
+  f = SD.open(path, mode);
+  if (!f) return false;
+  if (f.read((uint8_t *)&h, sizeof(h)) != sizeof(h) || h.magic != HIST_SEG_MAGIC ||
+      h.version != HIST_SEG_VERSION || h.recSize != sizeof(HistoryPoint)) {
+    f.close();
+    return false;
+  }
+  count = (f.size() - sizeof(h)) / sizeof(HistoryPoint);
+  return true;
+}
+
+bool histSegRead(File &f, uint32_t rec, HistoryPoint &p) {
+  if (!f.seek(sizeof(HistSegHeader) + rec * sizeof(HistoryPoint))) return false;
+  return f.read((uint8_t *)&p, sizeof(p)) == sizeof(p);
+}
+
+// First record with ts >= target, narrowed by the hour index when the segment is sealed.
+uint32_t histSegLowerBound(File &f, const HistSegHeader &h, uint32_t count, uint32_t target) {
+  uint32_t lo = 0;
+  uint32_t hi = count;
+  if (h.sealed && target > h.dayStart) {
+    uint32_t hour = (target - h.dayStart) / 3600;
+    if (hour < 24) {
+      lo = min(h.hourFirst[hour], count);
+      if (hour < 23) hi = min(h.hourFirst[hour + 1], count);
+    } else {
+      lo = count;
+    }
+  }
+  HistoryPoint p;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (!histSegRead(f, mid, p)) return count;
+    if (p.ts < target) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Writes hourFirst[] for a finished day. Runs from the storage job.
+void histSegSeal(uint32_t day) {
+  File f;
+  HistSegHeader h;
+  uint32_t count = 0;
+  if (!histSegOpen(f, h, count, day, "r+")) return;
+  if (h.sealed) {
+    f.close();
+    return;
+  }
+  HistoryPoint recs[32];
+  uint32_t rec = 0;
+  int hour = 0;
+  while (rec < count && hour < 24) {
+    size_t got = f.read((uint8_t *)recs, sizeof(recs)) / sizeof(HistoryPoint);
+    if (got == 0) break;
+    for (size_t k = 0; k < got && hour < 24; k++, rec++) {
+      while (hour < 24 && recs[k].ts >= h.dayStart + (uint32_t)hour * 3600UL) h.hourFirst[hour++] = rec;
+    }
+  }
+  while (hour < 24) h.hourFirst[hour++] = count;
+  h.sealed = 1;
+  if (f.seek(0)) f.write((const uint8_t *)&h, sizeof(h));
+  f.close();
+  if (DEBUG_SERIAL) Serial.printf("[HIST] sealed day %lu (%lu records)\n", (unsigned long)day, (unsigned long)count);
+}
+
+// Days since 1970-01-01 for a civil (proleptic Gregorian) date.
+uint32_t histDayFromYmd(int y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = (unsigned)(y - era * 400);
+  unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (uint32_t)(era * 146097 + (int)doe - 719468);
+}
+
+// Refills the RAM ring from the newest day segments so a reboot doesn't blank the charts;
+// the segments are already the append journal, so nothing extra is written while running.
+// The newest file on the card stands in for "today", which works before NTP has synced.
+// Whatever was still buffered in histSegLog (up to SDLOG_FLUSH_MS) at power loss is gone.
+void histRestore() {
+  const uint8_t RESTORE_DAYS = 8; // 7-day ring plus the partial day at its start
+  uint32_t days[RESTORE_DAYS] = {0}; // newest first
+  File dir = SD.open(HIST_SEG_DIR);
+  if (!dir || !dir.isDirectory()) return;
+  unsigned long startMs = millis();
+  for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+    const char *name = strrchr(f.name(), '/');
+    name = name ? name + 1 : f.name();
+    unsigned y, m, d;
+    bool ok = strlen(name) == 12 && sscanf(name, "%4u%2u%2u.bin", &y, &m, &d) == 3 && m >= 1 && m <= 12 && d >= 1 && d <= 31;
+    f.close();
+    if (!ok) continue;
+    uint32_t day = histDayFromYmd((int)y, m, d);
+    for (uint8_t i = 0; i < RESTORE_DAYS; i++) {
+      if (day == days[i]) break;
+      if (day > days[i]) {
+        memmove(&days[i + 1], &days[i], (RESTORE_DAYS - 1 - i) * sizeof(days[0]));
+        days[i] = day;
+        break;
       }
     }
   }
+  dir.close();
 
-  bool signedIn = isAuthenticated();
-  bool onNet = onAuthorizedNetwork();
-  bool canEdit = signedIn && onNet;
-  String authNote;
-  if (!signedIn) authNote = "Read-only. <a href='/login'>Sign in</a>.";
-  else if (!onNet) {
-    if (WiFi.status() != WL_CONNECTED) authNote = "Signed in, but WiFi is offline.";
-    else authNote = "Signed in, but not on " + String(AUTHORIZED_SSID) + ".";
+  // Oldest day first; once the ring is full the oldest samples fall off as usual.
+  uint32_t restored = 0;
+  for (int i = RESTORE_DAYS - 1; i >= 0; i--) {
+    if (days[i] == 0) continue;
+    File f;
+    HistSegHeader h;
+    uint32_t count = 0;
+    if (!histSegOpen(f, h, count, days[i], FILE_READ)) continue;
+    HistoryPoint recs[32];
+    size_t got;
+    while ((got = f.read((uint8_t *)recs, sizeof(recs)) / sizeof(HistoryPoint)) > 0) {
+      for (size_t k = 0; k < got; k++) {
+        if (recs[k].ts < UPLOAD_MIN_VALID_TS) continue;
+        histRingPush(recs[k].ts, recs[k].temp10, recs[k].set10);
+        restored++;
+      }
+    }
+    f.close();
+  }
+  if (restored) {
+    Serial.printf("[HIST] restored %lu samples (%d in ring) in %lu ms\n",
+                  (unsigned long)restored, histCount, millis() - startMs);
   }
-  else authNote = "Signed in. <a href='/logout'>Sign out</a>.";
-  String wifiLine;
-  if (wifiConnected) wifiLine = "WiFi: " + WiFi.SSID() + " | IP: " + wifiIpStr;
-  else if (apMode) wifiLine = "AP: " + String(AP_SSID) + " | IP: " + wifiIpStr;
-  else wifiLine = "WiFi: disconnected";
+}
 
-  String page;
-  page += F("<!doctype html><html><head><meta charset='UTF-8'><meta name='viewport' content='width=device-width,initial-scale=1'>");
-  page += F("<style>body{font-family:'Segoe UI',sans-serif;background:#0e1117;color:#e6e9f0;display:flex;justify-content:center;align-items:flex-start;min-height:100vh;padding:16px;} .card{background:#171b23;border-radius:18px;box-shadow:0 12px 30px rgba(0,0,0,0.45);width:460px;padding:20px;} h1{font-size:1.2rem;margin:0 0 8px;} .row{display:flex;align-items:center;justify-content:space-between;margin:6px 0;} .badge{padding:6px 10px;border-radius:12px;font-size:0.9rem;background:#232a36;} .big-temp{font-size:3.2rem;font-weight:700;text-align:center;margin:6px 0;} .mini{font-size:0.9rem;color:#a9b3c6;text-align:center;} .controls{display:flex;justify-content:space-around;margin:12px 0;} button.adj{width:68px;height:68px;border-radius:50%;border:none;font-size:2rem;color:#fefefe;background:#2f74ff;box-shadow:0 8px 18px rgba(47,116,255,0.35);cursor:pointer;} button.adj.minus{background:#334155;} .pill{background:#232a36;border-radius:14px;padding:10px;display:flex;align-items:center;justify-content:space-between;margin:8px 0;} .pill label{margin:0;font-size:0.95rem;} .pill .val{font-size:1.1rem;font-weight:600;} .hiddenField{display:none;} .footer{margin-top:14px;font-size:0.85rem;color:#8a93a8;text-align:center;} a{color:#8fb3ff;} .mode-buttons{display:flex;gap:8px;margin:8px 0;} .mode-buttons button{flex:1;padding:12px;border:none;border-radius:10px;font-size:1rem;font-weight:600;color:#fefefe;cursor:pointer;background:#232a36;} .mode-buttons button.active{background:#2f74ff;} .led{display:inline-block;width:10px;height:10px;border-radius:50%;margin-left:6px;background:#444;} .led.on{background:#30d158;} .nav{display:flex;gap:10px;margin:8px 0 12px;} .nav a{background:#232a36;color:#e6e9f0;text-decoration:none;padding:8px 12px;border-radius:10px;box-shadow:0 6px 12px rgba(0,0,0,0.25);} .nav a.active{background:#2f74ff;} .hide{display:none;} </style>");
-  page += F("<script>let setVal=");
-  page += String(setpointF, 1);
-  page += F(", diffVal=");
-  page += String(diffF, 1);
-  page += F(", fanVal=0; const canControl=");
-  page += String(canEdit ? "true" : "false");
-  page += F("; let warned=false; let fanHold=null, fanHoldTimeout=null; function guard(){if(canControl)return true; if(!warned){alert('Sign in to change settings.'); warned=true;} return false;} function updateInputs(){document.getElementById('setVal').textContent=setVal.toFixed(1);document.getElementById('diffVal').textContent=diffVal.toFixed(1);document.getElementById('fanVal').textContent=fanVal.toFixed(0);document.getElementById('setpointInput').value=setVal.toFixed(1);document.getElementById('diffInput').value=diffVal.toFixed(1);document.getElementById('fanInput').value=fanVal.toFixed(0);} function adjust(type,delta,min,max){if(!guard())return; if(type==='set'){setVal=Math.min(Math.max(setVal+delta,min),max);}else if(type==='diff'){diffVal=Math.min(Math.max(diffVal+delta,min),max);}else if(type==='fan'){fanVal=Math.min(Math.max(fanVal+delta,min),max);}updateInputs();} function startFanHold(delta){if(!guard())return; stopFanHold();fanHoldTimeout=setTimeout(()=>{fanHold=setInterval(()=>adjust('fan',delta,0,60),500);},1000);} function stopFanHold(){clearTimeout(fanHoldTimeout);fanHoldTimeout=null;clearInterval(fanHold);fanHold=null;} function quickMode(m){if(!guard())return; document.getElementsByName('mode')[0].value=m; if(m==='fan'){let v=prompt('Fan minutes (0-60)','5'); if(v===null)return; fanVal=Math.min(Math.max(parseInt(v)||0,0),60); updateInputs();} document.forms[0].submit();} async function refresh(){try{const r=await fetch('/status');if(!r.ok)return;const d=await r.json();['mode','temp','hum','feel','heat','cool','fan'].forEach(id=>{const el=document.getElementById(id);if(el)el.textContent=d[id];}); document.getElementById('modeBadge').textContent=d.mode; document.getElementById('mode').textContent=d.mode; const led=document.getElementById('led'); const active = (d.heat==='ON'||d.cool==='ON'||d.fan==='ON'); if(led){led.className = 'led' + (active ? ' on' : '');} const fanRow=document.getElementById('fanRow'); const fanPill=document.getElementById('fanPill'); if(fanRow)fanRow.style.display = d.mode==='fan' ? 'block' : 'none'; if(fanPill)fanPill.style.display = d.mode==='fan' ? 'flex' : 'none'; }catch(e){}} async function sendTz(){if(!canControl)return; try{const offsetSec = -new Date().getTimezoneOffset()*60; await fetch('/tz?offset=' + offsetSec);}catch(e){}} setInterval(refresh,1000);window.onload=function(){updateInputs();refresh();sendTz(); if(!canControl){document.querySelectorAll('button.adj, .mode-buttons button, form button[type=submit]').forEach(b=>b.disabled=true);} };</script>");
-  page += F("</head><body><div class='card'>");
-  page += F("<div class='row'><h1>Thermostat</h1><div class='badge' id='modeBadge'>");
-  page += mode + "</div></div>";
-  page += "<div class='nav'><a class='active' href='/thermostat'>Thermostat</a><a href='/schedule'>Schedule</a><a href='/history'>History</a><a href='/system_status'>System</a><a href='/wifi'>WiFi</a></div>";
-  page += "<div class='mini'>" + wifiLine + "</div>";
-  page += "<div class='mini'>" + authNote + "</div>";
-  page += "<div class='mini'>Temp: <span id='temp'>--</span></div>";
-  page += "<div class='big-temp'><span id='feel'>--</span></div>";
-  page += "<div class='mini'>Humidity: <span id='hum'>--</span> | Mode: <span id='mode'>" + mode + "</span> <span id='led' class='led" + String((heatOn||coolOn||fanOn) ? " on" : "") + "'></span></div>";
-  page += "<div class='controls'>";
-  page += "<button class='adj minus' type='button' onclick=\"adjust('set',-0.5,40,90)\">&#8722;</button>";
-  page += "<div style='text-align:center'><div class='mini'>Setpoint (&deg;F)</div><div style='font-size:2rem;font-weight:700;' id='setVal'>" + String(setpointF, 1) + "</div><div class='mini'>Diff: <span id='diffVal'>" + String(diffF, 1) + "</span></div><div class='mini' id='fanRow'>Fan: <span id='fanVal'>0</span> min</div></div>";
-  page += "<button class='adj' type='button' onclick=\"adjust('set',0.5,40,90)\">&#43;</button>";
-  page += "</div>";
-  page += "<div class='pill'><label>Diff (&deg;F)</label><div><button class='adj minus' type='button' onclick=\"adjust('diff',-0.5,0.1,10)\">&#8722;</button><button class='adj' type='button' onclick=\"adjust('diff',0.5,0.1,10)\">&#43;</button></div></div>";
-  page += "<div class='pill' id='fanPill'><label>Fan runtime (minutes, Mode=Fan)</label><div><button class='adj minus' type='button' ontouchstart=\"startFanHold(-1)\" onmousedown=\"startFanHold(-1)\" ontouchend=\"stopFanHold()\" onmouseup=\"stopFanHold()\" onmouseleave=\"stopFanHold()\" onclick=\"adjust('fan',-1,0,60)\">&#8722;</button><button class='adj' type='button' ontouchstart=\"startFanHold(1)\" onmousedown=\"startFanHold(1)\" ontouchend=\"stopFanHold()\" onmouseup=\"stopFanHold()\" onmouseleave=\"stopFanHold()\" onclick=\"adjust('fan',1,0,60)\">&#43;</button></div></div>";
-
-  page += "<div class='mode-buttons'>";
-  page += "<button type='button' class='modeBtn" + String(mode == "heat" ? " active" : "") + "' onclick=\"quickMode('heat')\">Heat</button>";
-  page += "<button type='button' class='modeBtn" + String(mode == "cool" ? " active" : "") + "' onclick=\"quickMode('cool')\">Cool</button>";
-  page += "<button type='button' class='modeBtn" + String(mode == "fan" ? " active" : "") + "' onclick=\"quickMode('fan')\">Fan</button>";
-  page += "<button type='button' class='modeBtn" + String(mode == "off" ? " active" : "") + "' onclick=\"quickMode('off')\">Off</button>";
-  page += "</div>";
-
-  page += F("<form action='/set' method='GET'>");
-  page += "<select name='mode' class='hiddenField'>";
-  page += "<option value='heat'" + String(mode == "heat" ? " selected" : "") + ">Heat</option>";
-  page += "<option value='cool'" + String(mode == "cool" ? " selected" : "") + ">Cool</option>";
-  page += "<option value='fan'"  + String(mode == "fan"  ? " selected" : "") + ">Fan (timer)</option>";
-  page += "<option value='off'"  + String(mode == "off"  ? " selected" : "") + ">Off</option>";
-  page += "</select>";
-  page += "<input type='hidden' class='hiddenField' id='setpointInput' name='setpoint' value='" + String(setpointF, 1) + "'>";
-  page += "<input type='hidden' class='hiddenField' id='diffInput' name='diff' value='" + String(diffF, 1) + "'>";
-  page += "<input type='hidden' class='hiddenField' id='fanInput' name='fan' value='0'>";
-  page += "<div class='pill'><label>Control source</label><div class='val'>" + schedLabel + " &ndash; " + schedVal + "</div></div>";
-
-  page += "<button type='submit' style='width:100%;padding:12px;font-size:1.1rem;margin-top:8px;'" + String(canEdit ? "" : " disabled") + ">Update</button>";
-  page += F("</form>");
-  page += F("<div class='footer'>Controls stay put; live data refreshes every second. For data logging/remote access, see notes in code.</div>");
-  page += F("</div></body></html>");
-  server.send(200, "text/html", page);
+void histCursorBegin(HistCursor &c, const HistQuery &q) {
+  c.q = q;
+  c.nextTs = q.fromTs;
+  c.i = histLowerBound(q.fromTs);
+  c.pushes = histPushes;
+  c.lastTs = 0;
+  c.ringStartTs = histCount > 0 ? histTsAt(0) : UINT32_MAX;
+  c.seg.close();
+  c.segRec = 0;
+  c.segCount = 0;
+  // Without an explicit from the request is ring-only, as before.
+  c.segDay = 1;
+  c.segLastDay = 0;
+  if (sdReady && q.fromTs >= UPLOAD_MIN_VALID_TS && q.fromTs < c.ringStartTs) {
+    c.segLastDay = (min(q.toTs, c.ringStartTs - 1)) / 86400;
+    c.segDay = max(q.fromTs / 86400, c.segLastDay >= HIST_SEG_MAX_DAYS ? c.segLastDay - HIST_SEG_MAX_DAYS : 0);
+  }
 }
 
-void handleSchedule() {
-  static const char* dayNames[7] = {"Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
-  bool canEdit = canControl();
-  String authNote = canEdit ? "" : "Read-only. <a href='/login'>Sign in</a> to edit schedule.";
-  String page;
-  page += F("<!doctype html><html><head><meta charset='UTF-8'><meta name='viewport' content='width=device-width,initial-scale=1'>");
-  page += F("<style>body{font-family:'Segoe UI',sans-serif;background:#0e1117;color:#e6e9f0;display:flex;justify-content:center;align-items:flex-start;min-height:100vh;padding:16px;} .card{background:#171b23;border-radius:18px;box-shadow:0 12px 30px rgba(0,0,0,0.45);width:100%;max-width:960px;padding:20px;} h1{font-size:1.2rem;margin:0 0 8px;} .nav{display:flex;gap:10px;margin:8px 0 12px;} .nav a{background:#232a36;color:#e6e9f0;text-decoration:none;padding:8px 12px;border-radius:10px;box-shadow:0 6px 12px rgba(0,0,0,0.25);} .nav a.active{background:#2f74ff;} .legend{font-size:0.9rem;color:#a9b3c6;margin:6px 0;} .dayrow{display:flex;align-items:center;gap:10px;margin:8px 0;} .dayname{width:60px;font-weight:700;text-align:right;color:#e6e9f0;} .bar{flex:1;position:relative;height:26px;background:#11161f;border-radius:12px;overflow:hidden;box-shadow:inset 0 0 0 1px #222a35;} .seg{position:absolute;top:0;bottom:0;border-radius:10px;opacity:0.9;} .seg span{position:absolute;left:6px;top:4px;font-size:0.8rem;color:#fff;} .controls{display:flex;gap:8px;flex-wrap:wrap;margin-top:12px;} button{border:none;border-radius:10px;background:#2f74ff;color:#fff;padding:10px 14px;font-size:1rem;cursor:pointer;box-shadow:0 6px 12px rgba(0,0,0,0.25);} button.secondary{background:#334155;} .hint{color:#8a93a8;font-size:0.85rem;margin-top:6px;} </style>");
-  page += F("</head><body><div class='card'>");
-  page += F("<div class='row'><h1>Schedule</h1><div></div></div>");
-  page += "<div class='nav'><a href='/thermostat'>Thermostat</a><a class='active' href='/schedule'>Schedule</a><a href='/history'>History</a><a href='/system_status'>System</a><a href='/wifi'>WiFi</a></div>";
-  if (authNote.length() > 0) page += "<div class='legend'>" + authNote + "</div>";
-  page += "<div class='legend'>Long-press a day's bar to add a setpoint block. Manual changes hold until the next scheduled block; when a day has no blocks it follows the manual setpoint.</div>";
-  page += "<div id='schedule'></div>";
-  page += "<div class='controls'><button onclick='reloadSchedule()'>Refresh</button><button class='secondary' onclick='clearAll()'" + String(canEdit ? "" : " disabled") + ">Clear all days</button></div>";
-  page += "<div class='hint'>Blocks are inclusive of the end hour. Example: start 8, end 10 covers 8,9,10. Clear all if you want to stay manual-only.</div>";
-  page += "<script>";
-  page += "const dayNames=['Mon','Tue','Wed','Thu','Fri','Sat','Sun'];const dayOrder=[1,2,3,4,5,6,0];const canControl=";
-  page += String(canEdit ? "true" : "false");
-  page += ";let warned=false;function guard(){if(canControl)return true; if(!warned){alert('Sign in to edit schedule.'); warned=true;} return false;} let schedule=[];let pressTimer=null;";
-  page += "function colorForSet(sp){const base=170-Math.min(Math.max((sp-60)*3,0),120);return `rgb(47,116,255,0.85)`;}";
-  page += "function ensureSchedule(){if(!Array.isArray(schedule)||schedule.length<7){const filled=[];for(let i=0;i<7;i++){const hrs=new Array(24).fill(NaN);filled.push(hrs);}schedule=filled;}}";
-  page += "function render(){ensureSchedule();const wrap=document.getElementById('schedule');wrap.innerHTML='';dayOrder.forEach((dayIdx,displayIdx)=>{const hours=schedule[dayIdx];const row=document.createElement('div');row.className='dayrow';row.innerHTML=`<div class='dayname'>${dayNames[displayIdx]}</div><div class='bar' data-day='${dayIdx}'></div>`;const bar=row.querySelector('.bar');bar.addEventListener('pointerdown',e=>startPress(e,dayIdx,bar));bar.addEventListener('pointerup',cancelPress);bar.addEventListener('pointerleave',cancelPress);let start=-1,lastSp=NAN;for(let h=0;h<25;h++){const sp=h<24?hours[h]:NAN;if(!isnan(sp)&&isnan(lastSp)){start=h;lastSp=sp;}else if((isnan(sp)&&!isnan(lastSp))||(!isnan(sp)&&!isnan(lastSp)&&fabs(sp-lastSp)>0.01)){addSeg(bar,start,h-1,lastSp);start=isnan(sp)?-1:h;lastSp=sp;}else if(h==24&&!isnan(lastSp)){addSeg(bar,start,23,lastSp);} }wrap.appendChild(row);});}";
-  page += "function addSeg(bar,start,end,sp){if(start<0||end<start)return;const seg=document.createElement('div');const left=(start/24)*100;const width=((end-start+1)/24)*100;seg.className='seg';seg.style.left=left+'%';seg.style.width=width+'%';seg.style.background=colorForSet(sp);seg.innerHTML=`<span>${sp.toFixed(0)}°</span>`;bar.appendChild(seg);}";
-  page += "function startPress(ev,day,bar){if(!guard())return; cancelPress();pressTimer=setTimeout(()=>{pressTimer=null;createBlock(ev,day,bar);},500);}function cancelPress(){if(pressTimer){clearTimeout(pressTimer);pressTimer=null;}}";
-  page += "function createBlock(ev,day,bar){const rect=bar.getBoundingClientRect();const pct=Math.max(0,Math.min(1,(ev.clientX-rect.left)/rect.width));const start=Math.floor(pct*24);const duration=parseInt(prompt(`Duration hours (1-24) starting at ${start}:00`,`2`)||'0');if(!duration||duration<1||duration>24)return;const end=(start+duration-1)%24;const sp=parseFloat(prompt('Setpoint °F','70'))||70;applyBlock(day,start,end,sp);} ";
-  page += "async function applyBlock(day,start,end,sp){const qs=new URLSearchParams({sch_apply:'1',sch_day:day,sch_start:start,sch_end:end,sch_setpoint:sp.toFixed(1)});await fetch('/set?'+qs.toString());reloadSchedule();}";
-  page += "async function clearDay(day){if(!guard())return; await fetch('/set?'+new URLSearchParams({sch_clear:'1',sch_day:day}).toString());reloadSchedule();}";
-  page += "async function clearAll(){if(!guard())return; for(let d=0;d<7;d++){await clearDay(d);} }";
-  page += "async function reloadSchedule(){const r=await fetch('/schedule_data');if(!r.ok)return;const data=await r.json();schedule=data.schedule||[];ensureSchedule();render();}";
-  page += "function fabs(x){return x<0?-x:x;} function isnan(x){return x!==x;}";
-  page += "reloadSchedule();";
-  page += "</script>";
-  page += F("<div class='footer'>Use /thermostat for live controls. Schedule persists until you clear a day.</div>");
-  page += F("</div></body></html>");
-  server.send(200, "text/html", page);
+// Yields the next point matching the query; false once the range is exhausted.
+bool histCursorNext(HistCursor &c, HistoryPoint &p) {
+  while (c.segDay <= c.segLastDay) {
+    if (!c.seg) {
+      if (!histSegOpen(c.seg, c.segHdr, c.segCount, c.segDay, FILE_READ)) {
+        c.segDay++;
+        continue;
+      }
+      c.segRec = histSegLowerBound(c.seg, c.segHdr, c.segCount, max(c.q.fromTs, c.nextTs));
+      c.seg.seek(sizeof(HistSegHeader) + c.segRec * sizeof(HistoryPoint));
+    }
+    if (c.segRec >= c.segCount || c.seg.read((uint8_t *)&p, sizeof(p)) != sizeof(p)) {
+      c.seg.close();
+      c.segDay++;
+      continue;
+    }
+    c.segRec++;
+    if (p.ts >= c.ringStartTs || p.ts > c.q.toTs) {
+      c.seg.close();
+      c.segDay = c.segLastDay + 1;
+      break;
+    }
+    if (p.ts < c.q.fromTs) continue;
+    if (c.q.stepSec > 0) {
+      if (p.ts < c.nextTs) {
+        // Skip ahead instead of reading every minute of a long range.
+        c.segRec = max(c.segRec, histSegLowerBound(c.seg, c.segHdr, c.segCount, c.nextTs));
+        c.seg.seek(sizeof(HistSegHeader) + c.segRec * sizeof(HistoryPoint));
+        continue;
+      }
+      c.nextTs = p.ts + c.q.stepSec;
+    }
+    c.lastTs = p.ts;
+    return true;
+  }
+  if (c.pushes != histPushes) {
+    // Samples landed since the last call and may have shifted the full ring (or reset it);
+    // find our place again by time instead of trusting the old index.
+    c.i = histLowerBound(c.lastTs ? c.lastTs + 1 : c.q.fromTs);
+    c.pushes = histPushes;
+  }
+  while (c.i < histCount) {
+    int i = c.i++;
+    uint32_t ts = histTsAt(i);
+    if (ts > c.q.toTs) {
+      c.i = histCount;
+      break;
+    }
+    if (c.q.stepSec > 0) {
+      if (ts < c.nextTs) continue;
+      c.nextTs = ts + c.q.stepSec;
+    }
+    int idx = histRingIndex(i);
+    p = {ts, histTemp10[idx], histSet10[idx]};
+    c.lastTs = ts;
+    return true;
+  }
+  return false;
 }
 
-void handleScheduleData() {
-  String json = "{ \"schedule\":[";
-  for (int d = 0; d < 7; d++) {
-    json += "[";
-    for (int h = 0; h < 24; h++) {
-      float sp = scheduleSP[d][h];
-      json += isnan(sp) ? "null" : String(sp, 1);
-      if (h < 23) json += ",";
+void formatHistPoint(JsonWriter &w, const HistoryPoint &p) {
+  jwObject(w);
+  jwUint(w, "ts", p.ts);
+  jwTenths(w, "temp", p.temp10);
+  jwTenths(w, "set", p.set10);
+  jwEndObject(w);
+}
+
+void rollupStatAdd(RollupStat &st, int16_t lo, int16_t avg, int16_t hi) {
+  if (avg == HIST_NA) return;
+  if (st.n == 0 || lo < st.lo) st.lo = lo;
+  if (st.n == 0 || hi > st.hi) st.hi = hi;
+  st.sum += avg;
+  st.n++;
+}
+
+void rollupStatOut(const RollupStat &st, int16_t out[3]) {
+  if (st.n == 0) {
+    out[0] = out[1] = out[2] = HIST_NA;
+    return;
+  }
+  out[0] = st.lo;
+  out[1] = (int16_t)lroundf((float)st.sum / st.n);
+  out[2] = st.hi;
+}
+
+void rollupAccAdd(RollupAcc &a, const RollupBucket &b) {
+  rollupStatAdd(a.temp, b.temp[0], b.temp[1], b.temp[2]);
+  rollupStatAdd(a.set, b.set[0], b.set[1], b.set[2]);
+  rollupStatAdd(a.duty, b.duty[0], b.duty[1], b.duty[2]);
+}
+
+void rollupAccOut(const RollupAcc &a, RollupBucket &b) {
+  int16_t duty[3];
+  b.ts = a.ts;
+  rollupStatOut(a.temp, b.temp);
+  rollupStatOut(a.set, b.set);
+  rollupStatOut(a.duty, duty);
+  for (int k = 0; k < 3; k++) b.duty[k] = (duty[k] == HIST_NA) ? 0 : (uint8_t)duty[k];
+}
+
+void rollupPush(RollupTier &tier, const RollupBucket &b) {
+  tier.buckets[tier.head] = b;
+  tier.head = (tier.head + 1) % tier.cap;
+  if (tier.count < tier.cap) tier.count++;
+}
+
+// Buffered like the other SD logs; a bucket closes at most once an hour per tier.
+void rollupPersist(const RollupTier &tier, const RollupBucket &b) {
+  RollupRecord rec = {};
+  rec.periodSec = tier.periodSec;
+  rec.bucket = b;
+  sdLogAppend(rollupLog, &rec, sizeof(rec), b.ts);
+  if (rollupLog.fileBytes + rollupLog.used >= ROLLUP_LOG_COMPACT_BYTES) rollupCompactPending = true;
+}
+
+// Feeds one minute sample (ts on the minute) into every tier, closing buckets as their period ends.
+void rollupAdd(uint32_t ts, int16_t temp10, int16_t set10, uint8_t duty) {
+  RollupBucket sample = {ts, {temp10, temp10, temp10}, {set10, set10, set10}, {duty, duty, duty}};
+  for (size_t t = 0; t < ROLLUP_TIER_COUNT; t++) {
+    RollupTier &tier = rollupTiers[t];
+    uint32_t start = ts - (ts % tier.periodSec);
+    if (tier.acc.ts != 0 && start < tier.acc.ts) continue; // clock stepped back; keep order
+    if (tier.acc.ts == 0 && tier.count > 0 && start <= tier.buckets[(tier.head + tier.cap - 1) % tier.cap].ts) continue;
+    if (tier.acc.ts != 0 && start != tier.acc.ts) {
+      RollupBucket closed;
+      rollupAccOut(tier.acc, closed);
+      rollupPush(tier, closed);
+      rollupPersist(tier, closed);
+      tier.acc = {};
+    }
+    tier.acc.ts = start;
+    rollupAccAdd(tier.acc, sample);
+  }
+}
+
+// Logical index 0 is the oldest closed bucket; index count is the open bucket, if any.
+bool rollupAt(const RollupTier &tier, int i, RollupBucket &out) {
+  if (i < tier.count) {
+    out = tier.buckets[(tier.head - tier.count + i + tier.cap) % tier.cap];
+    return true;
+  }
+  if (i == tier.count && tier.acc.ts != 0) {
+    rollupAccOut(tier.acc, out);
+    return true;
+  }
+  return false;
+}
+
+// Refills the tiers from /hist/rollup.bin at boot. Records that don't fit a tier or are
+// not newer than what it already holds (a torn tail, a repeat after a failed compaction)
+// are skipped. A compaction cut off between removing the log and renaming its
+// replacement leaves only rollup.tmp, which is promoted first.
+void rollupRestore() {
+  if (!SD.exists(ROLLUP_LOG_PATH) && SD.exists(ROLLUP_TMP_PATH)) SD.rename(ROLLUP_TMP_PATH, ROLLUP_LOG_PATH);
+  File f = SD.open(ROLLUP_LOG_PATH, FILE_READ);
+  if (!f) return;
+  unsigned long startMs = millis();
+  uint32_t restored = 0;
+  RollupRecord recs[16];
+  size_t got;
+  while ((got = f.read((uint8_t *)recs, sizeof(recs)) / sizeof(RollupRecord)) > 0) {
+    for (size_t k = 0; k < got; k++) {
+      const RollupBucket &b = recs[k].bucket;
+      for (size_t t = 0; t < ROLLUP_TIER_COUNT; t++) {
+        RollupTier &tier = rollupTiers[t];
+        if (tier.periodSec != recs[k].periodSec || b.ts < UPLOAD_MIN_VALID_TS || b.ts % tier.periodSec != 0) continue;
+        RollupBucket newest;
+        if (tier.count > 0 && rollupAt(tier, tier.count - 1, newest) && newest.ts >= b.ts) continue;
+        rollupPush(tier, b);
+        restored++;
+      }
+    }
+  }
+  f.close();
+  if (restored) {
+    Serial.printf("[HIST] restored %lu rollup buckets (%d hourly, %d daily) in %lu ms\n", (unsigned long)restored,
+                  rollupTiers[0].count, rollupTiers[1].count, millis() - startMs);
+  }
+}
+
+// Rewrites the rollup log with just what the tiers hold. Runs from the storage job.
+void rollupCompact() {
+  sdLogClose(rollupLog);
+  File f = SD.open(ROLLUP_TMP_PATH, FILE_WRITE);
+  if (!f) return;
+  bool ok = true;
+  for (size_t t = 0; t < ROLLUP_TIER_COUNT && ok; t++) {
+    RollupRecord rec = {};
+    rec.periodSec = rollupTiers[t].periodSec;
+    for (int i = 0; i < rollupTiers[t].count && ok; i++) {
+      rollupAt(rollupTiers[t], i, rec.bucket);
+      ok = f.write((const uint8_t *)&rec, sizeof(rec)) == sizeof(rec);
+    }
+  }
+  f.close();
+  // Until the rename lands the old log is the copy to keep; after the remove it is the tmp.
+  if (!ok || (SD.exists(ROLLUP_LOG_PATH) && !SD.remove(ROLLUP_LOG_PATH))) {
+    SD.remove(ROLLUP_TMP_PATH);
+    return;
+  }
+  if (!SD.rename(ROLLUP_TMP_PATH, ROLLUP_LOG_PATH)) {
+    rollupCompactPending = true; // retried after the remount; rollupRestore also promotes the tmp
+    sdFault("rollup rename failed");
+    return;
+  }
+  if (DEBUG_SERIAL) Serial.println("[HIST] compacted rollup log");
+}
+
+int rollupLowerBound(const RollupTier &tier, uint32_t target) {
+  int lo = 0;
+  int hi = tier.count + (tier.acc.ts != 0 ? 1 : 0);
+  RollupBucket b;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    rollupAt(tier, mid, b);
+    if (b.ts < target) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Coarsest tier not coarser than the requested step, widened while the chosen one does not
+// reach back to the start of the range. Null when raw points are the better answer.
+RollupTier *rollupPickTier(const HistQuery &q) {
+  int pick = -1;
+  for (size_t t = 0; t < ROLLUP_TIER_COUNT; t++) {
+    if (rollupTiers[t].periodSec <= q.stepSec) pick = (int)t;
+  }
+  if (pick < 0) return nullptr;
+  RollupBucket first;
+  for (size_t t = (size_t)pick; t < ROLLUP_TIER_COUNT; t++) {
+    if (rollupAt(rollupTiers[t], 0, first) && first.ts <= q.fromTs) return &rollupTiers[t];
+  }
+  return nullptr;
+}
+
+struct RollupCursor {
+  const RollupTier *tier;
+  HistQuery q;
+  int i;
+  uint32_t lastTs;  // last bucket consumed, 0 before the first
+};
+
+void rollupCursorBegin(RollupCursor &c, const RollupTier *tier, const HistQuery &q) {
+  c.tier = tier;
+  c.q = q;
+  c.i = rollupLowerBound(*tier, q.fromTs);
+  c.lastTs = 0;
+}
+
+// Merges the buckets of each step-wide window into one (min of mins, mean of avgs, max of maxes).
+bool rollupCursorNext(RollupCursor &c, RollupBucket &out) {
+  RollupAcc acc = {};
+  uint32_t windowEnd = 0;
+  RollupBucket b;
+  // A bucket closing into a full tier shifts every index; re-find our place by time.
+  if (c.lastTs) c.i = rollupLowerBound(*c.tier, c.lastTs + 1);
+  while (rollupAt(*c.tier, c.i, b)) {
+    if (b.ts > c.q.toTs) break;
+    if (acc.ts != 0 && b.ts >= windowEnd) break;
+    c.i++;
+    c.lastTs = b.ts;
+    if (acc.ts == 0) {
+      acc.ts = b.ts;
+      windowEnd = b.ts + max(c.q.stepSec, c.tier->periodSec);
+    }
+    rollupAccAdd(acc, b);
+  }
+  if (acc.ts == 0) return false;
+  rollupAccOut(acc, out);
+  return true;
+}
+
+size_t putVarint(uint8_t *out, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+uint32_t zigzag32(int32_t v) {
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+enum HistStreamKind : uint8_t { HIST_STREAM_JSON, HIST_STREAM_BIN, HIST_STREAM_ROLLUP };
+
+// Per-connection state of a chunked history response. AsyncTCP pulls the body through
+// histStreamRead() as the client's TCP window opens, so a slow client holds only its own
+// HIST_CHUNK_BYTES buffer instead of stalling the loop or the other connections.
+struct HistStream {
+  HistStreamKind kind = HIST_STREAM_JSON;
+  HistQuery q;
+  HistCursor c;
+  RollupCursor rc;
+  const RollupTier *tier = nullptr;
+  int col = -1;         // -1 until the header is written
+  int cols = 0;         // per row: ts plus cols - 1 values
+  uint32_t baseTs = 0;
+  uint32_t count = 0;
+  uint32_t prevTs = 0;
+  int32_t prev[9] = {};  // previous reading per value column
+  bool first = true;
+  bool trailer = false;  // all rows written; the count trailer is still to go
+  bool done = false;
+  uint8_t buf[HIST_CHUNK_BYTES];
+  size_t len = 0;
+  size_t pos = 0;
+};
+
+SpscRing<HistStream *, WEB_MAX_STREAMS> histStreamReaped; // AsyncTCP -> loop
+
+// Next row as ts plus value columns: temp, set for raw points. Rollup streams are version 4
+// of /history_bin: same header (reserved u16 = bucket minutes), and each row is ts followed
+// by nine values in the temp encoding: temp min/avg/max, set min/avg/max and duty
+// min/avg/max (duty in whole percent, not scaled).
+bool histStreamNext(HistStream &s, uint32_t &ts, int16_t *v) {
+  if (s.kind == HIST_STREAM_ROLLUP) {
+    RollupBucket b;
+    if (!rollupCursorNext(s.rc, b)) return false;
+    ts = b.ts;
+    for (int k = 0; k < 3; k++) {
+      v[k] = b.temp[k];
+      v[3 + k] = b.set[k];
+      v[6 + k] = (int16_t)b.duty[k];
     }
-    json += "]";
-    if (d < 6) json += ",";
+    return true;
   }
-  json += "]}";
-  server.send(200, "application/json", json);
+  HistoryPoint p;
+  if (!histCursorNext(s.c, p)) return false;
+  ts = p.ts;
+  v[0] = p.temp10;
+  v[1] = p.set10;
+  return true;
 }
 
-void handleHistoryData() {
-  String json = "{ \"points\":[";
-  int count = histCount;
-  int start = (histIndex - count + HIST_MAX) % HIST_MAX;
-  for (int i = 0; i < count; i++) {
-    int idx = (start + i) % HIST_MAX;
-    uint32_t ts = histBaseEpoch + ((uint32_t)histMin[idx] * 60UL);
-    json += "{";
-    json += "\"ts\":" + String(ts) + ",";
-    if (histTemp10[idx] == HIST_NA) json += "\"temp\":null,";
-    else json += "\"temp\":" + String(((float)histTemp10[idx]) / 10.0f, 2) + ",";
-    if (histSet10[idx] == HIST_NA) json += "\"set\":null";
-    else json += "\"set\":" + String(((float)histSet10[idx]) / 10.0f, 2);
-    json += "}";
-    if (i < count - 1) json += ",";
+// Each refill is one chunk: the writer restarts on the stream buffer, and `first` carries
+// the separator state across chunks.
+void histStreamFillJson(HistStream &s) {
+  JsonWriter w;
+  jwBegin(w, (char *)s.buf, sizeof(s.buf));
+  w.comma = !s.first;
+  if (s.col < 0) {
+    jwObject(w);
+    jwArray(w, "points");
+    s.col = 0;
   }
-  json += "]}";
-  server.send(200, "application/json", json);
+  HistoryPoint p;
+  while (w.len + HIST_POINT_MAX_BYTES <= sizeof(s.buf)) {
+    if (!histCursorNext(s.c, p)) {
+      jwEndArray(w);
+      jwEndObject(w);
+      s.done = true;
+      break;
+    }
+    formatHistPoint(w, p);
+  }
+  s.first = !w.comma;
+  s.len = w.len;
 }
 
-void handleSystemStatusData() {
+// Rows are encoded whole in one walk of the cursor, so a sample or bucket that lands
+// between chunks can add or drop a row but never shift one column against another. The
+// row count is only known at the end: the header says HIST_BIN_COUNT_TRAILER and the
+// count follows the last row as a u32.
+void histStreamFillBin(HistStream &s) {
+  if (s.col < 0) {
+    uint16_t reserved = s.tier ? (uint16_t)(s.tier->periodSec / 60) : 0;
+    uint32_t countField = HIST_BIN_COUNT_TRAILER;
+    s.buf[s.len++] = s.tier ? HIST_BIN_ROLLUP_VERSION : HIST_BIN_VERSION;
+    s.buf[s.len++] = 10;
+    memcpy(s.buf + s.len, &reserved, 2);
+    s.len += 2;
+    memcpy(s.buf + s.len, &s.baseTs, 4);
+    s.len += 4;
+    memcpy(s.buf + s.len, &countField, 4);
+    s.len += 4;
+    s.col = 0;
+    if (s.kind == HIST_STREAM_ROLLUP) rollupCursorBegin(s.rc, s.tier, s.q);
+    else histCursorBegin(s.c, s.q);
+    s.prevTs = s.baseTs;
+  }
+  uint32_t ts;
+  int16_t v[9];
+  while (s.len + 5 * (size_t)s.cols <= sizeof(s.buf)) {
+    if (s.trailer) {
+      memcpy(s.buf + s.len, &s.count, 4);
+      s.len += 4;
+      s.done = true;
+      return;
+    }
+    if (!histStreamNext(s, ts, v)) {
+      s.trailer = true;
+      continue;
+    }
+    // Rows stay in time order even if the ring was reset between chunks.
+    if (s.count > 0 && ts <= s.prevTs) continue;
+    s.len += putVarint(s.buf + s.len, ts / 60 - s.prevTs / 60);
+    s.prevTs = ts;
+    s.count++;
+    for (int k = 0; k < s.cols - 1; k++) {
+      uint32_t token = 0;
+      if (v[k] != HIST_NA) {
+        token = zigzag32((int32_t)v[k] - s.prev[k]) + 1;
+        s.prev[k] = v[k];
+      }
+      s.len += putVarint(s.buf + s.len, token);
+    }
+  }
+}
+
+// Response filler, called on the AsyncTCP task. Refills take the state lock because the
+// cursors read the RAM ring and SD segments the loop is writing.
+size_t histStreamRead(HistStream &s, uint8_t *out, size_t maxLen) {
+  if (s.pos == s.len) {
+    if (s.done) return 0;
+    if (xSemaphoreTakeRecursive(stateLock, pdMS_TO_TICKS(WEB_LOCK_WAIT_MS)) != pdTRUE) return RESPONSE_TRY_AGAIN;
+    s.len = 0;
+    s.pos = 0;
+    if (s.kind == HIST_STREAM_JSON) histStreamFillJson(s);
+    else histStreamFillBin(s);
+    xSemaphoreGiveRecursive(stateLock);
+    if (s.len == 0) return 0;
+  }
+  size_t n = min(maxLen, s.len - s.pos);
+  memcpy(out, s.buf + s.pos, n);
+  s.pos += n;
+  return n;
+}
+
+void histStreamDelete(HistStream *s) {
+  delete s;
+  webStats.streams--;
+}
+
+// Runs on the AsyncTCP task when the response is destroyed (finished or client gone).
+// Deleting closes the cursor's segment File, so it needs the lock like any other SD
+// access; if a job holds it, the stream is handed to the loop instead of waiting.
+void histStreamFree(HistStream *s) {
+  if (xSemaphoreTakeRecursive(stateLock, 0) == pdTRUE) {
+    histStreamDelete(s);
+    xSemaphoreGiveRecursive(stateLock);
+    return;
+  }
+  histStreamReaped.push(s); // never full: at most WEB_MAX_STREAMS streams exist
+}
+
+// Loop side of histStreamFree(); runs under the state lock from the scheduler.
+void histStreamReap() {
+  HistStream **s;
+  while ((s = histStreamReaped.front()) != nullptr) {
+    histStreamDelete(*s);
+    histStreamReaped.pop();
+  }
+}
+
+HistStream *histStreamAlloc(AsyncWebServerRequest *req, HistStreamKind kind, const HistQuery &q) {
+  HistStream *s = (webStats.streams < WEB_MAX_STREAMS) ? new (std::nothrow) HistStream() : nullptr;
+  if (!s) {
+    webBusy(req);
+    return nullptr;
+  }
+  if (++webStats.streams > webStats.peakStreams) webStats.peakStreams = webStats.streams;
+  s->kind = kind;
+  s->q = q;
+  return s;
+}
+
+void sendHistStream(AsyncWebServerRequest *req, HistStream *s, const char *type) {
+  std::shared_ptr<HistStream> ref(s, histStreamFree);
+  req->send(req->beginChunkedResponse(type, [ref](uint8_t *out, size_t maxLen, size_t) {
+    return histStreamRead(*ref, out, maxLen);
+  }));
+}
+
+// Streams history as chunked JSON in HIST_CHUNK_BYTES pieces instead of one large String.
+void handleHistoryData(AsyncWebServerRequest *req) {
+  HistStream *s = histStreamAlloc(req, HIST_STREAM_JSON, histQueryFromArgs(req));
+  if (!s) return;
+  histCursorBegin(s->c, s->q);
+  sendHistStream(req, s, "application/json");
+}
+
+// Compact history for the chart. Little-endian header (12 bytes):
+//   u8 version, u8 scale (values are 1/scale F), u16 reserved, u32 base epoch,
+//   u32 count (HIST_BIN_COUNT_TRAILER: the count is the u32 after the last row)
+// followed by `count` rows of three varints each:
+//   ts:   minutes since the previous row (first row is relative to base epoch,
+//         which is the start of the requested range rounded down to the minute)
+//   temp: 0 = no reading, else zigzag(delta from the previous row's reading) + 1
+//   set:  same encoding as temp
+// Accepts the same from/to/step args as /history_data. With agg=1 and a step of at least
+// an hour the answer comes from a rollup tier instead (layout version 4, see histStreamNext()).
+// Nothing is walked up front: every chunk is encoded by histStreamRead() under its own
+// short hold of the state lock.
+void handleHistoryBin(AsyncWebServerRequest *req) {
+  HistQuery q = histQueryFromArgs(req);
+  RollupTier *tier = (req->arg("agg") == "1") ? rollupPickTier(q) : nullptr;
+  HistStream *s = histStreamAlloc(req, tier ? HIST_STREAM_ROLLUP : HIST_STREAM_BIN, q);
+  if (!s) return;
+  s->tier = tier;
+  s->cols = tier ? 10 : 3;
+  s->baseTs = q.fromTs - q.fromTs % 60;
+  sendHistStream(req, s, "application/octet-stream");
+}
+
+void handleSystemStatusData(AsyncWebServerRequest *req) {
   unsigned long nowMs = millis();
   bool sensorFresh = (nowMs - lastRead) < 5000 && !isnan(lastTempF) && !isnan(lastHumidity);
   bool sensorOk = sensorFresh;
   bool relayOk = true; // assume OK if we can set outputs
   bool wifiOk = (WiFi.status() == WL_CONNECTED);
   uint64_t sdTotal = 0;
-  String sdType = "none";
+  const char *sdType = "none";
   if (sdReady) {
     uint8_t t = SD.cardType();
     if (t == CARD_NONE) {
-      sdReady = false;
+      sdFault("card missing");
     } else {
       sdTotal = SD.cardSize();
       if (t == CARD_MMC) sdType = "MMC";
@@ -918,53 +2899,176 @@ void handleSystemStatusData() {
     }
   }
   // Schedule context
-  bool scheduled = false;
-  float scheduledSp = NAN;
-  struct tm timeinfo;
-  if (getLocalTime(&timeinfo)) {
-    int d = timeinfo.tm_wday;
-    int h = timeinfo.tm_hour;
-    if (d >= 0 && d < 7 && h >= 0 && h < 24) {
-      float sp = scheduleSP[d][h];
-      if (!isnan(sp) && !overrideUntilNextSchedule) {
-        scheduled = true;
-        scheduledSp = sp;
-      }
-    }
+  float scheduledSp = scheduledSetpointNow();
+  char ip[16];
+  IPAddress addr = WiFi.localIP();
+  snprintf(ip, sizeof(ip), "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+
+  JsonWriter w;
+  JsonSlot *slot = jsonBegin(req, w);
+  if (!slot) return;
+  jwObject(w);
+  jwUint(w, "uptime_s", nowMs / 1000);
+  jwUint(w, "config_writes", configStoreWrites);
+  jwObject(w, "wifi");
+  jwBool(w, "ok", wifiOk);
+  jwString(w, "ip", ip);
+  jwInt(w, "rssi", WiFi.RSSI());
+  jwString(w, "state", WIFI_STATE_NAMES[wifiState]);
+  jwUint(w, "join_ms", wifiLastJoinMs);
+  jwUint(w, "joins", wifiJoins);
+  jwUint(w, "fast_joins", wifiFastJoins);
+  jwUint(w, "last_reason", wifiLastReason);
+  jwEndObject(w);
+  jwObject(w, "sensor");
+  jwBool(w, "ok", sensorOk);
+  jwFixed(w, "temp", lastTempF, 1);
+  jwFixed(w, "hum", lastHumidity, 1);
+  jwUint(w, "age_ms", dhtSample.seq ? nowMs - dhtSample.ms : 0);
+  jwUint(w, "reads", dhtStats.reads);
+  jwUint(w, "timeouts", dhtStats.timeouts);
+  jwUint(w, "short_frames", dhtStats.shortFrames);
+  jwUint(w, "checksum_errors", dhtStats.checksumErrors);
+  jwUint(w, "range_errors", dhtStats.rangeErrors);
+  jwFixed(w, "control", controlTempF, 2);
+  jwFixed(w, "control_raw", controlRawF, 2);
+  jwArray(w, "sources");
+  for (size_t i = 0; i < CONTROL_SENSOR_COUNT; i++) {
+    const ControlSensor &c = controlSensors[i];
+    jwObject(w);
+    jwString(w, "name", c.name);
+    jwFixed(w, "weight", c.weight, 2);
+    jwFixed(w, "raw", c.raw, 2);
+    jwFixed(w, "filtered", c.filtered, 2);
+    jwUint(w, "age_ms", c.lastMs ? nowMs - c.lastMs : 0);
+    jwBool(w, "stale", c.lastMs == 0 || nowMs - c.lastMs >= SENSOR_STALE_MS);
+    jwUint(w, "samples", c.samples);
+    jwUint(w, "spikes", c.spikes);
+    jwEndObject(w);
+  }
+  jwEndArray(w);
+  jwEndObject(w);
+  jwObject(w, "model");
+  jwFixed(w, "heat_fph", model.heatFph, 2);
+  jwFixed(w, "cool_fph", model.coolFph, 2);
+  jwFixed(w, "drift_fph", model.driftFph, 2);
+  jwUint(w, "heat_windows", model.heatN);
+  jwUint(w, "cool_windows", model.coolN);
+  jwUint(w, "drift_windows", model.driftN);
+  jwFixed(w, "rate_err_fph", modelRateErrFph, 2);
+  jwObject(w, "preheat");
+  jwBool(w, "active", preheat.active);
+  if (preheat.active) {
+    jwString(w, "kind", preheat.heating ? "heat" : "cool");
+    jwFixed(w, "target", preheat.target, 1);
+    jwUint(w, "start_ts", preheat.startTs);
+    jwUint(w, "block_ts", preheat.blockTs);
+  }
+  jwUint(w, "runs", preheatRuns);
+  jwFixed(w, "last_err_min", preheatLastErrMin, 1);
+  jwFixed(w, "mean_abs_err_min", preheatMeanAbsErrMin, 1);
+  jwEndObject(w);
+  jwEndObject(w);
+  jwObject(w, "relays");
+  jwBool(w, "ok", relayOk);
+  jwString(w, "heat", heatOn ? "ON" : "OFF");
+  jwString(w, "cool", coolOn ? "ON" : "OFF");
+  jwString(w, "fan", fanOn ? "ON" : "OFF");
+  jwEndObject(w);
+  jwString(w, "mode", mode.c_str());
+  jwObject(w, "schedule");
+  jwBool(w, "active", !isnan(scheduledSp));
+  jwFixed(w, "setpoint", scheduledSp, 1);
+  jwBool(w, "override", overrideUntilNextSchedule);
+  jwEndObject(w);
+  jwObject(w, "sd");
+  jwBool(w, "ok", sdReady);
+  jwString(w, "type", sdType);
+  jwUint(w, "total_bytes", sdTotal);
+  jwUint(w, "remounts", sdRemounts);
+  jwArray(w, "logs");
+  for (const SdLog *log : sdLogs) {
+    const SdLog &l = *log;
+    jwObject(w);
+    jwString(w, "path", l.base);
+    jwUint(w, "flushes", l.flushes);
+    jwUint(w, "bytes", l.bytesWritten);
+    jwUint(w, "last_flush_bytes", l.lastFlushBytes);
+    jwUint(w, "last_write_us", l.lastWriteUs);
+    jwUint(w, "worst_write_us", l.worstWriteUs);
+    jwUint(w, "buffered", l.used);
+    jwUint(w, "drops", l.drops);
+    jwEndObject(w);
+  }
+  jwEndArray(w);
+  jwEndObject(w);
+  jwObject(w, "web");
+  jwUint(w, "requests", webStats.requests.load());
+  jwUint(w, "rejected", webStats.rejected.load());
+  jwUint(w, "busy", webStats.busy.load());
+  jwUint(w, "streams", webStats.streams);
+  jwUint(w, "peak_streams", webStats.peakStreams);
+  jwUint(w, "json_overflows", jsonOverflows);
+  jwEndObject(w);
+  jwObject(w, "events");
+  jwUint(w, "clients", events.count());
+  jwUint(w, "deltas", eventsDeltas);
+  jwUint(w, "heartbeats", eventsHeartbeats);
+  jwEndObject(w);
+  addHeapJson(w);
+  jwArray(w, "tasks");
+  for (size_t i = 0; i < SCHED_TASK_COUNT; i++) {
+    const SchedTask &t = schedTasks[i];
+    jwObject(w);
+    jwString(w, "name", t.name);
+    jwUint(w, "period_ms", t.periodMs);
+    jwUint(w, "priority", t.priority);
+    jwUint(w, "runs", t.runs);
+    jwUint(w, "overruns", t.overruns);
+    jwUint(w, "budget_us", t.budgetUs);
+    jwUint(w, "last_run_us", t.lastRunUs);
+    jwUint(w, "worst_run_us", t.worstRunUs);
+    jwUint(w, "worst_latency_ms", t.worstLatencyMs);
+    jwEndObject(w);
   }
+  jwEndArray(w);
+  jwEndObject(w);
+  jsonSend(req, slot, w);
+}
 
-  String json = "{";
-  json += "\"uptime_s\":" + String(nowMs / 1000) + ",";
-  json += "\"wifi\":{\"ok\":" + String(wifiOk ? "true" : "false") + ",\"ip\":\"" + WiFi.localIP().toString() + "\",\"rssi\":" + String(WiFi.RSSI()) + "},";
-  json += "\"sensor\":{\"ok\":" + String(sensorOk ? "true" : "false") + ",\"temp\":" + (isnan(lastTempF) ? String("null") : String(lastTempF, 1)) + ",\"hum\":" + (isnan(lastHumidity) ? String("null") : String(lastHumidity, 1)) + "},";
-  json += "\"relays\":{\"ok\":" + String(relayOk ? "true" : "false") + ",\"heat\":\"" + (heatOn ? "ON" : "OFF") + "\",\"cool\":\"" + (coolOn ? "ON" : "OFF") + "\",\"fan\":\"" + (fanOn ? "ON" : "OFF") + "\"},";
-  json += "\"mode\":\"" + mode + "\",";
-  json += "\"schedule\":{\"active\":" + String(scheduled ? "true" : "false") + ",\"setpoint\":" + (isnan(scheduledSp) ? String("null") : String(scheduledSp, 1)) + ",\"override\":" + String(overrideUntilNextSchedule ? "true" : "false") + "},";
-  json += "\"sd\":{\"ok\":" + String(sdReady ? "true" : "false") + ",\"type\":\"" + sdType + "\",\"total_bytes\":" + String((unsigned long long)sdTotal) + "}";
-  json += "}";
-  server.send(200, "application/json", json);
+// Heap health: fragmentation is the share of free memory outside the largest free block,
+// so a steady climb with flat `free` means long-lived allocations are splitting the heap.
+void addHeapJson(JsonWriter &w) {
+  uint32_t freeBytes = ESP.getFreeHeap();
+  uint32_t largest = ESP.getMaxAllocHeap();
+  jwObject(w, "heap");
+  jwUint(w, "free", freeBytes);
+  jwUint(w, "min_free", ESP.getMinFreeHeap());
+  jwUint(w, "largest_block", largest);
+  jwUint(w, "frag_pct", freeBytes ? 100 - (uint64_t)largest * 100 / freeBytes : 0);
+  jwEndObject(w);
 }
 
-void handleSet() {
-  if (!requireControlAuth()) return;
+void handleSet(AsyncWebServerRequest *req) {
+  if (!requireControlAuth(req)) return;
   bool updated = false;
   bool manualChange = false;
-  if (server.hasArg("setpoint")) {
-    setpointF = server.arg("setpoint").toFloat();
+  if (req->hasArg("setpoint")) {
+    setpointF = req->arg("setpoint").toFloat();
     if (setpointF < 40.0f) setpointF = 40.0f;
     if (setpointF > 90.0f) setpointF = 90.0f;
     updated = true;
     manualChange = true;
   }
-  if (server.hasArg("diff")) {
-    diffF = server.arg("diff").toFloat();
+  if (req->hasArg("diff")) {
+    diffF = req->arg("diff").toFloat();
     if (diffF < 0.1f) diffF = 0.1f;
     if (diffF > 10.0f) diffF = 10.0f;
     updated = true;
     manualChange = true;
   }
-  if (server.hasArg("mode")) {
-    String m = server.arg("mode");
+  if (req->hasArg("mode")) {
+    String m = req->arg("mode");
     m.toLowerCase();
     if (m == "heat" || m == "cool" || m == "fan" || m == "off") {
       mode = m;
@@ -972,19 +3076,19 @@ void handleSet() {
       manualChange = true;
     }
   }
-  if (server.hasArg("fan")) {
-    int minutes = server.arg("fan").toInt();
+  if (req->hasArg("fan")) {
+    int minutes = req->arg("fan").toInt();
     if (minutes < 0) minutes = 0;
     if (minutes > 60) minutes = 60;
     fanRequestMinutes = (uint8_t)minutes;
     updated = true;
   }
   // Schedule apply/clear
-  if (server.hasArg("sch_apply") && server.hasArg("sch_day") && server.hasArg("sch_start") && server.hasArg("sch_end") && server.hasArg("sch_setpoint")) {
-    int d = server.arg("sch_day").toInt();
-    int startH = server.arg("sch_start").toInt();
-    int endH = server.arg("sch_end").toInt();
-    float sp = server.arg("sch_setpoint").toFloat();
+  if (req->hasArg("sch_apply") && req->hasArg("sch_day") && req->hasArg("sch_start") && req->hasArg("sch_end") && req->hasArg("sch_setpoint")) {
+    int d = req->arg("sch_day").toInt();
+    int startH = req->arg("sch_start").toInt();
+    int endH = req->arg("sch_end").toInt();
+    float sp = req->arg("sch_setpoint").toFloat();
     if (d >= 0 && d < 7 && startH >= 0 && startH < 24 && endH >= 0 && endH < 24) {
       int h = startH;
       while (true) {
@@ -996,8 +3100,8 @@ void handleSet() {
       updated = true;
     }
   }
-  if (server.hasArg("sch_clear") && server.hasArg("sch_day")) {
-    int d = server.arg("sch_day").toInt();
+  if (req->hasArg("sch_clear") && req->hasArg("sch_day")) {
+    int d = req->arg("sch_day").toInt();
     if (d >= 0 && d < 7) {
       for (int h = 0; h < 24; h++) scheduleSP[d][h] = NAN;
       updated = true;
@@ -1006,7 +3110,7 @@ void handleSet() {
   if (manualChange) {
     overrideUntilNextSchedule = true;
     struct tm timeinfo;
-    if (getLocalTime(&timeinfo)) {
+    if (getLocalTime(&timeinfo, 0)) {
       overrideStartHour = timeinfo.tm_hour;
       lastScheduleHour = overrideStartHour;
     } else {
@@ -1017,76 +3121,250 @@ void handleSet() {
     markConfigDirty();
   }
   String msg = updated ? "Updated" : "No changes";
-  server.sendHeader("Location", "/");
-  server.send(303, "text/plain", msg);
+  AsyncWebServerResponse *res = req->beginResponse(303, "text/plain", msg);
+  res->addHeader("Location", "/");
+  req->send(res);
+}
+
+void handleSystemStatus(AsyncWebServerRequest *req) {
+  sendAsset(req, "/system_status");
+}
+
+void handleHistory(AsyncWebServerRequest *req) {
+  sendAsset(req, "/history");
+}
+
+// Look up a page/stylesheet embedded from web/ by tools/embed_web.py.
+const WebAsset *findAsset(const char *path) {
+  for (size_t i = 0; i < WEB_ASSET_COUNT; i++) {
+    if (strcmp(WEB_ASSETS[i].path, path) == 0) return &WEB_ASSETS[i];
+  }
+  return nullptr;
+}
+
+// Pages are static gzip'd shells that pull live values from /status and the
+// *_data endpoints, so browsers can revalidate with If-None-Match and get 304.
+void sendAsset(AsyncWebServerRequest *req, const char *path) {
+  const WebAsset *a = findAsset(path);
+  if (!a) {
+    req->send(404, "text/plain", "not found");
+    return;
+  }
+  AsyncWebServerResponse *res;
+  if (req->header("If-None-Match") == a->etag) {
+    res = req->beginResponse(304, a->type, "");
+  } else {
+    res = req->beginResponse(200, a->type, a->data, a->len);
+    res->addHeader("Content-Encoding", "gzip");
+  }
+  res->addHeader("ETag", a->etag);
+  res->addHeader("Cache-Control", "no-cache");
+  req->send(res);
+}
+
+// Claims a free JSON slot and points the writer at it; answers 503 when both are in use.
+// Slots are only claimed and released on the AsyncTCP task.
+JsonSlot *jsonBegin(AsyncWebServerRequest *req, JsonWriter &w) {
+  for (uint8_t i = 0; i < JSON_SLOTS; i++) {
+    JsonSlot &slot = jsonSlots[i];
+    if (slot.busy) continue;
+    slot.busy = true;
+    slot.len = 0;
+    slot.pos = 0;
+    jwBegin(w, slot.buf, sizeof(slot.buf));
+    return &slot;
+  }
+  webBusy(req);
+  return nullptr;
+}
+
+void jsonSlotRelease(JsonSlot *slot) {
+  slot->busy = false;
+}
+
+// Streams the finished document straight out of the slot, which is released when the
+// response is destroyed (sent or client gone).
+void jsonSend(AsyncWebServerRequest *req, JsonSlot *slot, const JsonWriter &w) {
+  if (w.overflow) {
+    jsonOverflows++;
+    slot->busy = false;
+    if (DEBUG_SERIAL) Serial.printf("[WEB] JSON for %s exceeds %u bytes\n", req->url().c_str(), (unsigned)JSON_SLOT_BYTES);
+    req->send(500, "text/plain", "response too large");
+    return;
+  }
+  slot->len = w.len;
+  std::shared_ptr<JsonSlot> ref(slot, jsonSlotRelease);
+  req->send(req->beginChunkedResponse("application/json", [ref](uint8_t *out, size_t maxLen, size_t) {
+    size_t n = min(maxLen, ref->len - ref->pos);
+    memcpy(out, ref->buf + ref->pos, n);
+    ref->pos += n;
+    return n;
+  }));
+}
+
+void webBusy(AsyncWebServerRequest *req) {
+  webStats.busy++;
+  AsyncWebServerResponse *res = req->beginResponse(503, "text/plain", "busy");
+  res->addHeader("Retry-After", "1");
+  req->send(res);
+}
+
+// Registers a handler behind the state lock (size limits are WebLimitHandler's). Handlers
+// run on the AsyncTCP task; one that can't get the lock within WEB_LOCK_WAIT_MS answers
+// 503 instead of holding up the other connections.
+void webRoute(const char *path, WebRequestMethodComposite method, void (*fn)(AsyncWebServerRequest *req)) {
+  server.on(path, method, [fn](AsyncWebServerRequest *req) {
+    webStats.requests++;
+    if (xSemaphoreTakeRecursive(stateLock, pdMS_TO_TICKS(WEB_LOCK_WAIT_MS)) != pdTRUE) {
+      webBusy(req);
+      return;
+    }
+    fn(req);
+    xSemaphoreGiveRecursive(stateLock);
+  });
+}
+
+// Setpoint of the schedule block in force now, or NAN while manual/overridden or before
+// NTP sync. Never waits for time: it runs from handlers and the events job.
+float scheduledSetpointNow() {
+  struct tm timeinfo;
+  if (!getLocalTime(&timeinfo, 0)) return NAN;
+  int d = timeinfo.tm_wday;
+  int h = timeinfo.tm_hour;
+  if (d < 0 || d >= 7 || h < 0 || h >= 24 || overrideUntilNextSchedule) return NAN;
+  return scheduleSP[d][h];
+}
+
+// Display string such as "72.50 F" ("NaN" when unknown), kept for the page's text fields.
+void jwReading(JsonWriter &w, const char *key, float v, uint8_t dp, const char *unit) {
+  char text[24];
+  JsonWriter t;
+  jwBegin(t, text, sizeof(text));
+  if (isnan(v)) {
+    jwPut(t, "NaN", 3);
+  } else {
+    jwFixed(t, nullptr, v, dp);
+    jwPut(t, unit, strlen(unit));
+  }
+  jwString(w, key, text);
+}
+
+// JSON status for AJAX polling
+void handleStatus(AsyncWebServerRequest *req) {
+  bool connected = (WiFi.status() == WL_CONNECTED);
+  float scheduledSp = scheduledSetpointNow();
+  JsonWriter w;
+  JsonSlot *slot = jsonBegin(req, w);
+  if (!slot) return;
+  jwObject(w);
+  jwString(w, "mode", mode.c_str());
+  jwReading(w, "temp", lastTempF, 2, " F");
+  jwReading(w, "hum", lastHumidity, 1, " %");
+  jwReading(w, "feel", lastHeatIndexF, 2, " F");
+  jwString(w, "heat", heatOn ? "ON" : "OFF");
+  jwString(w, "cool", coolOn ? "ON" : "OFF");
+  jwString(w, "fan", fanOn ? "ON" : "OFF");
+  jwBool(w, "active", heatOn || coolOn || fanOn);
+  jwReading(w, "setpoint", setpointF, 1, " F");
+  jwReading(w, "diff", diffF, 1, " F");
+  jwFixed(w, "setpoint_f", setpointF, 1);
+  jwFixed(w, "diff_f", diffF, 1);
+  jwObject(w, "source");
+  jwBool(w, "scheduled", !isnan(scheduledSp));
+  jwFixed(w, "setpoint", scheduledSp, 1);
+  jwEndObject(w);
+  jwObject(w, "auth");
+  jwBool(w, "signed_in", isAuthenticated(req));
+  jwBool(w, "on_network", onAuthorizedNetwork());
+  jwBool(w, "can_control", canControl(req));
+  jwString(w, "authorized_ssid", AUTHORIZED_SSID);
+  jwEndObject(w);
+  jwObject(w, "wifi");
+  jwBool(w, "connected", connected);
+  jwBool(w, "ap", apMode);
+  jwString(w, "ssid", connected ? WiFi.SSID().c_str() : "");
+  jwString(w, "ip", wifiIpStr.c_str());
+  jwString(w, "ap_ssid", AP_SSID);
+  jwString(w, "saved_ssid", wifiSsid.c_str());
+  jwEndObject(w);
+  jwEndObject(w);
+  jsonSend(req, slot, w);
+}
+
+int16_t eventTenths(float v) {
+  return isnan(v) ? HIST_NA : (int16_t)lroundf(v * 10.0f);
 }
 
-void handleSystemStatus() {
-  String page;
-  page += F("<!doctype html><html><head><meta charset='UTF-8'><meta name='viewport' content='width=device-width,initial-scale=1'>");
-  page += F("<style>body{font-family:'Segoe UI',sans-serif;background:#0e1117;color:#e6e9f0;display:flex;justify-content:center;align-items:flex-start;min-height:100vh;padding:16px;} .card{background:#171b23;border-radius:18px;box-shadow:0 12px 30px rgba(0,0,0,0.45);width:100%;max-width:960px;padding:20px;} h1{font-size:1.2rem;margin:0 0 8px;} .nav{display:flex;gap:10px;margin:8px 0 12px;} .nav a{background:#232a36;color:#e6e9f0;text-decoration:none;padding:8px 12px;border-radius:10px;box-shadow:0 6px 12px rgba(0,0,0,0.25);} .nav a.active{background:#2f74ff;} .grid{display:grid;grid-template-columns:repeat(auto-fit,minmax(220px,1fr));gap:12px;margin-top:10px;} .tile{background:#11161f;border-radius:12px;padding:12px;box-shadow:inset 0 0 0 1px #222a35;} .label{font-size:0.9rem;color:#8a93a8;margin-bottom:4px;} .value{font-size:1rem;font-weight:700;} .pill{display:inline-block;padding:4px 10px;border-radius:999px;font-size:0.9rem;font-weight:700;} .go{background:#123821;color:#30d158;} .nogo{background:#3d1b1b;color:#ff6b6b;} .detail{font-size:0.9rem;color:#a9b3c6;margin-top:4px;} </style>");
-  page += F("</head><body><div class='card'>");
-  page += F("<div class='row'><h1>System Status</h1><div></div></div>");
-  page += "<div class='nav'><a href='/thermostat'>Thermostat</a><a href='/schedule'>Schedule</a><a href='/history'>History</a><a class='active' href='/system_status'>System</a><a href='/wifi'>WiFi</a></div>";
-  page += "<div id='grid' class='grid'></div>";
-  page += "<div class='detail'>Shows live health for sensors, relays, WiFi, SD, and schedule/manual state.</div>";
-  page += "<script>";
-  page += "function badge(ok){return `<span class='pill ${ok?'go':'nogo'}'>${ok?'GO':'NO-GO'}</span>`;} ";
-  page += "function load(){fetch('/system_status_data').then(r=>r.json()).then(d=>{const g=document.getElementById('grid');if(!d){g.innerHTML='No data';return;}const rows=[];rows.push(`<div class='tile'><div class='label'>WiFi</div><div class='value'>${badge(d.wifi.ok)} ${d.wifi.ip}</div><div class='detail'>RSSI ${d.wifi.rssi} dBm</div></div>`);rows.push(`<div class='tile'><div class='label'>Sensor</div><div class='value'>${badge(d.sensor.ok)} T: ${(d.sensor.temp==null?'--':d.sensor.temp)} F / H: ${(d.sensor.hum==null?'--':d.sensor.hum)}%</div><div class='detail'>Fresh if reading updated recently.</div></div>`);rows.push(`<div class='tile'><div class='label'>Relays</div><div class='value'>${badge(d.relays.ok)} Heat ${d.relays.heat} | Cool ${d.relays.cool} | Fan ${d.relays.fan}</div><div class='detail'>Mode ${d.mode}</div></div>`);rows.push(`<div class='tile'><div class='label'>Schedule</div><div class='value'>${d.schedule.active?'Scheduled':'Manual'} ${d.schedule.setpoint?d.schedule.setpoint+' F':''}</div><div class='detail'>Override: ${d.schedule.override?'Yes':'No'}</div></div>`);rows.push(`<div class='tile'><div class='label'>SD Card</div><div class='value'>${badge(d.sd.ok)} ${d.sd.type}</div><div class='detail'>Size: ${d.sd.total_bytes ? (d.sd.total_bytes/(1024*1024*1024)).toFixed(2)+' GB' : 'n/a'}</div></div>`);rows.push(`<div class='tile'><div class='label'>Uptime</div><div class='value'>${(d.uptime_s/3600).toFixed(2)} h</div><div class='detail'>${(d.uptime_s/86400).toFixed(2)} days</div></div>`);g.innerHTML=rows.join('');}).catch(()=>{});} load(); setInterval(load, 5000);";
-  page += "</script>";
-  page += F("<div class='footer'>Refreshes every 5 seconds; use SD status to confirm logging.</div>");
-  page += F("</div></body></html>");
-  server.send(200, "text/html", page);
+void eventStateCapture(EventState &st) {
+  st.temp10 = eventTenths(lastTempF);
+  st.hum10 = eventTenths(lastHumidity);
+  st.feel10 = eventTenths(lastHeatIndexF);
+  st.set10 = eventTenths(setpointF);
+  st.diff10 = eventTenths(diffF);
+  st.sched10 = eventTenths(scheduledSetpointNow());
+  st.heat = heatOn;
+  st.cool = coolOn;
+  st.fan = fanOn;
+  strlcpy(st.mode, mode.c_str(), sizeof(st.mode));
 }
 
-void handleHistory() {
-  String page;
-  page += F("<!doctype html><html><head><meta charset='UTF-8'><meta name='viewport' content='width=device-width,initial-scale=1'>");
-  page += F("<style>body{font-family:'Segoe UI',sans-serif;background:#0e1117;color:#e6e9f0;display:flex;justify-content:center;align-items:flex-start;min-height:100vh;padding:16px;} .card{background:#171b23;border-radius:18px;box-shadow:0 12px 30px rgba(0,0,0,0.45);width:100%;max-width:960px;padding:20px;} h1{font-size:1.2rem;margin:0 0 8px;} .nav{display:flex;gap:10px;margin:8px 0 12px;} .nav a{background:#232a36;color:#e6e9f0;text-decoration:none;padding:8px 12px;border-radius:10px;box-shadow:0 6px 12px rgba(0,0,0,0.25);} .nav a.active{background:#2f74ff;} .controls{display:flex;gap:8px;flex-wrap:wrap;margin:10px 0;} button{border:none;border-radius:10px;background:#2f74ff;color:#fff;padding:10px 14px;font-size:1rem;cursor:pointer;box-shadow:0 6px 12px rgba(0,0,0,0.25);} button.secondary{background:#334155;} .hint{color:#8a93a8;font-size:0.85rem;} canvas{background:#0b0f16;border-radius:12px;width:100%;height:360px;box-shadow:inset 0 0 0 1px #222a35;} .legend{display:flex;gap:10px;font-size:0.9rem;margin-top:6px;} .swatch{width:14px;height:14px;border-radius:4px;display:inline-block;margin-right:4px;} </style>");
-  page += F("</head><body><div class='card'>");
-  page += F("<div class='row'><h1>History</h1><div></div></div>");
-  page += "<div class='nav'><a href='/thermostat'>Thermostat</a><a href='/schedule'>Schedule</a><a class='active' href='/history'>History</a><a href='/system_status'>System</a><a href='/wifi'>WiFi</a></div>";
-  page += "<div class='controls'><button onclick=\"setRange('day')\">Day</button><button onclick=\"setRange('week')\">Week</button><button onclick=\"setRange('month')\">Month</button><button class='secondary' onclick='loadHistory()'>Refresh</button></div>";
-  page += "<canvas id='chart' width='900' height='360'></canvas>";
-  page += "<div class='legend'><span><span class='swatch' style='background:#2f74ff'></span>Setpoint</span><span><span class='swatch' style='background:#30d158'></span>Temperature</span></div>";
-  page += "<div class='hint'>Data logs every minute (in-memory, last 7 days). Month view shows whatever span is available; add SD/RTC for deeper history.</div>";
-  page += "<script>";
-  page += "let raw=[];let filtered=[];let currentRange='day';";
-  page += "async function loadHistory(){const r=await fetch('/history_data');if(!r.ok)return;const d=await r.json();raw=d.points||[];setRange(currentRange);} ";
-  page += "function setRange(range){currentRange=range;const now=Math.floor(Date.now()/1000);let cutoff=0;if(range==='day')cutoff=now-86400;else if(range==='week')cutoff=now-604800;else if(range==='month')cutoff=now-2592000;filtered=raw.filter(p=>!cutoff||p.ts>=cutoff);draw();}";
-  page += "function draw(){const c=document.getElementById('chart');const ctx=c.getContext('2d');ctx.clearRect(0,0,c.width,c.height);if(!filtered.length){ctx.fillStyle='#8a93a8';ctx.fillText('No history yet',20,30);return;}const temps=filtered.map(p=>p.temp).filter(v=>v!=null);const sets=filtered.map(p=>p.set).filter(v=>v!=null);const minVal=Math.min(...temps,...sets);const maxVal=Math.max(...temps,...sets);const minTs=filtered[0].ts;const maxTs=filtered[filtered.length-1].ts;const pad=30;const h=c.height-2*pad;const w=c.width-2*pad;function y(v){if(maxVal===minVal)return c.height/2;return pad+h-(v-minVal)/(maxVal-minVal)*h;}function x(t){if(maxTs===minTs)return pad+w/2;return pad+(t-minTs)/(maxTs-minTs)*w;}function line(color,key){ctx.beginPath();ctx.strokeStyle=color;ctx.lineWidth=2;let first=true;filtered.forEach(p=>{const v=p[key];if(v==null)return;const px=x(p.ts),py=y(v);if(first){ctx.moveTo(px,py);first=false;}else ctx.lineTo(px,py);});ctx.stroke();}line('#2f74ff','set');line('#30d158','temp');ctx.strokeStyle='#222a35';ctx.lineWidth=1;ctx.beginPath();ctx.moveTo(pad,c.height-pad);ctx.lineTo(c.width-pad,c.height-pad);ctx.stroke();ctx.fillStyle='#8a93a8';ctx.textAlign='center';ctx.textBaseline='top';const ticks=5;for(let i=0;i<ticks;i++){const t=minTs+(i/(ticks-1))*(maxTs-minTs);const px=x(t);ctx.fillText(new Date(t*1000).toLocaleTimeString([], {hour:'2-digit', minute:'2-digit'}),px,c.height-pad+4);ctx.beginPath();ctx.moveTo(px,c.height-pad);ctx.lineTo(px,c.height-pad-4);ctx.strokeStyle='#444d5e';ctx.stroke();}ctx.textAlign='left';ctx.fillText(new Date(minTs*1000).toLocaleDateString(),pad,8);} ";
-  page += "loadHistory();";
-  page += "</script>";
-  page += F("<div class='footer'>History lives in RAM; add SD/RTC for deeper or power-safe logging.</div>");
-  page += F("</div></body></html>");
-  server.send(200, "text/html", page);
+// Writes the fields of cur that differ from prev as one JSON object; 0 when nothing changed.
+size_t eventStateJson(char *out, size_t cap, const EventState &cur, const EventState &prev) {
+  JsonWriter w;
+  jwBegin(w, out, cap);
+  jwObject(w);
+  size_t empty = w.len;
+  if (cur.temp10 != prev.temp10) jwTenths(w, "temp_f", cur.temp10);
+  if (cur.hum10 != prev.hum10) jwTenths(w, "hum", cur.hum10);
+  if (cur.feel10 != prev.feel10) jwTenths(w, "feel_f", cur.feel10);
+  if (cur.set10 != prev.set10) jwTenths(w, "setpoint_f", cur.set10);
+  if (cur.diff10 != prev.diff10) jwTenths(w, "diff_f", cur.diff10);
+  if (cur.sched10 != prev.sched10) jwTenths(w, "scheduled_f", cur.sched10);
+  if (cur.heat != prev.heat) jwBool(w, "heat", cur.heat);
+  if (cur.cool != prev.cool) jwBool(w, "cool", cur.cool);
+  if (cur.fan != prev.fan) jwBool(w, "fan", cur.fan);
+  if (strcmp(cur.mode, prev.mode) != 0) jwString(w, "mode", cur.mode);
+  if (w.len == empty) return 0;
+  jwEndObject(w);
+  return w.overflow ? 0 : w.len;
 }
 
-// JSON status for AJAX polling
-void handleStatus() {
-  String json = "{";
-  json += "\"mode\":\"" + mode + "\",";
-  json += "\"temp\":\"" + (isnan(lastTempF) ? String("NaN") : String(lastTempF, 2) + " F") + "\",";
-  json += "\"hum\":\"" + (isnan(lastHumidity) ? String("NaN") : String(lastHumidity, 1) + " %") + "\",";
-  json += "\"feel\":\"" + (isnan(lastHeatIndexF) ? String("NaN") : String(lastHeatIndexF, 2) + " F") + "\",";
-  json += "\"heat\":\"" + String(heatOn ? "ON" : "OFF") + "\",";
-  json += "\"cool\":\"" + String(coolOn ? "ON" : "OFF") + "\",";
-  json += "\"fan\":\"" + String(fanOn ? "ON" : "OFF") + "\",";
-  json += "\"setpoint\":\"" + String(setpointF, 1) + " F\",";
-  json += "\"diff\":\"" + String(diffF, 1) + " F\"";
-  json += "}";
-  server.send(200, "application/json", json);
+// Publishes a delta when a displayed value changed, else a heartbeat every
+// EVENTS_HEARTBEAT_MS. With no subscribers it only tracks state.
+void taskEvents() {
+  unsigned long now = millis();
+  EventState cur;
+  eventStateCapture(cur);
+  char buf[EVENTS_MSG_BYTES];
+  size_t len = eventStateJson(buf, sizeof(buf), cur, eventsLast);
+  eventsLast = cur;
+  if (events.count() == 0) return;
+  if (len > 0) {
+    events.send(buf, "status", ++eventsSeq);
+    eventsDeltas++;
+    eventsLastSendMs = now;
+  } else if (now - eventsLastSendMs >= EVENTS_HEARTBEAT_MS) {
+    JsonWriter w;
+    jwBegin(w, buf, sizeof(buf));
+    jwObject(w);
+    jwUint(w, "up", now / 1000);
+    jwEndObject(w);
+    events.send(buf, "ping", ++eventsSeq);
+    eventsHeartbeats++;
+    eventsLastSendMs = now;
+  }
 }
 
 // Set timezone offset (seconds) from client
-void handleTz() {
-  if (!requireControlAuth()) return;
-  if (server.hasArg("offset")) {
-    tzOffsetSec = server.arg("offset").toInt();
+void handleTz(AsyncWebServerRequest *req) {
+  if (!requireControlAuth(req)) return;
+  if (req->hasArg("offset")) {
+    tzOffsetSec = req->arg("offset").toInt();
+    configStoreMark();
     configTime(tzOffsetSec, dstOffsetSec, "pool.ntp.org", "time.nist.gov", "time.google.com");
-    server.send(200, "text/plain", "tz updated");
+    req->send(200, "text/plain", "tz updated");
   } else {
-    server.send(400, "text/plain", "offset required");
+    req->send(400, "text/plain", "offset required");
   }
 }
 
@@ -1095,8 +3373,15 @@ void setOutput(int pin, bool on) {
   digitalWrite(pin, level);
 }
 
+// Runs every DISPLAY_INTERVAL_MS but only redraws when a shown value changed, and
+// DirtyOled then sends only the changed page spans.
 void updateDisplay() {
   if (!displayReady) return;
+  char shown[sizeof(displayShown)];
+  snprintf(shown, sizeof(shown), "%d|%d|%s|%s|%.1f|%.1f|%.1f", wifiConnected, apMode, wifiIpStr.c_str(),
+           mode.c_str(), lastTempF, lastHeatIndexF, setpointF);
+  if (strcmp(shown, displayShown) == 0) return;
+  strlcpy(displayShown, shown, sizeof(displayShown));
   display.clearDisplay();
   display.setTextColor(SSD1306_WHITE);
   display.setTextSize(1);
@@ -1155,8 +3440,7 @@ void logSdCardInfo(const char* context) {
   uint8_t type = SD.cardType();
   if (type == CARD_NONE) {
     Serial.printf("[SD] %s: no card detected\n", context);
-    sdReady = false;
-    lastSdError = "card missing";
+    sdFault("card missing");
     return;
   }
   uint64_t size = SD.cardSize();
@@ -1167,11 +3451,7 @@ void sdWriteTest() {
   if (!DEBUG_SERIAL || !sdReady) return;
   File f = SD.open("/sd_diag.txt", FILE_APPEND);
   if (!f) {
-    lastSdWriteOk = false;
-    lastSdError = "diag open failed";
-    sdWriteFailures++;
-    sdReady = false;
-    Serial.println("[SD] diag open failed");
+    sdFault("diag open failed");
     return;
   }
   uint32_t ts = (uint32_t)time(nullptr);
@@ -1198,24 +3478,170 @@ void sdWriteTest() {
   }
 }
 
+// Any card error closes the open handles and unmounts; taskStorage() remounts with
+// backoff and buffered records are written once the card is back.
+void sdFault(const char *reason) {
+  lastSdWriteMs = millis();
+  lastSdWriteOk = false;
+  lastSdError = reason;
+  sdWriteFailures++;
+  for (SdLog *log : sdLogs) {
+    if (log->file) log->file.close();
+  }
+  if (!sdReady) return;
+  sdReady = false;
+  sdRemountAtMs = millis() + sdRemountBackoffMs;
+  Serial.printf("[SD] %s; remount in %lus\n", reason, sdRemountBackoffMs / 1000);
+}
+
+// Local calendar day of ts as YYYYMMDD, or 0 before NTP sync.
+uint32_t sdLogDay(uint32_t ts) {
+  if (ts < UPLOAD_MIN_VALID_TS) return 0;
+  time_t t = ts;
+  struct tm lt;
+  localtime_r(&t, &lt);
+  return (uint32_t)(lt.tm_year + 1900) * 10000UL + (uint32_t)(lt.tm_mon + 1) * 100UL + (uint32_t)lt.tm_mday;
+}
+
+bool sdLogOpen(SdLog &log) {
+  if (log.file) return true;
+  if (!sdReady) return false;
+  if (!log.daily) strlcpy(log.openPath, log.base, sizeof(log.openPath));
+  else if (log.day == 0) snprintf(log.openPath, sizeof(log.openPath), "%s.csv", log.base);
+  else snprintf(log.openPath, sizeof(log.openPath), "%s-%08lu.csv", log.base, (unsigned long)log.day);
+  log.file = SD.open(log.openPath, FILE_APPEND);
+  if (!log.file) {
+    sdFault("open failed");
+    return false;
+  }
+  log.fileBytes = log.file.size();
+  if (log.fileBytes == 0 && log.create && !log.create(log)) {
+    sdFault("header write failed");
+    return false;
+  }
+  return true;
+}
+
+// Writes the first n buffered bytes and keeps the rest. Whatever the card took is
+// consumed even on a short write, so fixed-size records stay contiguous on retry.
+bool sdLogWrite(SdLog &log, size_t n) {
+  if (n == 0) return true;
+  if (!sdLogOpen(log)) return false;
+  unsigned long startUs = micros();
+  size_t written = log.file.write(log.buf, n);
+  log.file.flush();
+  unsigned long us = micros() - startUs;
+  if (written > 0) {
+    memmove(log.buf, log.buf + written, log.used - written);
+    log.used -= written;
+    log.fileBytes += written;
+    log.bytesWritten += written;
+  }
+  if (written != n) {
+    sdFault("write failed");
+    return false;
+  }
+  log.flushes++;
+  log.lastFlushBytes = n;
+  log.lastWriteUs = us;
+  if (us > log.worstWriteUs) log.worstWriteUs = us;
+  if (log.used > 0) log.oldestMs = millis();
+  lastSdWriteMs = millis();
+  lastSdWriteOk = true;
+  lastSdError = "ok";
+  sdRemountBackoffMs = SD_REMOUNT_MIN_MS;
+  return true;
+}
+
+// Group commit: without force only whole sectors are written, ending on a sector
+// boundary of the file; force also writes the partial tail.
+bool sdLogFlush(SdLog &log, bool force) {
+  if (log.used == 0) return true;
+  if (!sdLogOpen(log)) return false;
+  size_t n = log.used;
+  if (!force) {
+    size_t head = SD_SECTOR_BYTES - (log.fileBytes % SD_SECTOR_BYTES);
+    if (n < head) return true;
+    n = head + ((n - head) / SD_SECTOR_BYTES) * SD_SECTOR_BYTES;
+  }
+  return sdLogWrite(log, n);
+}
+
+bool sdLogClose(SdLog &log) {
+  bool ok = sdLogFlush(log, true);
+  if (log.file) log.file.close();
+  return ok;
+}
+
+// Buffers one record. Records are kept while the card is away and dropped (counted)
+// only once the buffer is full.
+bool sdLogAppend(SdLog &log, const void *data, size_t len, uint32_t ts) {
+  if (!sdEverMounted || len > sizeof(log.buf)) return false;
+  if (log.daily) {
+    uint32_t day = sdLogDay(ts);
+    if (day != log.day) {
+      // Best effort: if the card is down the old day's tail lands in the new file.
+      sdLogClose(log);
+      log.day = day;
+    }
+  }
+  if (log.used + len > sizeof(log.buf)) sdLogFlush(log, true);
+  if (log.used + len > sizeof(log.buf)) {
+    log.drops++;
+    return false;
+  }
+  if (log.used == 0) log.oldestMs = millis();
+  memcpy(log.buf + log.used, data, len);
+  log.used += len;
+  sdLogFlush(log, false);
+  return true;
+}
+
+// Storage job: remounts a lost card and writes partial sectors that have waited too long.
+void taskStorage() {
+  unsigned long now = millis();
+  configStoreService();
+  modelService();
+  if (!sdReady) {
+    if ((long)(now - sdRemountAtMs) < 0) return;
+    SD.end();
+    if (!SD.begin(SD_CS) || SD.cardType() == CARD_NONE) {
+      sdRemountBackoffMs = min(sdRemountBackoffMs * 2, SD_REMOUNT_MAX_MS);
+      sdRemountAtMs = millis() + sdRemountBackoffMs;
+      return;
+    }
+    sdReady = true;
+    sdEverMounted = true;
+    sdRemounts++;
+    Serial.printf("[SD] remounted (%lu)\n", sdRemounts);
+    SD.mkdir(HIST_SEG_DIR);
+    uploadQueueScanWal();
+  }
+  if (histSegSealDay) {
+    histSegSeal(histSegSealDay);
+    histSegSealDay = 0;
+    return; // one card-heavy step per pass
+  }
+  if (rollupCompactPending) {
+    rollupCompactPending = false;
+    rollupCompact();
+    return;
+  }
+  for (SdLog *log : sdLogs) {
+    if (log->used > 0 && now - log->oldestMs >= SDLOG_FLUSH_MS) sdLogFlush(*log, true);
+  }
+}
+
 void logHealth() {
   if (!DEBUG_SERIAL) return;
   unsigned long nowMs = millis();
-  if (nowMs - lastHealthLog < HEALTH_LOG_INTERVAL_MS) return;
-  lastHealthLog = nowMs;
 
   bool wifiOk = (WiFi.status() == WL_CONNECTED);
   bool sensorFresh = (nowMs - lastRead) < 5000 && !isnan(lastTempF) && !isnan(lastHumidity);
-  float ctlTemp = !isnan(lastHeatIndexF) ? lastHeatIndexF : lastTempF;
+  float ctlTemp = controlTempF;
   if (sdReady) {
     uint8_t type = SD.cardType();
-    if (type == CARD_NONE) {
-      sdReady = false;
-      lastSdWriteOk = false;
-      lastSdError = "card missing";
-      sdWriteFailures++;
-      Serial.println("[SD] card missing");
-    }
+    if (type == CARD_NONE) sdFault("card missing");
   }
 
   Serial.printf("[HEALTH] up=%lus wifi=%s rssi=%ld ip=%s sensor=%s T=%s H=%s ctl=%s mode=%s set=%.1f diff=%.1f heat=%s cool=%s fan=%s heap=%lu\n",
@@ -1233,171 +3659,951 @@ void logHealth() {
                 coolOn ? "ON" : "OFF",
                 fanOn ? "ON" : "OFF",
                 (unsigned long)ESP.getFreeHeap());
-  Serial.printf("[SD] ready=%d lastWrite=%s err=%s failures=%lu age=%lus\n",
+  for (size_t i = 0; i < CONTROL_SENSOR_COUNT; i++) {
+    const ControlSensor &c = controlSensors[i];
+    Serial.printf("[SENSOR] %s raw=%.2f filtered=%.2f age=%lums samples=%lu spikes=%lu\n",
+                  c.name, c.raw, c.filtered, c.lastMs ? nowMs - c.lastMs : 0UL,
+                  (unsigned long)c.samples, (unsigned long)c.spikes);
+  }
+  Serial.printf("[MODEL] heat=%.2f cool=%.2f drift=%.2f F/h windows=%u/%u/%u rateErr=%.2f preheat=%s runs=%lu lastErr=%.1fmin meanAbsErr=%.1fmin\n",
+                model.heatFph, model.coolFph, model.driftFph,
+                model.heatN, model.coolN, model.driftN,
+                modelRateErrFph,
+                preheat.active ? (preheat.heating ? "heat" : "cool") : "idle",
+                (unsigned long)preheatRuns,
+                preheatLastErrMin, preheatMeanAbsErrMin);
+  if (displayReady) {
+    Serial.printf("[DISPLAY] flushes=%lu skipped=%lu bytes=%lu\n",
+                  (unsigned long)display.flushes(), (unsigned long)display.skipped(), (unsigned long)display.bytesSent());
+  }
+  Serial.printf("[WIFI] state=%s join=%lums joins=%lu fast=%lu reason=%u cache=%s ch=%u\n",
+                WIFI_STATE_NAMES[wifiState],
+                wifiLastJoinMs,
+                (unsigned long)wifiJoins,
+                (unsigned long)wifiFastJoins,
+                wifiLastReason,
+                wifiCacheValid ? "yes" : "no",
+                wifiCache.channel);
+  uint32_t heapFree = ESP.getFreeHeap();
+  uint32_t heapLargest = ESP.getMaxAllocHeap();
+  Serial.printf("[HEAP] free=%lu min=%lu largest=%lu frag=%lu%% json_slots_busy=%u\n",
+                (unsigned long)heapFree, (unsigned long)ESP.getMinFreeHeap(), (unsigned long)heapLargest,
+                heapFree ? 100UL - (unsigned long)((uint64_t)heapLargest * 100 / heapFree) : 0UL,
+                (unsigned)(jsonSlots[0].busy + jsonSlots[1].busy));
+  Serial.printf("[SD] ready=%d remounts=%lu lastWrite=%s err=%s failures=%lu age=%lus\n",
                 sdReady ? 1 : 0,
+                sdRemounts,
                 lastSdWriteOk ? "OK" : "FAIL",
                 lastSdError,
                 sdWriteFailures,
                 lastSdWriteMs == 0 ? 0UL : (nowMs - lastSdWriteMs) / 1000UL);
+  for (SdLog *log : sdLogs) {
+    Serial.printf("[SD] log=%s flushes=%lu bytes=%lu perFlush=%lu lastFlush=%luB write=%luus worst=%luus buffered=%u drops=%lu\n",
+                  log->base, log->flushes, log->bytesWritten,
+                  log->flushes ? log->bytesWritten / log->flushes : 0UL,
+                  log->lastFlushBytes, log->lastWriteUs, log->worstWriteUs,
+                  (unsigned)log->used, log->drops);
+  }
+  Serial.printf("[CLOUD] status full=%lu delta=%lu resyncs=%lu seq=%lu events=%lu keepalives=%lu coalesced=%lu\n",
+                statusDelta.fulls, statusDelta.deltas, statusDelta.resyncs, (unsigned long)statusDelta.seq,
+                statusEventPushes, statusKeepalivePushes, statusCoalesced);
+  Serial.printf("[CLOUD] pushes=%lu failures=%lu drops=%lu configFetches=%lu unchanged=%lu configHeap=%lu/%luB wire=%s statusBytes=%lu serialize=%luus stackFree=%lu\n",
+                cloudStatusPushes,
+                cloudStatusFailures,
+                cloudStatusDrops,
+                cloudConfigFetches,
+                cloudConfigUnchanged,
+                (unsigned long)cloudConfigHeapLast,
+                (unsigned long)cloudConfigHeapPeak,
+                CLOUD_WIRE_MSGPACK ? "msgpack" : "json",
+                (unsigned long)cloudStatusBytes,
+                (unsigned long)cloudStatusSerializeUs,
+                cloudTaskHandle ? (unsigned long)uxTaskGetStackHighWaterMark(cloudTaskHandle) : 0UL);
+  for (size_t i = 0; i < CLOUD_MAX_HOSTS; i++) {
+    const HttpsConn &c = cloudConns[i];
+    if (c.host[0] == '\0') continue;
+    unsigned long done = c.handshakes + c.reused;
+    Serial.printf("[CLOUD] conn=%s requests=%lu handshakes=%lu reused=%lu reuse=%lu%% failures=%lu backoff=%lus\n",
+                  c.host, c.requests, c.handshakes, c.reused,
+                  done ? (c.reused * 100UL) / done : 0UL,
+                  c.failures, c.backoffMs / 1000);
+  }
+}
+
+uint32_t runtimeChecksum(const RuntimeStore &st) {
+  const uint8_t *p = (const uint8_t *)&st;
+  uint32_t h = 2166136261UL; // FNV-1a
+  for (size_t i = 0; i < offsetof(RuntimeStore, checksum); i++) h = (h ^ p[i]) * 16777619UL;
+  return h;
+}
+
+void runtimeSeal() {
+  runtimeStore.checksum = runtimeChecksum(runtimeStore);
+}
+
+void runtimePersist() {
+  runtimeSeal();
+  runtimePrefs.putBytes("store", &runtimeStore, sizeof(runtimeStore));
+  runtimeLastPersistMs = millis();
+}
+
+// RTC memory wins after a soft reset; after power loss the last NVS checkpoint is used.
+void runtimeBegin() {
+  runtimePrefs.begin("runtime", false);
+  if (runtimeStore.magic != RUNTIME_MAGIC || runtimeStore.checksum != runtimeChecksum(runtimeStore)) {
+    if (runtimePrefs.getBytes("store", &runtimeStore, sizeof(runtimeStore)) != sizeof(runtimeStore) ||
+        runtimeStore.magic != RUNTIME_MAGIC || runtimeStore.checksum != runtimeChecksum(runtimeStore)) {
+      memset(&runtimeStore, 0, sizeof(runtimeStore));
+      runtimeStore.magic = RUNTIME_MAGIC;
+    }
+  }
+  runtimeSeal();
+  runtimeLastOn = 0; // outputs are forced off at boot
+  runtimeLastTickMs = millis();
+  runtimeLastPersistMs = runtimeLastTickMs;
+}
+
+void runtimeRollDay(uint32_t day) {
+  if (runtimeStore.day != 0) {
+    for (int i = RUNTIME_DAYS - 1; i > 0; i--) {
+      runtimeStore.pastDay[i] = runtimeStore.pastDay[i - 1];
+      runtimeStore.past[i] = runtimeStore.past[i - 1];
+    }
+    runtimeStore.pastDay[0] = runtimeStore.day;
+    runtimeStore.past[0] = runtimeStore.today;
+    memset(runtimeStore.hours, 0, sizeof(runtimeStore.hours));
+    memset(&runtimeStore.today, 0, sizeof(runtimeStore.today));
+  }
+  // Counts gathered before the first NTP sync stay with the day they are assigned to.
+  runtimeStore.day = day;
+  runtimePersist();
+}
+
+// Called after every control pass: time since the previous tick belongs to the outputs
+// as they were then; an off->on change counts one cycle.
+void runtimeTick() {
+  unsigned long now = millis();
+  unsigned long elapsed = now - runtimeLastTickMs;
+  runtimeLastTickMs = now;
+  struct tm lt;
+  if (getLocalTime(&lt, 0)) {
+    uint32_t day = (uint32_t)(lt.tm_year + 1900) * 10000UL + (uint32_t)(lt.tm_mon + 1) * 100UL + (uint32_t)lt.tm_mday;
+    if (day != runtimeStore.day) runtimeRollDay(day);
+    runtimeHour = (uint8_t)lt.tm_hour;
+  }
+  bool on[3] = {heatOn, coolOn, fanOn};
+  uint8_t mask = 0;
+  RuntimeCounters &hour = runtimeStore.hours[runtimeHour];
+  for (int k = 0; k < 3; k++) {
+    if (runtimeLastOn & (1 << k)) {
+      runtimeCarryMs[k] += elapsed;
+      uint32_t sec = runtimeCarryMs[k] / 1000;
+      runtimeCarryMs[k] %= 1000;
+      hour.sec[k] += sec;
+      runtimeStore.today.sec[k] += sec;
+    }
+    if (on[k]) {
+      mask |= (1 << k);
+      if (!(runtimeLastOn & (1 << k))) {
+        hour.cycles[k]++;
+        runtimeStore.today.cycles[k]++;
+      }
+    }
+  }
+  runtimeLastOn = mask;
+  if (now - runtimeLastPersistMs >= RUNTIME_PERSIST_MS) runtimePersist();
+  else runtimeSeal();
+}
+
+void runtimeCountersJson(JsonWriter &w, const char *key, const RuntimeCounters &c) {
+  static const char *keys[3][3] = {
+    {"heat_s", "heat_cycles", "heat_avg_cycle_s"},
+    {"cool_s", "cool_cycles", "cool_avg_cycle_s"},
+    {"fan_s", "fan_cycles", "fan_avg_cycle_s"},
+  };
+  jwObject(w, key);
+  for (int k = 0; k < 3; k++) {
+    jwUint(w, keys[k][0], c.sec[k]);
+    jwUint(w, keys[k][1], c.cycles[k]);
+    jwUint(w, keys[k][2], c.cycles[k] ? c.sec[k] / c.cycles[k] : 0UL);
+  }
+  jwEndObject(w);
+}
+
+// Runtime counters: today's totals, today's 24 hours and the last RUNTIME_DAYS days.
+void handleRuntimeData(AsyncWebServerRequest *req) {
+  JsonWriter w;
+  JsonSlot *slot = jsonBegin(req, w);
+  if (!slot) return;
+  jwObject(w);
+  jwUint(w, "day", runtimeStore.day);
+  jwUint(w, "hour", runtimeHour);
+  runtimeCountersJson(w, "today", runtimeStore.today);
+  jwArray(w, "hours");
+  for (int h = 0; h < 24; h++) runtimeCountersJson(w, nullptr, runtimeStore.hours[h]);
+  jwEndArray(w);
+  jwArray(w, "days");
+  for (int i = 0; i < RUNTIME_DAYS; i++) {
+    if (runtimeStore.pastDay[i] == 0) continue;
+    jwObject(w);
+    jwUint(w, "day", runtimeStore.pastDay[i]);
+    runtimeCountersJson(w, "counters", runtimeStore.past[i]);
+    jwEndObject(w);
+  }
+  jwEndArray(w);
+  jwEndObject(w);
+  jsonSend(req, slot, w);
 }
 
 void markConfigDirty() {
   configDirty = true;
+  configStoreMark();
+}
+
+uint32_t configStoreChecksum(const ConfigStore &st) {
+  return esp_rom_crc32_le(0, (const uint8_t *)&st, offsetof(ConfigStore, crc));
 }
 
+// Called first thing in setup(): NVS reads take well under a millisecond, so the schedule
+// and setpoint are back before the sensor, Wi-Fi or SD are touched.
+void configStoreLoad() {
+  configPrefs.begin("config", false);
+  ConfigStore st;
+  if (configPrefs.getBytes("store", &st, sizeof(st)) != sizeof(st) ||
+      st.magic != CONFIG_STORE_MAGIC || st.version != CONFIG_STORE_VERSION || st.size != sizeof(st) ||
+      st.crc != configStoreChecksum(st)) {
+    if (configPrefs.isKey("store")) Serial.println("[CONFIG] stored config invalid; using defaults");
+    return;
+  }
+  configStoreCrc = st.crc;
+  setpointF = constrain(st.cfg.setpointF, 40.0f, 90.0f);
+  diffF = constrain(st.cfg.diffF, 0.1f, 10.0f);
+  st.cfg.mode[sizeof(st.cfg.mode) - 1] = '\0';
+  mode = String(st.cfg.mode);
+  memcpy(scheduleSP, st.cfg.schedule, sizeof(scheduleSP));
+  tzOffsetSec = st.tzOffsetSec;
+  dstOffsetSec = st.dstOffsetSec;
+  // The fan timer is not resumed: without the clock there is no telling how much is left.
+  Serial.printf("[CONFIG] restored mode=%s set=%.1f diff=%.1f\n", mode.c_str(), setpointF, diffF);
+}
+
+void configStoreMark() {
+  configStoreDirtyMs = millis() | 1;
+}
+
+// Runs from the storage job once edits have been quiet for CONFIG_SAVE_DELAY_MS; a record
+// identical to the one in NVS is not rewritten.
+void configStoreService() {
+  if (configStoreDirtyMs == 0 || millis() - configStoreDirtyMs < CONFIG_SAVE_DELAY_MS) return;
+  configStoreDirtyMs = 0;
+  ConfigStore st;
+  memset(&st, 0, sizeof(st));
+  st.magic = CONFIG_STORE_MAGIC;
+  st.version = CONFIG_STORE_VERSION;
+  st.size = sizeof(st);
+  captureConfig(st.cfg);
+  st.cfg.fanUntil = 0;
+  st.tzOffsetSec = tzOffsetSec;
+  st.dstOffsetSec = dstOffsetSec;
+  st.crc = configStoreChecksum(st);
+  if (st.crc == configStoreCrc) return;
+  if (configPrefs.putBytes("store", &st, sizeof(st)) != sizeof(st)) {
+    Serial.println("[CONFIG] NVS write failed");
+    return;
+  }
+  configStoreCrc = st.crc;
+  configStoreWrites++;
+}
+
+// Main-task side of cloud sync: applies inbound config, and hands snapshots to the
+// cloud task. Never touches the network, so it is safe to run between control passes.
 void tickCloudSync() {
+  // Consumed before the inbox: a fetch that follows a failed push returns the old server
+  // config, and must not overwrite the edit that failed to go up.
+  if (cloudConfigPushFailed.exchange(false)) configDirty = true;
+  RemoteConfig *inbound = configInbox.front();
+  if (inbound) {
+    // A local edit still on its way up wins over a config fetched before it landed.
+    if (!configDirty && configOutbox.empty()) applyRemoteConfig(*inbound);
+    // Dropped, so the cloud task must not answer the next fetch from its revision.
+    else cloudConfigRevReset.store(true);
+    configInbox.pop();
+  }
+
   if (!wifiConnected) return;
   if (THERMOSTAT_DEVICE_TOKEN_STR[0] == '\0') return;
   unsigned long now = millis();
+  bool wake = false;
 
   if (configDirty && ((lastConfigPush == 0) || (now - lastConfigPush >= CONFIG_PUSH_INTERVAL_MS))) {
-    if (pushThermostatConfig()) {
+    ConfigSnapshot cfg;
+    captureConfig(cfg);
+    if (configOutbox.push(cfg)) {
       configDirty = false;
       lastConfigPush = now;
+      wake = true;
     }
   }
 
   if ((lastConfigFetch == 0) || (now - lastConfigFetch >= CONFIG_FETCH_INTERVAL_MS)) {
-    if (fetchThermostatConfig()) {
-      lastConfigFetch = now;
-    }
+    cloudFetchRequested.store(true);
+    lastConfigFetch = now;
+    wake = true;
+  }
+
+  uploadQueueService();
+  // After an outage the backlog drains one full batch at a time as soon as the previous
+  // one is acknowledged; a few fresh points just ride along with the next push.
+  bool catchUp = !uploadPending && statusRing.empty() && uploadLastBatchFull && uploadQueueBacklog();
+
+  StatusTrigger trig;
+  statusTriggerCapture(trig);
+  bool event = !statusTriggerEqual(trig, statusTriggerSent);
+  if (event && !statusTriggerEqual(statusTriggerSeen, statusTriggerSent) && !statusTriggerEqual(trig, statusTriggerSeen)) {
+    statusCoalesced++;
   }
+  statusTriggerSeen = trig;
+  bool eventDue = event && (now - lastCloudPush >= STATUS_EVENT_SPACING_MS);
+  bool keepalive = (lastCloudPush == 0) || (now - lastCloudPush >= STATUS_KEEPALIVE_MS);
 
-  if ((lastCloudPush == 0) || (now - lastCloudPush >= CLOUD_PUSH_INTERVAL_MS)) {
-    bool includeHistory = historyDirty;
-    if (pushThermostatStatus(includeHistory)) {
+  if (catchUp || eventDue || keepalive) {
+    StatusSnapshot snap;
+    captureStatus(snap);
+    uint32_t endOffset = 0;
+    if (!uploadPending) uploadQueueFillBatch(snap, endOffset);
+    if (statusRing.push(snap)) {
       lastCloudPush = now;
-      if (includeHistory) historyDirty = false;
+      statusTriggerSent = trig;
+      if (eventDue) statusEventPushes++;
+      else if (keepalive) statusKeepalivePushes++;
+      uploadLastBatchFull = snap.historyCount == UPLOAD_BATCH_MAX;
+      if (snap.historyCount > 0) {
+        uploadPending = true;
+        uploadPendingLastTs = snap.history[snap.historyCount - 1].ts;
+        uploadPendingEndOffset = endOffset;
+      }
+      wake = true;
+    } else {
+      cloudStatusDrops++;
     }
   }
+
+  if (wake && cloudTaskHandle) xTaskNotifyGive(cloudTaskHandle);
 }
 
-bool pushThermostatStatus(bool includeHistory) {
-  WiFiClientSecure client;
-  client.setInsecure();
-  HTTPClient http;
-  if (!http.begin(client, THERMOSTAT_INGEST_ENDPOINT)) return false;
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("X-Device-Token", THERMOSTAT_DEVICE_TOKEN_STR);
+void statusTriggerCapture(StatusTrigger &t) {
+  memset(&t, 0, sizeof(t));
+  t.heat = heatOn;
+  t.cool = coolOn;
+  t.fan = fanOn;
+  t.sensorOk = (millis() - lastRead) < 5000 && !isnan(lastTempF) && !isnan(lastHumidity);
+  t.controlOk = !isnan(controlTempF);
+  t.sdOk = sdReady;
+  t.set10 = eventTenths(setpointF);
+  strlcpy(t.mode, mode.c_str(), sizeof(t.mode));
+}
+
+bool statusTriggerEqual(const StatusTrigger &a, const StatusTrigger &b) {
+  return a.heat == b.heat && a.cool == b.cool && a.fan == b.fan && a.sensorOk == b.sensorOk &&
+         a.controlOk == b.controlOk && a.sdOk == b.sdOk && a.set10 == b.set10 && strcmp(a.mode, b.mode) == 0;
+}
 
-  DynamicJsonDocument doc(2048);
+void captureStatus(StatusSnapshot &snap) {
+  memset(&snap, 0, sizeof(snap));
   uint32_t ts = (uint32_t)time(nullptr);
   if (ts == 0) ts = millis() / 1000;
-  doc["deviceId"] = THERMOSTAT_DEVICE_ID_STR;
-  doc["ts"] = ts;
-  if (!isnan(lastTempF)) doc["tempF"] = lastTempF;
-  if (!isnan(lastHumidity)) doc["humidity"] = lastHumidity;
-  if (!isnan(lastHeatIndexF)) doc["heatIndexF"] = lastHeatIndexF;
-  doc["setpointF"] = setpointF;
-  doc["diffF"] = diffF;
-  doc["mode"] = mode;
-  doc["heatOn"] = heatOn;
-  doc["coolOn"] = coolOn;
-  doc["fanOn"] = fanOn;
-  doc["fanUntil"] = fanUntilEpoch;
-  doc["ssid"] = WiFi.SSID();
-  doc["rssi"] = WiFi.RSSI();
-  doc["ip"] = wifiIpStr;
-  doc["uptimeSec"] = millis() / 1000;
-  bool sensorOk = (millis() - lastRead) < 5000 && !isnan(lastTempF) && !isnan(lastHumidity);
-  doc["sensorOk"] = sensorOk;
-  doc["sdOk"] = sdReady;
-  if (!lastSdWriteOk && lastSdError) doc["sdError"] = lastSdError;
-
-  bool scheduled = false;
-  float scheduledSp = NAN;
+  snap.ts = ts;
+  snap.tempF = lastTempF;
+  snap.humidity = lastHumidity;
+  snap.heatIndexF = lastHeatIndexF;
+  snap.setpointF = setpointF;
+  snap.diffF = diffF;
+  strlcpy(snap.mode, mode.c_str(), sizeof(snap.mode));
+  snap.heatOn = heatOn;
+  snap.coolOn = coolOn;
+  snap.fanOn = fanOn;
+  snap.fanUntil = fanUntilEpoch;
+  strlcpy(snap.ssid, WiFi.SSID().c_str(), sizeof(snap.ssid));
+  snap.rssi = WiFi.RSSI();
+  strlcpy(snap.ip, wifiIpStr.c_str(), sizeof(snap.ip));
+  snap.uptimeSec = millis() / 1000;
+  snap.sensorOk = (millis() - lastRead) < 5000 && !isnan(lastTempF) && !isnan(lastHumidity);
+  snap.sdOk = sdReady;
+  if (!lastSdWriteOk && lastSdError) strlcpy(snap.sdError, lastSdError, sizeof(snap.sdError));
+
+  snap.scheduleActive = false;
+  snap.scheduleSetpoint = NAN;
   struct tm timeinfo;
-  if (getLocalTime(&timeinfo)) {
+  if (getLocalTime(&timeinfo, 0)) {
     int d = timeinfo.tm_wday;
     int h = timeinfo.tm_hour;
     if (d >= 0 && d < 7 && h >= 0 && h < 24) {
       float sp = scheduleSP[d][h];
       if (!isnan(sp) && !overrideUntilNextSchedule) {
-        scheduled = true;
-        scheduledSp = sp;
+        snap.scheduleActive = true;
+        snap.scheduleSetpoint = sp;
+      }
+    }
+  }
+  snap.overrideActive = overrideUntilNextSchedule;
+
+  snap.runtimeDay = runtimeStore.day;
+  snap.runtimeToday = runtimeStore.today;
+  memcpy(snap.runtimeHours, runtimeStore.hours, sizeof(snap.runtimeHours));
+  snap.runtimePastDay = runtimeStore.pastDay[0];
+  snap.runtimePast = runtimeStore.past[0];
+
+  snap.historyCount = 0;
+}
+
+void uploadQueueBegin() {
+  uploadPrefs.begin("upload", false);
+  uploadAckTs = uploadPrefs.getUInt("ackTs", 0);
+  uploadPersistedAckTs = uploadAckTs;
+  uploadQueueScanWal();
+}
+
+// Rebuilds the WAL cursor from the file (at boot and after a remount); records still
+// buffered in walLog count as queued.
+void uploadQueueScanWal() {
+  uploadWalOffset = 0;
+  uploadWalSize = walLog.used;
+  if (!sdReady) return;
+  File f = SD.open(UPLOAD_WAL_PATH, FILE_READ);
+  if (!f) return;
+  uploadWalSize += f.size() - (f.size() % sizeof(HistoryPoint));
+  // Skip records the server already has; the WAL is compacted often enough that a scan is cheap.
+  HistoryPoint rec;
+  while (uploadWalOffset < uploadWalSize && f.read((uint8_t *)&rec, sizeof(rec)) == sizeof(rec)) {
+    if (rec.ts > uploadAckTs) break;
+    uploadWalOffset += sizeof(rec);
+  }
+  f.close();
+  if (DEBUG_SERIAL) {
+    Serial.printf("[UPLOAD] WAL size=%lu pending=%lu ackTs=%lu\n",
+                  (unsigned long)uploadWalSize,
+                  (unsigned long)((uploadWalSize - uploadWalOffset) / sizeof(HistoryPoint)),
+                  (unsigned long)uploadAckTs);
+  }
+}
+
+void uploadQueueAppend(const HistoryPoint &point) {
+  if (point.ts < UPLOAD_MIN_VALID_TS) return;
+  if (sdLogAppend(walLog, &point, sizeof(point), point.ts)) uploadWalSize += sizeof(point);
+}
+
+bool uploadQueueBacklog() {
+  if (sdReady) return uploadWalOffset < uploadWalSize;
+  return histCount > 0 && histTsAt(histCount - 1) > uploadAckTs && histTsAt(histCount - 1) >= UPLOAD_MIN_VALID_TS;
+}
+
+// Copies up to UPLOAD_BATCH_MAX unacknowledged points into the snapshot.
+// endOffset receives the WAL offset just past the batch (unused for the RAM source).
+void uploadQueueFillBatch(StatusSnapshot &snap, uint32_t &endOffset) {
+  snap.historyCount = 0;
+  endOffset = uploadWalOffset;
+  if (sdReady) {
+    if (uploadWalOffset >= uploadWalSize) return;
+    // The WAL is the file followed by walLog's unflushed tail. Read the flushed part and
+    // copy the rest from RAM, so a batch never forces a partial-sector write.
+    size_t want = min((size_t)UPLOAD_BATCH_MAX, (size_t)((uploadWalSize - uploadWalOffset) / sizeof(HistoryPoint)));
+    uint8_t *out = (uint8_t *)snap.history;
+    size_t bytes = want * sizeof(HistoryPoint);
+    uint32_t flushedEnd = uploadWalSize - walLog.used;
+    size_t got = 0;
+    if (uploadWalOffset < flushedEnd) {
+      File f = SD.open(UPLOAD_WAL_PATH, FILE_READ);
+      if (!f) return;
+      size_t fromFile = min(bytes, (size_t)(flushedEnd - uploadWalOffset));
+      if (f.seek(uploadWalOffset)) got = f.read(out, fromFile);
+      f.close();
+      if (got != fromFile) {
+        got -= got % sizeof(HistoryPoint);
+        bytes = got;
+      }
+    }
+    if (got < bytes) {
+      size_t bufPos = uploadWalOffset + got - flushedEnd;
+      size_t n = min(bytes - got, walLog.used - bufPos);
+      memcpy(out + got, walLog.buf + bufPos, n);
+      got += n;
+    }
+    snap.historyCount = (uint8_t)(got / sizeof(HistoryPoint));
+    endOffset = uploadWalOffset + snap.historyCount * sizeof(HistoryPoint);
+    return;
+  }
+  for (int i = histLowerBound(max(uploadAckTs + 1, UPLOAD_MIN_VALID_TS)); i < histCount && snap.historyCount < UPLOAD_BATCH_MAX; i++) {
+    int idx = histRingIndex(i);
+    snap.history[snap.historyCount++] = {histTsAt(i), histTemp10[idx], histSet10[idx]};
+  }
+}
+
+// Applies acknowledgements from the cloud task, persists the cursor and compacts the WAL.
+void uploadQueueService() {
+  uint32_t acked = cloudBatchAckTs.exchange(0);
+  if (uploadPending && acked != 0) {
+    // A short ack leaves the cursor alone; the batch is resent and the server merges by ts.
+    if (acked >= uploadPendingLastTs) {
+      uploadAckTs = max(uploadAckTs, acked);
+      uploadWalOffset = max(uploadWalOffset, uploadPendingEndOffset);
+    }
+    uploadPending = false;
+  }
+  if (sdReady && !uploadPending && uploadWalOffset >= uploadWalSize && uploadWalSize >= UPLOAD_WAL_COMPACT_BYTES) {
+    sdLogClose(walLog);
+    if (SD.remove(UPLOAD_WAL_PATH)) {
+      uploadWalOffset = 0;
+      uploadWalSize = 0;
+    }
+  }
+  unsigned long now = millis();
+  if (uploadAckTs != uploadPersistedAckTs && (now - uploadLastPersistMs >= UPLOAD_ACK_PERSIST_MS || uploadLastPersistMs == 0)) {
+    uploadPrefs.putUInt("ackTs", uploadAckTs);
+    uploadPersistedAckTs = uploadAckTs;
+    uploadLastPersistMs = now;
+  }
+}
+
+void captureConfig(ConfigSnapshot &cfg) {
+  cfg.setpointF = setpointF;
+  cfg.diffF = diffF;
+  strlcpy(cfg.mode, mode.c_str(), sizeof(cfg.mode));
+  cfg.fanUntil = fanUntilEpoch;
+  memcpy(cfg.schedule, scheduleSP, sizeof(cfg.schedule));
+}
+
+// Cloud task: owns every HTTPS request. Pinned to the core opposite the Arduino loop
+// and woken by tickCloudSync(); failed work is retried after CLOUD_RETRY_MS.
+void cloudTask(void *param) {
+  static RemoteConfig fetched; // too large for the task stack
+  // Revision of the last config handed to the main task; sent as If-None-Match so an
+  // unchanged config comes back as an empty 304 instead of a body to parse.
+  static char configRev[24] = "";
+  unsigned long nextFetchMs = 0;
+  unsigned long nextStatusMs = 0;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+    if (WiFi.status() != WL_CONNECTED) continue;
+    unsigned long now = millis();
+
+    ConfigSnapshot *cfg = configOutbox.front();
+    if (cfg) {
+      // On failure hand the change back so the next snapshot carries the latest values,
+      // and hold off fetching until it has landed.
+      if (!pushThermostatConfig(*cfg)) {
+        cloudConfigPushFailed.store(true);
+        nextFetchMs = now + CLOUD_RETRY_MS;
+      }
+      configOutbox.pop();
+    }
+
+    if (cloudConfigRevReset.exchange(false)) configRev[0] = '\0';
+    if (cloudFetchRequested.load() && (long)(now - nextFetchMs) >= 0) {
+      char rev[sizeof(configRev)];
+      ConfigFetch result = fetchThermostatConfig(fetched, rev, sizeof(rev));
+      if (result == FETCH_FAILED) {
+        nextFetchMs = now + CLOUD_RETRY_MS;
+      } else {
+        cloudFetchRequested.store(false);
+        cloudConfigFetches++;
+        if (result == FETCH_UNCHANGED) {
+          cloudConfigUnchanged++;
+        } else if (configInbox.push(fetched)) {
+          strlcpy(configRev, rev, sizeof(configRev));
+        } else {
+          // The main task has not consumed the previous config yet; refetch in full next time.
+          configRev[0] = '\0';
+        }
       }
     }
+
+    StatusSnapshot *snap = statusRing.front();
+    while (snap && (long)(millis() - nextStatusMs) >= 0) {
+      if (!pushThermostatStatus(*snap)) {
+        cloudStatusFailures++;
+        nextStatusMs = millis() + CLOUD_RETRY_MS;
+        break;
+      }
+      statusRing.pop();
+      cloudStatusPushes++;
+      snap = statusRing.front();
+    }
+  }
+}
+
+void startCloudTask() {
+  xTaskCreatePinnedToCore(cloudTask, "cloud", CLOUD_TASK_STACK, nullptr, 1, &cloudTaskHandle, CLOUD_TASK_CORE);
+}
+
+// Splits "https://host/path?query" into host and path (path points into url).
+bool splitHttpsUrl(const char *url, char *host, size_t hostCap, const char *&path) {
+  const char *p = strstr(url, "://");
+  if (!p) return false;
+  p += 3;
+  const char *slash = strchr(p, '/');
+  size_t n = slash ? (size_t)(slash - p) : strlen(p);
+  if (n == 0 || n >= hostCap) return false;
+  memcpy(host, p, n);
+  host[n] = '\0';
+  path = slash ? slash : "/";
+  return true;
+}
+
+// Returns the host's connection ready for a request, reusing its keep-alive socket when
+// it is still open. Returns nullptr while the host is backing off after a failure.
+// Cloud task only; pair every successful call with cloudFinish().
+HttpsConn *cloudBegin(const char *url) {
+  char host[sizeof(cloudConns[0].host)];
+  const char *path;
+  if (!splitHttpsUrl(url, host, sizeof(host), path)) return nullptr;
+
+  HttpsConn *conn = nullptr;
+  for (size_t i = 0; i < CLOUD_MAX_HOSTS && !conn; i++) {
+    if (strcmp(cloudConns[i].host, host) == 0) conn = &cloudConns[i];
+  }
+  for (size_t i = 0; i < CLOUD_MAX_HOSTS && !conn; i++) {
+    if (cloudConns[i].host[0] == '\0') {
+      conn = &cloudConns[i];
+      strlcpy(conn->host, host, sizeof(conn->host));
+      conn->client.setInsecure();
+      conn->client.setHandshakeTimeout(CLOUD_HANDSHAKE_TIMEOUT_S);
+      conn->http.setReuse(true);
+      conn->http.setTimeout(CLOUD_HTTP_TIMEOUT_MS);
+      conn->http.setConnectTimeout(CLOUD_HTTP_TIMEOUT_MS);
+    }
+  }
+  if (!conn) return nullptr;
+  if ((long)(millis() - conn->nextAttemptMs) < 0) return nullptr;
+
+  conn->warm = conn->open && conn->client.connected();
+  bool ok = conn->warm ? conn->http.setURL(path) : conn->http.begin(conn->client, url);
+  conn->open = ok;
+  return ok ? conn : nullptr;
+}
+
+// Ends the request; keeps the socket when the server allowed keep-alive, otherwise
+// drops it and backs off exponentially before the next attempt to this host.
+void cloudFinish(HttpsConn *conn, int code) {
+  conn->http.end();
+  conn->requests++;
+  if (code > 0) {
+    if (conn->warm) conn->reused++;
+    else conn->handshakes++;
+    conn->backoffMs = 0;
+    return;
+  }
+  conn->failures++;
+  conn->client.stop();
+  conn->open = false;
+  conn->backoffMs = conn->backoffMs ? min(conn->backoffMs * 2, CLOUD_BACKOFF_MAX_MS) : CLOUD_BACKOFF_MIN_MS;
+  conn->nextAttemptMs = millis() + conn->backoffMs;
+  if (DEBUG_SERIAL) {
+    Serial.printf("[CLOUD] %s request failed (%s); retry in %lus\n",
+                  conn->host, HTTPClient::errorToString(code).c_str(), conn->backoffMs / 1000);
+  }
+}
+
+void addRuntimeJson(JsonObject obj, uint32_t day, const RuntimeCounters &c) {
+  if (day != 0) obj["day"] = day;
+  obj["heatSec"] = c.sec[RT_HEAT];
+  obj["coolSec"] = c.sec[RT_COOL];
+  obj["fanSec"] = c.sec[RT_FAN];
+  obj["heatCycles"] = c.cycles[RT_HEAT];
+  obj["coolCycles"] = c.cycles[RT_COOL];
+  obj["fanCycles"] = c.cycles[RT_FAN];
+}
+
+// Content-Type for bodies we send and Accept for replies, both in the CLOUD_WIRE_MSGPACK
+// format; the functions answer JSON to anything that doesn't ask for msgpack.
+void cloudWireHeaders(HTTPClient &http, bool hasBody) {
+  if (hasBody) http.addHeader("Content-Type", CLOUD_WIRE_TYPE);
+  http.addHeader("Accept", CLOUD_WIRE_TYPE);
+}
+
+// Serializes doc in the wire format into an exactly sized buffer. msgpack bodies hold
+// NUL bytes, which Arduino String would truncate. Returns 0 if the allocation fails.
+size_t cloudSerialize(JsonDocument &doc, std::unique_ptr<uint8_t[]> &out) {
+  size_t len = CLOUD_WIRE_MSGPACK ? measureMsgPack(doc) : measureJson(doc);
+  out.reset(new (std::nothrow) uint8_t[len + 1]);
+  if (!out) return 0;
+  return CLOUD_WIRE_MSGPACK ? serializeMsgPack(doc, out.get(), len + 1) : serializeJson(doc, out.get(), len + 1);
+}
+
+// Nullable reading compared at the 0.1 resolution the portal shows. In a delta a reading
+// that went away is sent as an explicit null; a full push just leaves it out.
+void statusFloat(JsonDocument &doc, const char *key, float v, const float *prev) {
+  if (prev && eventTenths(v) == eventTenths(*prev)) return;
+  if (!isnan(v)) doc[key] = v;
+  else if (prev) doc[key] = nullptr;
+}
+
+bool runtimeEqual(const RuntimeCounters &a, const RuntimeCounters &b) {
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// Adds the status fields of snap that differ from base, or all of them when base is null.
+// Returns whether rssi went out, since small RSSI changes are held back.
+bool addStatusFields(JsonDocument &doc, const StatusSnapshot &snap, const StatusSnapshot *base) {
+  const StatusSnapshot *b = base;
+  statusFloat(doc, "tempF", snap.tempF, b ? &b->tempF : nullptr);
+  statusFloat(doc, "humidity", snap.humidity, b ? &b->humidity : nullptr);
+  statusFloat(doc, "heatIndexF", snap.heatIndexF, b ? &b->heatIndexF : nullptr);
+  statusFloat(doc, "setpointF", snap.setpointF, b ? &b->setpointF : nullptr);
+  statusFloat(doc, "diffF", snap.diffF, b ? &b->diffF : nullptr);
+  if (!b || strcmp(snap.mode, b->mode) != 0) doc["mode"] = snap.mode;
+  if (!b || snap.heatOn != b->heatOn) doc["heatOn"] = snap.heatOn;
+  if (!b || snap.coolOn != b->coolOn) doc["coolOn"] = snap.coolOn;
+  if (!b || snap.fanOn != b->fanOn) doc["fanOn"] = snap.fanOn;
+  if (!b || snap.fanUntil != b->fanUntil) doc["fanUntil"] = snap.fanUntil;
+  if (!b || strcmp(snap.ssid, b->ssid) != 0) doc["ssid"] = snap.ssid;
+  bool rssiSent = !b || abs(snap.rssi - b->rssi) >= STATUS_RSSI_DELTA_DB;
+  if (rssiSent) doc["rssi"] = snap.rssi;
+  if (!b || strcmp(snap.ip, b->ip) != 0) doc["ip"] = snap.ip;
+  // Deltas leave uptime out; the server advances it by the ts difference.
+  if (!b) doc["uptimeSec"] = snap.uptimeSec;
+  if (!b || snap.sensorOk != b->sensorOk) doc["sensorOk"] = snap.sensorOk;
+  if (!b || snap.sdOk != b->sdOk) doc["sdOk"] = snap.sdOk;
+  if (!b) {
+    if (snap.sdError[0]) doc["sdError"] = snap.sdError;
+  } else if (strcmp(snap.sdError, b->sdError) != 0) {
+    if (snap.sdError[0]) doc["sdError"] = snap.sdError;
+    else doc["sdError"] = nullptr;
+  }
+  if (!b || snap.scheduleActive != b->scheduleActive) doc["scheduleActive"] = snap.scheduleActive;
+  statusFloat(doc, "scheduleSetpoint", snap.scheduleSetpoint, b ? &b->scheduleSetpoint : nullptr);
+  if (!b || snap.overrideActive != b->overrideActive) doc["overrideActive"] = snap.overrideActive;
+
+  // Runtime documents are merged per hour on the server, so a delta carries today's totals
+  // and only the hours that moved.
+  bool dayChanged = !b || snap.runtimeDay != b->runtimeDay;
+  if (snap.runtimeDay != 0 && (dayChanged || !runtimeEqual(snap.runtimeToday, b->runtimeToday) ||
+                               snap.runtimePastDay != b->runtimePastDay || !runtimeEqual(snap.runtimePast, b->runtimePast))) {
+    JsonObject runtime = doc["runtime"].to<JsonObject>();
+    addRuntimeJson(runtime, snap.runtimeDay, snap.runtimeToday);
+    JsonArray hours = runtime["hours"].to<JsonArray>();
+    for (int h = 0; h < 24; h++) {
+      const RuntimeCounters &c = snap.runtimeHours[h];
+      if (!c.sec[RT_HEAT] && !c.sec[RT_COOL] && !c.sec[RT_FAN] && !c.cycles[RT_HEAT] && !c.cycles[RT_COOL] && !c.cycles[RT_FAN]) continue;
+      if (!dayChanged && runtimeEqual(c, b->runtimeHours[h])) continue;
+      JsonObject hour = hours.add<JsonObject>();
+      hour["hour"] = h;
+      addRuntimeJson(hour, 0, c);
+    }
+    if (snap.runtimePastDay != 0 &&
+        (!b || snap.runtimePastDay != b->runtimePastDay || !runtimeEqual(snap.runtimePast, b->runtimePast))) {
+      JsonObject past = runtime["previous"].to<JsonObject>();
+      addRuntimeJson(past, snap.runtimePastDay, snap.runtimePast);
+    }
   }
-  doc["scheduleActive"] = scheduled;
-  if (!isnan(scheduledSp)) doc["scheduleSetpoint"] = scheduledSp;
-  doc["overrideActive"] = overrideUntilNextSchedule;
+  return rssiSent;
+}
 
-  if (includeHistory && lastHistTs > 0) {
-    JsonArray history = doc.createNestedArray("history");
-    JsonObject point = history.createNestedObject();
-    point["ts"] = lastHistTs;
-    if (!isnan(lastHistCtl)) point["tempF"] = lastHistCtl;
-    if (!isnan(lastHistSetpoint)) point["setpointF"] = lastHistSetpoint;
+bool pushThermostatStatus(const StatusSnapshot &snap) {
+  StatusDelta &sd = statusDelta;
+  bool full = !sd.valid || sd.resync || sd.sinceFull >= STATUS_FULL_EVERY;
+  uint32_t seq = ++sd.seq;
+  JsonDocument doc;
+  doc["deviceId"] = THERMOSTAT_DEVICE_ID_STR;
+  doc["ts"] = snap.ts;
+  doc["seq"] = seq;
+  if (!full) doc["base"] = sd.ackedSeq;
+  bool rssiSent = addStatusFields(doc, snap, full ? nullptr : &sd.acked);
+
+  if (snap.historyCount > 0) {
+    JsonArray history = doc["history"].to<JsonArray>();
+    for (uint8_t i = 0; i < snap.historyCount; i++) {
+      const HistoryPoint &p = snap.history[i];
+      JsonObject point = history.add<JsonObject>();
+      point["ts"] = p.ts;
+      if (p.temp10 != HIST_NA) point["tempF"] = p.temp10 / 10.0f;
+      if (p.set10 != HIST_NA) point["setpointF"] = p.set10 / 10.0f;
+    }
   }
 
-  String payload;
-  serializeJson(doc, payload);
-  int code = http.POST(payload);
-  http.end();
+  unsigned long serStart = micros();
+  std::unique_ptr<uint8_t[]> payload;
+  size_t payloadLen = cloudSerialize(doc, payload);
+  cloudStatusSerializeUs = micros() - serStart;
+  cloudStatusBytes = payloadLen;
+  doc.clear();
+  if (payloadLen == 0) return false;
+
+  HttpsConn *conn = cloudBegin(THERMOSTAT_INGEST_ENDPOINT);
+  if (!conn) return false;
+  HTTPClient &http = conn->http;
+  cloudWireHeaders(http, true);
+  http.addHeader("X-Device-Token", THERMOSTAT_DEVICE_TOKEN_STR);
+  int code = http.POST(payload.get(), payloadLen);
+  String response;
+  if (code > 0) response = http.getString(); // drain so the socket can be reused
+  cloudFinish(conn, code);
   if (code < 200 || code >= 300) {
     if (DEBUG_SERIAL) Serial.printf("[CLOUD] Status push failed: %d\n", code);
     return false;
   }
+  JsonDocument ack;
+  DeserializationError err = CLOUD_WIRE_MSGPACK ? deserializeMsgPack(ack, response) : deserializeJson(ack, response);
+  if (snap.historyCount > 0) {
+    // Older functions deployments do not return ackTs; a 2xx still means the batch was stored.
+    uint32_t ackTs = snap.history[snap.historyCount - 1].ts;
+    if (!err) ackTs = ack["ackTs"] | ackTs;
+    cloudBatchAckTs.store(ackTs);
+  }
+
+  // Deployments that predate deltas never echo seq; keep sending full pushes to them.
+  bool merged = !err && (ack["seq"] | 0UL) == seq;
+  bool resync = !merged || (ack["resync"] | false);
+  int32_t keptRssi = sd.acked.rssi;
+  sd.acked = snap;
+  sd.acked.historyCount = 0;
+  if (!full && !rssiSent) sd.acked.rssi = keptRssi;
+  sd.ackedSeq = seq;
+  sd.valid = true;
+  if (full) {
+    sd.fulls++;
+    sd.sinceFull = 0;
+  } else {
+    sd.deltas++;
+    sd.sinceFull++;
+  }
+  if (resync && !sd.resync && merged) sd.resyncs++;
+  sd.resync = resync;
   return true;
 }
 
-bool fetchThermostatConfig() {
-  WiFiClientSecure client;
-  client.setInsecure();
-  HTTPClient http;
+// Samples how much heap a config sync is holding relative to `base`; called at the
+// point where the document is fully built, which is the high-water mark of the sync.
+void noteConfigHeap(uint32_t base) {
+  uint32_t now = ESP.getFreeHeap();
+  uint32_t used = base > now ? base - now : 0;
+  cloudConfigHeapLast = used;
+  if (used > cloudConfigHeapPeak) cloudConfigHeapPeak = used;
+}
+
+// rev holds the revision last applied ("" for none) and receives the new one on
+// FETCH_CHANGED. A 304 costs no body read and no parse.
+ConfigFetch fetchThermostatConfig(RemoteConfig &out, char *rev, size_t revLen) {
   String url = String(THERMOSTAT_CONFIG_ENDPOINT) + "?deviceId=" + THERMOSTAT_DEVICE_ID_STR;
-  if (!http.begin(client, url)) return false;
+  HttpsConn *conn = cloudBegin(url.c_str());
+  if (!conn) return FETCH_FAILED;
+  HTTPClient &http = conn->http;
+  static const char *headerKeys[] = {"ETag"};
+  http.collectHeaders(headerKeys, 1);
+  cloudWireHeaders(http, false);
   http.addHeader("X-Device-Token", THERMOSTAT_DEVICE_TOKEN_STR);
+  if (rev[0]) http.addHeader("If-None-Match", String("\"") + rev + "\"");
   int code = http.GET();
+  if (code == HTTP_CODE_NOT_MODIFIED) {
+    cloudFinish(conn, code);
+    return FETCH_UNCHANGED;
+  }
   if (code != 200) {
+    cloudFinish(conn, code);
     if (DEBUG_SERIAL) Serial.printf("[CLOUD] Config fetch failed: %d\n", code);
-    http.end();
-    return false;
+    return FETCH_FAILED;
   }
-  String payload = http.getString();
-  http.end();
+  String etag = http.header("ETag");
 
-  DynamicJsonDocument doc(12288);
-  DeserializationError err = deserializeJson(doc, payload);
+  // Parse straight off the socket and keep only the fields parseRemoteConfig reads, so
+  // the body is never buffered and deviceId/serverTime/rev never reach the document.
+  uint32_t heapBase = ESP.getFreeHeap();
+  JsonDocument filter;
+  JsonObject keep = filter["config"].to<JsonObject>();
+  keep["setpointF"] = true;
+  keep["diffF"] = true;
+  keep["mode"] = true;
+  keep["fanUntil"] = true;
+  keep["schedule"] = true;
+  JsonDocument doc;
+  DeserializationError err;
+  if (http.getSize() >= 0) {
+    Stream &body = http.getStream();
+    err = CLOUD_WIRE_MSGPACK ? deserializeMsgPack(doc, body, DeserializationOption::Filter(filter))
+                             : deserializeJson(doc, body, DeserializationOption::Filter(filter));
+  } else {
+    // Chunked replies carry framing in the stream; fall back to a buffered read.
+    String body = http.getString();
+    err = CLOUD_WIRE_MSGPACK ? deserializeMsgPack(doc, body, DeserializationOption::Filter(filter))
+                             : deserializeJson(doc, body, DeserializationOption::Filter(filter));
+  }
+  noteConfigHeap(heapBase);
+  cloudFinish(conn, code);
   if (err) {
     if (DEBUG_SERIAL) Serial.printf("[CLOUD] Config parse error: %s\n", err.c_str());
-    return false;
+    return FETCH_FAILED;
   }
   JsonObject config = doc["config"];
-  if (config.isNull()) return false;
-  applyRemoteConfig(config);
-  return true;
+  if (config.isNull()) return FETCH_FAILED;
+  parseRemoteConfig(config, out);
+  etag.replace("W/", "");
+  etag.replace("\"", "");
+  strlcpy(rev, etag.c_str(), revLen);
+  return FETCH_CHANGED;
 }
 
-bool pushThermostatConfig() {
-  WiFiClientSecure client;
-  client.setInsecure();
-  HTTPClient http;
-  if (!http.begin(client, THERMOSTAT_CONFIG_ENDPOINT)) return false;
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("X-Device-Token", THERMOSTAT_DEVICE_TOKEN_STR);
+// Copies the JSON config into a fixed struct so it can cross to the main task.
+void parseRemoteConfig(JsonObject config, RemoteConfig &out) {
+  out.hasSetpoint = config["setpointF"].is<float>();
+  out.setpointF = config["setpointF"] | 0.0f;
+  out.hasDiff = config["diffF"].is<float>();
+  out.diffF = config["diffF"] | 0.0f;
+  const char *m = config["mode"];
+  out.hasMode = (m != nullptr);
+  strlcpy(out.mode, m ? m : "", sizeof(out.mode));
+  out.hasFanUntil = !config["fanUntil"].isNull();
+  out.fanUntil = (uint32_t)(config["fanUntil"] | 0UL);
+  out.hasSchedule = false;
+  out.scheduleDayMask = 0;
+  if (config["schedule"].is<JsonArray>()) {
+    JsonArray days = config["schedule"].as<JsonArray>();
+    if (!days.isNull()) {
+      out.hasSchedule = true;
+      for (int d = 0; d < 7; d++) {
+        JsonArray hours = days[d].as<JsonArray>();
+        if (hours.isNull()) continue;
+        out.scheduleDayMask |= (1 << d);
+        for (int h = 0; h < 24; h++) {
+          JsonVariant v = hours[h];
+          out.schedule[d][h] = v.isNull() ? NAN : v.as<float>();
+        }
+      }
+    }
+  }
+}
 
-  DynamicJsonDocument doc(12288);
+bool pushThermostatConfig(const ConfigSnapshot &cfgSnap) {
+  uint32_t heapBase = ESP.getFreeHeap();
+  JsonDocument doc;
   doc["deviceId"] = THERMOSTAT_DEVICE_ID_STR;
-  JsonObject cfg = doc.createNestedObject("config");
-  cfg["setpointF"] = setpointF;
-  cfg["diffF"] = diffF;
-  cfg["mode"] = mode;
-  cfg["fanUntil"] = fanUntilEpoch;
-  JsonArray schedule = cfg.createNestedArray("schedule");
+  JsonObject cfg = doc["config"].to<JsonObject>();
+  cfg["setpointF"] = cfgSnap.setpointF;
+  cfg["diffF"] = cfgSnap.diffF;
+  cfg["mode"] = cfgSnap.mode;
+  cfg["fanUntil"] = cfgSnap.fanUntil;
+  JsonArray schedule = cfg["schedule"].to<JsonArray>();
   for (int d = 0; d < 7; d++) {
-    JsonArray day = schedule.createNestedArray();
+    JsonArray day = schedule.add<JsonArray>();
     for (int h = 0; h < 24; h++) {
-      float sp = scheduleSP[d][h];
+      float sp = cfgSnap.schedule[d][h];
       if (isnan(sp)) day.add(nullptr);
       else day.add(sp);
     }
   }
 
-  String payload;
-  serializeJson(doc, payload);
-  int code = http.POST(payload);
-  http.end();
+  std::unique_ptr<uint8_t[]> payload;
+  size_t payloadLen = cloudSerialize(doc, payload);
+  noteConfigHeap(heapBase);
+  doc.clear();
+  if (payloadLen == 0) return false;
+
+  HttpsConn *conn = cloudBegin(THERMOSTAT_CONFIG_ENDPOINT);
+  if (!conn) return false;
+  HTTPClient &http = conn->http;
+  cloudWireHeaders(http, true);
+  http.addHeader("X-Device-Token", THERMOSTAT_DEVICE_TOKEN_STR);
+  int code = http.POST(payload.get(), payloadLen);
+  if (code > 0) http.getString();
+  cloudFinish(conn, code);
   if (code < 200 || code >= 300) {
     if (DEBUG_SERIAL) Serial.printf("[CLOUD] Config push failed: %d\n", code);
     return false;
@@ -1405,59 +4611,61 @@ bool pushThermostatConfig() {
   return true;
 }
 
-void applyRemoteConfig(JsonObject config) {
-  bool changed = false;
-  float sp = config["setpointF"] | setpointF;
-  sp = constrain(sp, 40.0f, 90.0f);
-  if (fabs(sp - setpointF) > 0.01f) {
-    setpointF = sp;
-    changed = true;
+void applyRemoteConfig(const RemoteConfig &config) {
+  bool changed = false;          // setpoint/mode changes also start a manual override
+  bool settingsChanged = false;  // fan timer and schedule only need persisting
+  if (config.hasSetpoint) {
+    float sp = constrain(config.setpointF, 40.0f, 90.0f);
+    if (fabs(sp - setpointF) > 0.01f) {
+      setpointF = sp;
+      changed = true;
+    }
   }
 
-  float diff = config["diffF"] | diffF;
-  diff = constrain(diff, 0.1f, 10.0f);
-  if (fabs(diff - diffF) > 0.01f) {
-    diffF = diff;
-    changed = true;
+  if (config.hasDiff) {
+    float diff = constrain(config.diffF, 0.1f, 10.0f);
+    if (fabs(diff - diffF) > 0.01f) {
+      diffF = diff;
+      changed = true;
+    }
   }
 
-  const char* m = config["mode"];
-  if (m && mode != String(m)) {
-    mode = String(m);
+  if (config.hasMode && mode != String(config.mode)) {
+    mode = String(config.mode);
     changed = true;
   }
 
-  if (config.containsKey("fanUntil")) {
-    uint32_t remoteFanUntil = (uint32_t)(config["fanUntil"] | 0UL);
+  if (config.hasFanUntil) {
+    uint32_t remoteFanUntil = config.fanUntil;
     uint32_t nowEpoch = (uint32_t)time(nullptr);
-    if (remoteFanUntil == 0) {
+    if (remoteFanUntil == fanUntilEpoch) {
+      // unchanged; leave the running timer alone
+    } else if (remoteFanUntil == 0) {
       fanUntilEpoch = 0;
       fanRunUntil = 0;
+      settingsChanged = true;
     } else if (nowEpoch > 0 && remoteFanUntil >= nowEpoch) {
       fanUntilEpoch = remoteFanUntil;
+      settingsChanged = true;
       fanRunUntil = millis() + (unsigned long)(remoteFanUntil - nowEpoch) * 1000UL;
     }
   }
 
-  if (config.containsKey("schedule")) {
-    JsonArray days = config["schedule"].as<JsonArray>();
-    if (!days.isNull()) {
-      for (int d = 0; d < 7; d++) {
-        JsonArray hours = days[d].as<JsonArray>();
-        for (int h = 0; h < 24; h++) {
-          if (hours.isNull()) continue;
-          JsonVariant v = hours[h];
-          if (v.isNull()) scheduleSP[d][h] = NAN;
-          else scheduleSP[d][h] = v.as<float>();
-        }
-      }
+  if (config.hasSchedule) {
+    for (int d = 0; d < 7; d++) {
+      if (!(config.scheduleDayMask & (1 << d))) continue;
+      if (memcmp(scheduleSP[d], config.schedule[d], sizeof(scheduleSP[d])) == 0) continue;
+      memcpy(scheduleSP[d], config.schedule[d], sizeof(scheduleSP[d]));
+      settingsChanged = true;
     }
   }
 
+  // Only real changes reach NVS; a re-sent identical config costs nothing.
+  if (changed || settingsChanged) configStoreMark();
   if (changed) {
     overrideUntilNextSchedule = true;
     struct tm timeinfo;
-    if (getLocalTime(&timeinfo)) {
+    if (getLocalTime(&timeinfo, 0)) {
       overrideStartHour = timeinfo.tm_hour;
       lastScheduleHour = overrideStartHour;
     } else {
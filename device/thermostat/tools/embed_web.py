@@ -0,0 +1,94 @@
+"""Embed web/ assets into the firmware as gzip'd PROGMEM arrays.
+
+Runs as a PlatformIO pre-script (see platformio.ini) and can also be run by
+hand: `python tools/embed_web.py`. Each file under web/ becomes a WebAsset
+entry in include/web_assets.h with a content-hash ETag, so the device can
+answer conditional requests with 304 and only ship bytes when a page changes.
+"""
+
+import gzip
+import hashlib
+import os
+
+TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".svg": "image/svg+xml",
+    ".ico": "image/x-icon",
+}
+
+
+def project_dir():
+    try:
+        Import("env")  # noqa: F821 - provided by PlatformIO/SCons
+        return env["PROJECT_DIR"]  # noqa: F821
+    except NameError:
+        return os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def symbol(name):
+    return "WEB_" + "".join(c if c.isalnum() else "_" for c in name).upper()
+
+
+def render(web_dir):
+    entries = []
+    out = [
+        "// Generated by tools/embed_web.py from web/. Do not edit.",
+        "#pragma once",
+        "#include <Arduino.h>",
+        "",
+        "struct WebAsset {",
+        "  const char *path;",
+        "  const char *type;",
+        "  const char *etag;",
+        "  const uint8_t *data;",
+        "  size_t len;",
+        "};",
+        "",
+    ]
+    for name in sorted(os.listdir(web_dir)):
+        ext = os.path.splitext(name)[1].lower()
+        if ext not in TYPES:
+            continue
+        with open(os.path.join(web_dir, name), "rb") as f:
+            raw = f.read()
+        # mtime=0 keeps the output stable so unchanged pages keep their ETag.
+        data = gzip.compress(raw, compresslevel=9, mtime=0)
+        etag = '"%s"' % hashlib.sha1(raw).hexdigest()[:16]
+        sym = symbol(name)
+        out.append("// %s: %d bytes, %d gzip" % (name, len(raw), len(data)))
+        out.append("const uint8_t %s[] PROGMEM = {" % sym)
+        for i in range(0, len(data), 16):
+            out.append("  " + ",".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+        out.append("};")
+        out.append("")
+        path = "/" + os.path.splitext(name)[0] if ext == ".html" else "/" + name
+        entries.append((path, TYPES[ext], etag, sym))
+    out.append("const WebAsset WEB_ASSETS[] = {")
+    for path, mime, etag, sym in entries:
+        out.append('  {"%s", "%s", "%s", %s, sizeof(%s)},'
+                   % (path, mime, etag.replace('"', '\\"'), sym, sym))
+    out.append("};")
+    out.append("const size_t WEB_ASSET_COUNT = sizeof(WEB_ASSETS) / sizeof(WEB_ASSETS[0]);")
+    out.append("")
+    return "\n".join(out)
+
+
+def main():
+    root = project_dir()
+    text = render(os.path.join(root, "web"))
+    target = os.path.join(root, "include", "web_assets.h")
+    try:
+        with open(target, "r") as f:
+            if f.read() == text:
+                return
+    except OSError:
+        pass
+    # Only rewrite on change so the build doesn't recompile main.cpp every time.
+    with open(target, "w") as f:
+        f.write(text)
+    print("embed_web: wrote %s" % target)
+
+
+main()
@@ -0,0 +1,70 @@
+"""Record the thermostat's heap counters over a soak, for before/after comparisons.
+
+Polls /system_status_data and appends one CSV row per sample with uptime and the
+`heap` block (free, min_free, largest_block, frag_pct). Run it against one build,
+flash the other, run it again, and compare the two summaries it prints:
+
+    python tools/heap_soak.py 192.168.1.50 --hours 24 --out heap-baseline.csv
+"""
+
+import argparse
+import csv
+import json
+import os
+import sys
+import time
+import urllib.request
+
+FIELDS = ["free", "min_free", "largest_block", "frag_pct"]
+
+
+def sample(host, timeout):
+    with urllib.request.urlopen(f"http://{host}/system_status_data", timeout=timeout) as r:
+        heap = json.load(r).get("heap", {})
+    return [heap.get(k) for k in FIELDS]
+
+
+def summarize(rows):
+    if not rows:
+        return "no samples"
+    first, last = rows[0], rows[-1]
+    lines = [f"{len(rows)} samples over {(last[0] - first[0]) / 3600:.1f} h"]
+    for i, name in enumerate(FIELDS, start=1):
+        vals = [r[i] for r in rows if r[i] is not None]
+        if vals:
+            lines.append(f"  {name:14} first={vals[0]} last={vals[-1]} min={min(vals)} max={max(vals)}")
+    return "\n".join(lines)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("host", help="device address, e.g. 192.168.1.50")
+    ap.add_argument("--hours", type=float, default=24.0)
+    ap.add_argument("--interval", type=float, default=60.0, help="seconds between samples")
+    ap.add_argument("--out", default="heap-soak.csv")
+    args = ap.parse_args()
+
+    rows = []
+    end = time.time() + args.hours * 3600
+    new = not os.path.exists(args.out)
+    with open(args.out, "a", newline="") as f:
+        w = csv.writer(f)
+        if new:
+            w.writerow(["epoch"] + FIELDS)
+        try:
+            while time.time() < end:
+                try:
+                    row = [int(time.time())] + sample(args.host, timeout=10)
+                    w.writerow(row)
+                    f.flush()
+                    rows.append(row)
+                except (OSError, ValueError) as e:
+                    print(f"sample failed: {e}", file=sys.stderr)
+                time.sleep(args.interval)
+        except KeyboardInterrupt:
+            pass
+    print(summarize(rows))
+
+
+if __name__ == "__main__":
+    main()
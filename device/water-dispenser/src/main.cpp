@@ -2,6 +2,7 @@
 #include <Wire.h>
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
+#include <DirtyOled.h>
 #include <EEPROM.h>
 #include <string.h>
 
@@ -16,7 +17,8 @@ const uint8_t PIN_RELAY   = 12;
 // -------- Display --------
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
-Adafruit_SSD1306 oled(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, -1);
+const uint32_t OLED_I2C_HZ = 1000000; // Fast-mode Plus; use 400000 if the panel garbles
+DirtyOled oled(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, -1, OLED_I2C_HZ); // sends only changed spans
 const uint8_t OLED_ADDR = 0x3C; // change to 0x3D if needed
 
 // -------- Timing / Behavior --------